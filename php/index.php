@@ -19,39 +19,62 @@ function process_post_request() {
 
     $asm_contents = $_POST['assembly'];
 
-    # Write the input to a temporary file
-    $temp = tmpfile();
-    $meta_data = stream_get_meta_data($temp);
-    $asm_file = $meta_data['uri'];
-    fwrite($temp, $asm_contents);
+    # Assemble! The source is piped to stdin, the object records come back on
+    # stdout and the listing on file descriptor 3
+    $descriptors = array(
+        0 => array('pipe', 'r'),
+        1 => array('pipe', 'w'),
+        2 => array('pipe', 'w'),
+        3 => array('pipe', 'w'),
+    );
+
+    $proc = proc_open(SICASM_PATH.' --listing-fd 3 -o - -', $descriptors, $pipes);
+    if (!is_resource($proc)) {
+        $error_msg = 'Failed to run the assembler';
+        return false;
+    }
+
+    fwrite($pipes[0], $asm_contents);
+    fclose($pipes[0]);
+
+    # Read all outputs at once so that a full pipe cannot block the assembler
+    $outputs = array(1 => '', 2 => '', 3 => '');
+    $open = array(1 => $pipes[1], 2 => $pipes[2], 3 => $pipes[3]);
+    while (!empty($open)) {
+        $read = array_values($open);
+        $write = null;
+        $except = null;
+        if (stream_select($read, $write, $except, null) === false) {
+            break;
+        }
+
+        foreach ($open as $fd => $pipe) {
+            if (!in_array($pipe, $read, true)) {
+                continue;
+            }
 
-    # Generated files
-    $lst_file = $asm_file.'.lst';
-    $obj_file = $asm_file.'.obj';
+            $data = fread($pipe, 8192);
+            if ($data === false || ($data === '' && feof($pipe))) {
+                fclose($pipe);
+                unset($open[$fd]);
+            } else {
+                $outputs[$fd] .= $data;
+            }
+        }
+    }
 
-    # Assemble!
-    exec(SICASM_PATH.' '
-            .escapeshellarg($asm_file).' 2>&1', $output, $exit_code);
+    $exit_code = proc_close($proc);
 
     if ($exit_code != 0) {
-        $error_msg = implode("\n", $output);
+        $error_msg = $outputs[2];
         $ret = false;
     } else {
         # Output
-        $lst_contents = file_get_contents($lst_file);
-        $obj_contents = file_get_contents($obj_file);
+        $lst_contents = $outputs[3];
+        $obj_contents = $outputs[1];
         $ret = true;
     }
 
-    # Close file handles and delete temporary files
-    fclose($temp);
-    if (file_exists($lst_file)) {
-        unlink($lst_file);
-    }
-    if (file_exists($obj_file)) {
-        unlink($obj_file);
-    }
-
     return $ret;
 }
 
@@ -1,7 +1,11 @@
 #include "assembler.h"
 
 #include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <stdarg.h>
@@ -11,7 +15,44 @@
 #include <sstream>
 
 #include <algorithm>
+#include <thread>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "binaryobject.h"
+#include "encoding.h"
+#include "linetable.h"
+#include "memoryimage.h"
+#include "parallel.h"
+
+
+// Symbol table entry of a symbol that is not defined in a section
+static const unsigned int NoAddress = ~0u;
+
+// Text records hold up to 30 bytes, 60 hex digits
+static const std::size_t MaxTextRecordBytes = 30;
+
+// Number of source lines formatted by one worker when writing the listing
+static const std::size_t ListingChunkLines = 4096;
+
+// Batches in flight between the reader thread and pass 1, and the amount of
+// text read for each
+static const std::size_t PipelineBatches = 8;
+static const std::size_t PipelineBatchBytes = 256 * 1024;
+
+// Lines between checks for cancellation and the time limit
+static const std::size_t InterruptCheckLines = 256;
+
+// Milliseconds between checks for cancellation and the time limit while the
+// input is read or pass 1 waits for a batch. The cancellation token cannot
+// wake up the wait.
+static const int InterruptCheckMs = 10;
+
+// Name of standard input in diagnostics
+static const char StdinName[] = "<stdin>";
 
 static bool strtolWrap(const char *str, int base, int *out)
 {
@@ -35,502 +76,2654 @@ static bool strtoulWrap(const char *str, int base, unsigned int *out)
     return true;
 }
 
+static std::string stripExtension(const std::string &path,
+                                  const std::string &ext)
+{
+    if (path.size() >= ext.size()
+            && path.compare(path.size() - ext.size(), ext.size(), ext) == 0) {
+        return path.substr(0, path.size() - ext.size());
+    }
+
+    return path;
+}
+
+/* Read a whole stream into the buffer of a previous file. With a limit,
+ * reading stops once the text is longer than it. */
+static bool readText(std::istream &in, std::string *text, std::size_t limit)
+{
+    char buf[65536];
+
+    text->clear();
+    while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+        text->append(buf, in.gcount());
+        if (limit != 0 && text->size() > limit) {
+            break;
+        }
+    }
+
+    return !in.bad();
+}
+
+// Escape a file name for a Make rule
+static std::string makeEscape(const std::string &path)
+{
+    std::string result;
+    for (char c : path) {
+        if (c == ' ' || c == '#') {
+            result += '\\';
+        } else if (c == '$') {
+            result += '$';
+        }
+        result += c;
+    }
+    return result;
+}
+
+Assembler::Options::Options()
+    : binaryObject(false)
+    , image(false)
+    , lineTable(false)
+    , listing(true)
+    , listingFd(-1)
+    , pipeline(false)
+    , printDiagnostics(true)
+    , displacementWarnings(false)
+    , maxInputSize(0)
+    , maxLines(0)
+    , maxOutputSize(0)
+    , timeLimitMs(0)
+    , addressSpace(1u << 20)
+    , cancel(nullptr)
+    , removeUnused(false)
+{
+}
+
 Assembler::Assembler()
+    : m_inputPos(0)
+    , m_skipDepth(0)
+    , m_batches(PipelineBatches)
+    , m_batch(nullptr)
+    , m_stopReader(false)
+    , m_stopPipe{ -1, -1 }
+    , m_maxLineLength(0)
+    , m_located(false)
+    , m_inputSize(0)
+    , m_outputSize(0)
+    , m_stopped(false)
 {
 }
 
 Assembler::~Assembler()
 {
-    for (auto *asmLine : m_lines) {
+    reset();
+
+    for (auto *asmLine : m_freeLines) {
         delete asmLine;
     }
+
+    for (auto *section : m_freeSections) {
+        delete section;
+    }
+}
+
+/* Forget the previous program so that the next assembleFile() starts from a
+ * clean state. The options are kept. Lines and sections are moved to free
+ * lists instead of being deleted, and the containers keep their capacity, so
+ * an Assembler that is reused for many programs stops allocating once it has
+ * seen the largest one. */
+void Assembler::reset()
+{
+    m_freeLines.insert(m_freeLines.end(), m_lines.begin(), m_lines.end());
+    m_lines.clear();
+
+    m_freeSections.insert(m_freeSections.end(), m_sections.begin(),
+                          m_sections.end());
+    m_sections.clear();
+
+    // Included files stay cached for the next program
+    m_files.clear();
+    m_input.clear();
+    m_inputPos = 0;
+    m_conditions.clear();
+    m_skipDepth = 0;
+    m_symbols.clear();
+    m_entry.clear();
+    m_error.clear();
+    m_maxLineLength = 0;
+    m_located = false;
+    m_diagnostics.clear();
+
+    // The time limit runs from here, as every program starts with a reset
+    m_deadline = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(m_options.timeLimitMs);
+    m_inputSize = 0;
+    m_outputSize = 0;
+    m_stopped = false;
+}
+
+/* Take a line from the free list, or allocate one */
+Assembler::ASMLine * Assembler::newLine()
+{
+    ASMLine *asmLine;
+    if (m_freeLines.empty()) {
+        asmLine = new ASMLine();
+    } else {
+        asmLine = m_freeLines.back();
+        m_freeLines.pop_back();
+    }
+
+    asmLine->file = 0;
+    asmLine->lineNumber = 0;
+    asmLine->line.clear();
+    asmLine->location = 0;
+    asmLine->locationNext = 0;
+    asmLine->block = 0;
+    asmLine->label = SymbolPool::None;
+    asmLine->operand = SymbolPool::None;
+    asmLine->instr.clear();
+    asmLine->info = nullptr;
+    asmLine->params.clear();
+    asmLine->objectCode = 0;
+    asmLine->listLocation = false;
+    asmLine->removed = false;
+
+    return asmLine;
+}
+
+/* Take a section from the free list, or allocate one */
+Assembler::Section * Assembler::newSection()
+{
+    if (m_freeSections.empty()) {
+        return new Section();
+    }
+
+    Section *section = m_freeSections.back();
+    m_freeSections.pop_back();
+
+    section->name.clear();
+    section->start = 0;
+    section->loc = 0;
+    section->blocks.clear();
+    section->lines.clear();
+    section->symbols.clear();
+    section->extDefs.clear();
+    section->extRefs.clear();
+    section->mods.clear();
+    section->error.clear();
+    section->diagnostics.clear();
+    section->encoded = false;
+    section->stats.clear();
+
+    return section;
+}
+
+void Assembler::setOptions(const Options &options)
+{
+    m_options = options;
 }
 
 __attribute__((format(printf, 3, 4)))
 void Assembler::error(ASMLine *asmLine, const char *fmt, ...)
 {
-    // Filename and line number
-    if (asmLine) {
-        std::fprintf(stderr, "%s:%u: ", m_path.c_str(), asmLine->lineNumber);
-    }
+    va_list ap;
+    va_start(ap, fmt);
+    Diagnostic diagnostic = asmLine
+            ? makeDiagnostic(Diagnostic::Error, asmLine->file,
+                             asmLine->lineNumber, &asmLine->line, fmt, ap)
+            : makeDiagnostic(Diagnostic::Error, 0, 0, nullptr, fmt, ap);
+    va_end(ap);
+
+    report(diagnostic);
+}
+
+/* Errors found while expanding includes, before lines are parsed */
+__attribute__((format(printf, 3, 4)))
+void Assembler::sourceError(const SourceLine &source, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    Diagnostic diagnostic = makeDiagnostic(Diagnostic::Error, source.file,
+                                           source.lineNumber, source.line,
+                                           fmt, ap);
+    va_end(ap);
+
+    report(diagnostic);
+}
 
-    std::fprintf(stderr, "error: ");
+/* Errors raised while sections are being encoded in parallel are buffered in
+ * the section and reported in section order afterwards */
+__attribute__((format(printf, 4, 5)))
+void Assembler::sectionError(Section *section, ASMLine *asmLine,
+                             const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    section->diagnostics.push_back(
+            makeDiagnostic(Diagnostic::Error, asmLine->file,
+                           asmLine->lineNumber, &asmLine->line, fmt, ap));
+    va_end(ap);
+}
 
+__attribute__((format(printf, 4, 5)))
+void Assembler::sectionWarning(Section *section, ASMLine *asmLine,
+                               const char *fmt, ...)
+{
     va_list ap;
     va_start(ap, fmt);
-    std::vfprintf(stderr, fmt, ap);
+    section->diagnostics.push_back(
+            makeDiagnostic(Diagnostic::Warning, asmLine->file,
+                           asmLine->lineNumber, &asmLine->line, fmt, ap));
     va_end(ap);
-    std::fprintf(stderr, "\n");
+}
 
-    if (asmLine) {
-        std::fprintf(stderr, "    %s\n", asmLine->line.c_str());
+/* Without a source line, a diagnostic has no location */
+Assembler::Diagnostic Assembler::makeDiagnostic(Diagnostic::Severity severity,
+                                                unsigned int file,
+                                                unsigned int lineNumber,
+                                                const std::string *line,
+                                                const char *fmt, va_list ap)
+{
+    Diagnostic diagnostic;
+    diagnostic.severity = severity;
+    diagnostic.file = line ? file : 0;
+    diagnostic.lineNumber = line ? lineNumber : 0;
+
+    va_list apCopy;
+    va_copy(apCopy, ap);
+    int size = std::vsnprintf(nullptr, 0, fmt, apCopy);
+    va_end(apCopy);
+
+    if (size > 0) {
+        std::vector<char> buf(size + 1);
+        std::vsnprintf(buf.data(), buf.size(), fmt, ap);
+        diagnostic.message.assign(buf.data(), size);
+    }
+
+    if (line) {
+        diagnostic.line = *line;
     }
+
+    return diagnostic;
 }
 
-bool Assembler::assembleFile(const std::string &path)
+std::string Assembler::formatDiagnostic(const Diagnostic &diagnostic)
 {
-    std::ifstream file(path);
-    if (!file.is_open()) {
-        return false;
+    std::string msg;
+
+    // Filename and line number
+    if (diagnostic.lineNumber != 0) {
+        msg += m_files[diagnostic.file];
+        msg += ":";
+        msg += std::to_string(diagnostic.lineNumber);
+        msg += ": ";
     }
 
-    m_path = path;
+    msg += diagnostic.severity == Diagnostic::Warning ? "warning: " : "error: ";
+    msg += diagnostic.message;
+    msg += "\n";
 
-    std::vector<std::string> lines;
-    std::string line;
-    while (std::getline(file, line)) {
-        if (!line.empty() && *line.crbegin() == '\r') {
-            line.erase(line.end() - 1);
-        }
-        lines.push_back(line);
+    if (diagnostic.lineNumber != 0) {
+        msg += "    ";
+        msg += diagnostic.line;
+        msg += "\n";
     }
 
-    file.close();
+    return msg;
+}
 
-    if (!pass1(lines)) {
-        return false;
+void Assembler::report(const Diagnostic &diagnostic)
+{
+    if (m_options.printDiagnostics) {
+        std::fputs(formatDiagnostic(diagnostic).c_str(), stderr);
     }
+    m_diagnostics.push_back(diagnostic);
+}
 
-    if (!pass2()) {
-        return false;
+/* Why the program has to stop, if it has been cancelled or is out of time.
+ * This is safe to call from the pass 2 workers. */
+const char * Assembler::interruption() const
+{
+    if (m_options.cancel && m_options.cancel->isCancelled()) {
+        return "Assembly cancelled";
     }
 
-    std::string lstPath;
-    std::string objPath;
-    if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".asm") == 0) {
-        lstPath = path.substr(0, path.size() - 4) + ".lst";
-        objPath = path.substr(0, path.size() - 4) + ".obj";
-    } else {
-        lstPath = path + ".lst";
-        objPath = path + ".obj";
+    if (m_options.timeLimitMs != 0
+            && std::chrono::steady_clock::now() >= m_deadline) {
+        return "Time limit exceeded";
     }
 
-    if (!writeOutput(lstPath, objPath)) {
-        return false;
+    return nullptr;
+}
+
+/* Check for an interruption, and report it the first time */
+bool Assembler::shouldStop()
+{
+    if (m_stopped) {
+        return true;
     }
 
-    return true;
+    const char *reason = interruption();
+    if (reason) {
+        error(nullptr, "%s", reason);
+        m_stopped = true;
+    }
+
+    return m_stopped;
 }
 
-bool Assembler::pass1(const std::vector<std::string> &lines)
+/* Count source text towards the input size limit */
+bool Assembler::addInput(std::size_t bytes)
 {
-    m_loc = 0;
-    m_name.clear();
+    m_inputSize += bytes;
+    return m_options.maxInputSize == 0
+        || m_inputSize <= m_options.maxInputSize;
+}
 
-    int lineNumber = 0;
+/* Count bytes about to be written towards the output size limit, and report
+ * when it is reached. Writers stop at the next check, and the file they were
+ * writing is removed, so that an incomplete output is not left behind. */
+bool Assembler::addOutput(std::size_t bytes)
+{
+    if (m_stopped) {
+        return false;
+    }
 
-    for (auto const &line : lines) {
-        ++lineNumber;
+    m_outputSize += bytes;
+    if (m_options.maxOutputSize != 0
+            && m_outputSize > m_options.maxOutputSize) {
+        error(nullptr, "Output larger than the limit of %zu bytes",
+              m_options.maxOutputSize);
+        m_stopped = true;
+        return false;
+    }
 
-        std::vector<std::string> tokens;
-        splitString(&tokens, line, " \t");
+    return true;
+}
 
-        if (tokens.empty()) {
-            // Skip empty lines
-            continue;
+/* Assemble a source file, or standard input if the path is "-". Any state
+ * from a previous call is reset first. */
+bool Assembler::assembleFile(const std::string &path)
+{
+    reset();
+
+    std::ifstream file;
+    // Standard input and the input of the pipelined reader are polled
+    // through a descriptor, so that a stalled input can be stopped
+    int fd = STDIN_FILENO;
+
+    if (path == "-") {
+        m_files.push_back(StdinName);
+    } else if (m_options.pipeline) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error(nullptr, "%s: %s", path.c_str(), std::strerror(errno));
+            return false;
+        }
+        m_files.push_back(path);
+    } else {
+        file.open(path);
+        if (!file.is_open()) {
+            error(nullptr, "%s: %s", path.c_str(), std::strerror(errno));
+            return false;
         }
+        m_files.push_back(path);
+    }
 
-        if (tokens[0][0] == '.' || tokens[0][0] == ';') {
-            // Skip comment lines
-            continue;
+    if (m_options.pipeline) {
+        bool ok = pass1Pipelined(fd);
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+        if (!ok) {
+            return false;
+        }
+    } else {
+        if (path == "-") {
+            if (!readInput(fd, &m_text, m_options.maxInputSize)) {
+                return false;
+            }
+        } else if (!readText(file, &m_text, m_options.maxInputSize)) {
+            error(nullptr, "%s: Read failed", m_files[0].c_str());
+            return false;
         }
 
-        ASMLine *asmLine = new ASMLine();
-        m_lines.push_back(asmLine);
-        asmLine->line = line;
-        asmLine->lineNumber = lineNumber;
+        if (!addInput(m_text.size())) {
+            error(nullptr, "%s: Input larger than the limit of %zu bytes",
+                  m_files[0].c_str(), m_options.maxInputSize);
+            return false;
+        }
 
-        std::string label;
-        std::string instr;
-        int paramIndex;
+        m_scanner.split(m_text, &m_main.lines, &m_main.tokens);
 
-        if (m_instrs.isValid(tokens[0])) {
-            // First token is instruction and there's no label
-            instr = tokens[0];
-            paramIndex = 1;
-        } else if (tokens.size() >= 2 && m_instrs.isValid(tokens[1])) {
-            // First token is label, second token is instruction
-            label = tokens[0];
-            instr = tokens[1];
-            paramIndex = 2;
-        } else {
-            error(asmLine, "Invalid instruction %s", tokens[0].c_str());
+        std::vector<unsigned int> stack;
+        if (!expandIncludes(0, m_main, 1, &stack)) {
             return false;
         }
 
-        if (Instructions::getRegister(label) >= 0) {
-            error(asmLine, "Label cannot be the name of a register: %s",
-                  label.c_str());
+        if (!pass1()) {
             return false;
         }
+    }
+    file.close();
 
-        // Treat remaining tokens in the line as parameters and split them at each
-        // comma if necessary
-        for (unsigned int i = paramIndex; i < tokens.size(); ++i) {
-            if (!tokens[i].empty() && (tokens[i][0] == '.' || tokens[i][0] == ';')) {
-                break;
-            }
-
-            std::vector<std::string> commaSplit;
-            splitString(&commaSplit, tokens[i], ",");
-            if (!tokens[i].empty()) {
-                asmLine->params.insert(asmLine->params.end(),
-                                       commaSplit.begin(), commaSplit.end());
-            }
-        }
+    if (m_options.removeUnused) {
+        removeUnused();
+    }
 
-        // Replace ie. BUFFER[%RX] with BUFFER,X
-        convertIndexing(&asmLine->params);
+    if (!encodeSections()) {
+        return false;
+    }
 
-        if (Instructions::stripModifiers(instr) == Instructions::Additional_MOV) {
-            std::string newInstr;
-            std::vector<std::string> newParams;
+    // Output files are named after the object file if one was given, or
+    // after the input file. Source from standard input has no name, so its
+    // object records go to standard output.
+    std::string basePath;
+    std::string objectFile = m_options.objectFile;
+    if (!objectFile.empty() && objectFile != "-") {
+        basePath = stripExtension(objectFile, ".obj");
+    } else if (path != "-") {
+        basePath = stripExtension(path, ".asm");
+    }
 
-            bool ret = convertMovToSicXE(asmLine->params,
-                                        Instructions::isExtended(instr),
-                                        &newInstr, &newParams);
-            if (!ret) {
-                error(asmLine, "%s", m_error.c_str());
-                return false;
-            }
+    if (objectFile.empty()) {
+        objectFile = basePath.empty() ? "-" : basePath + ".obj";
+    }
 
-            instr = newInstr;
-            asmLine->params.swap(newParams);
-        } else if (Instructions::stripModifiers(instr) == Instructions::Additional_LD
-                || Instructions::stripModifiers(instr) == Instructions::Additional_ST) {
-            std::string newInstr;
-            std::vector<std::string> newParams;
+    if (m_options.binaryObject && basePath.empty()) {
+        error(nullptr, "Binary object file needs an input or output file name");
+        return false;
+    }
 
-            bool ret = convertLdStToSicXE(Instructions::stripModifiers(instr),
-                                          asmLine->params,
-                                          Instructions::isExtended(instr),
-                                          &newInstr, &newParams);
-            if (!ret) {
-                error(asmLine, "%s", m_error.c_str());
-                return false;
-            }
+    if (m_options.image && basePath.empty()) {
+        error(nullptr, "Memory image needs an input or output file name");
+        return false;
+    }
 
-            instr = newInstr;
-            asmLine->params.swap(newParams);
-        }
+    if (m_options.lineTable && basePath.empty()) {
+        error(nullptr, "Line table needs an input or output file name");
+        return false;
+    }
 
-        asmLine->label = label;
-        asmLine->instr = instr;
+    if (!m_options.depFile.empty() && objectFile == "-") {
+        error(nullptr, "Dependency file needs an object file name");
+        return false;
+    }
 
-        // Calculate locations
+    if (!writeObjectFile(objectFile)) {
+        return false;
+    }
 
-        if (instr == Instructions::Directive_START) {
-            if (asmLine->params.size() != 1) {
-                error(asmLine, "START accepts 1 argument");
+    if (m_options.listing) {
+        if (m_options.listingFd >= 0) {
+            if (!writeListingFd(m_options.listingFd)) {
                 return false;
             }
-
-            // Set initial location to the parameter (in hex)
-            if (!strtoulWrap(asmLine->params[0].c_str(), 16, &m_start)) {
-                error(asmLine, "Invalid hex address: %s",
-                      asmLine->params[0].c_str());
+        } else if (!basePath.empty()) {
+            if (!writeListingFile(basePath + ".lst")) {
                 return false;
             }
+        }
+    }
 
-            m_loc = m_start;
-            m_name = asmLine->label;
-        } else if (instr == Instructions::Directive_END) {
-            // END is unimportant
-        } else if (instr == Instructions::Directive_BASE
-                || instr == Instructions::Directive_NOBASE) {
-            // Base directives do not affect the location
-        } else if (m_instrs.isSicXE(instr)) {
-            auto *info = m_instrs[instr];
+    if (m_options.binaryObject && !writeBinaryObject(basePath + ".sxo")) {
+        return false;
+    }
 
-            // Save location and increment appropriately
-            asmLine->location = m_loc;
+    if (m_options.image && !writeImage(basePath + ".img")) {
+        return false;
+    }
 
-            switch (info->length) {
-            case Instructions::Length::One:
-                m_loc += 1;
-                break;
-            case Instructions::Length::Two:
-                m_loc += 2;
-                break;
-            case Instructions::Length::ThreeOrFour:
-                if (m_instrs.isExtended(instr)) {
-                    m_loc += 4;
-                } else {
-                    m_loc += 3;
-                }
-                break;
-            }
-        } else if (instr == Instructions::Variable_WORD) {
-            asmLine->location = m_loc;
+    if (m_options.lineTable && !writeLineTable(basePath + ".sxl")) {
+        return false;
+    }
 
-            // A word is 3 bytes
-            m_loc += 3;
-        } else if (instr == Instructions::Variable_RESW) {
-            if (asmLine->params.size() != 1) {
-                error(asmLine, "RESW accepts 1 argument");
-                return false;
-            }
+    if (!m_options.depFile.empty()
+            && !writeDepFile(m_options.depFile, objectFile)) {
+        return false;
+    }
 
-            asmLine->location = m_loc;
+    if (statsEnabled()) {
+        EncodingStats stats;
+        for (auto *section : m_sections) {
+            stats.merge(section->stats);
+        }
 
-            // An array of words is: 3 bytes * length
-            unsigned int length;
-            if (!strtoulWrap(asmLine->params[0].c_str(), 10, &length)) {
-                error(asmLine, "Invalid length: %s",
-                      asmLine->params[0].c_str());
-                return false;
+        if (!m_options.statsFile.empty()
+                && !writeStats(stats, m_options.statsFile, false)) {
+            return false;
+        }
+
+        if (!m_options.statsJsonFile.empty()
+                && !writeStats(stats, m_options.statsJsonFile, true)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Assembler::assembleText(const std::string &name, const std::string &text)
+{
+    reset();
+
+    m_files.push_back(name);
+    if (!addInput(text.size())) {
+        error(nullptr, "%s: Input larger than the limit of %zu bytes",
+              name.c_str(), m_options.maxInputSize);
+        return false;
+    }
+
+    m_scanner.split(text, &m_main.lines, &m_main.tokens);
+
+    std::vector<unsigned int> stack;
+    if (!expandIncludes(0, m_main, 1, &stack)) {
+        return false;
+    }
+
+    if (!pass1()) {
+        return false;
+    }
+
+    if (m_options.removeUnused) {
+        removeUnused();
+    }
+
+    return encodeSections();
+}
+
+const std::vector<std::string> & Assembler::sourceFiles() const
+{
+    return m_files;
+}
+
+const std::vector<Assembler::Diagnostic> & Assembler::diagnostics() const
+{
+    return m_diagnostics;
+}
+
+void Assembler::getLineInfo(std::vector<LineInfo> *out)
+{
+    out->clear();
+    if (!m_located) {
+        return;
+    }
+
+    for (auto *section : m_sections) {
+        for (ASMLine *asmLine : section->lines) {
+            out->emplace_back();
+            LineInfo &info = out->back();
+            info.file = asmLine->file;
+            info.lineNumber = asmLine->lineNumber;
+            info.address = asmLine->location;
+            info.hasAddress = asmLine->listLocation;
+            info.encoded = section->encoded;
+            if (section->encoded) {
+                getObjCodeBytes(asmLine, &info.objectCode);
+            }
+        }
+    }
+}
+
+bool Assembler::statsEnabled() const
+{
+    return !m_options.statsFile.empty() || !m_options.statsJsonFile.empty();
+}
+
+/* Return an included file split into lines and tokens. The file is only read
+ * if it is not cached yet or its size or modification time has changed. */
+const Assembler::Module * Assembler::loadModule(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        m_error = std::strerror(errno);
+        return nullptr;
+    }
+
+    Module *module = &m_modules[path];
+    if (module->loaded && module->size == st.st_size
+            && module->mtime.tv_sec == st.st_mtim.tv_sec
+            && module->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return module;
+    }
+
+    // Files that would not fit in the input size limit are not read at all
+    std::size_t limit = m_options.maxInputSize;
+    if (limit != 0 && static_cast<uint64_t>(st.st_size) > limit - m_inputSize) {
+        m_error = "Input larger than the limit of " + std::to_string(limit)
+            + " bytes";
+        return nullptr;
+    }
+
+    std::ifstream file(path);
+    if (!file.is_open() || !readText(file, &m_text, limit)) {
+        m_error = std::strerror(errno);
+        module->loaded = false;
+        return nullptr;
+    }
+
+    m_scanner.split(m_text, &module->lines, &module->tokens);
+
+    module->loaded = true;
+    module->mtime = st.st_mtim;
+    module->size = st.st_size;
+
+    return module;
+}
+
+/* Append the lines of a file to the program, replacing each INCLUDE
+ * directive with the lines of the included file and leaving out the regions
+ * of IF directives that are not assembled. The stack holds the files being
+ * expanded, to catch files that include themselves. */
+bool Assembler::expandIncludes(unsigned int file, const Module &module,
+                               unsigned int firstLine,
+                               std::vector<unsigned int> *stack)
+{
+    stack->push_back(file);
+
+    for (std::size_t i = 0; i < module.lines.size(); ++i) {
+        if (!m_conditions.empty() && !m_conditions.back().active) {
+            i = skipInactive(module, i);
+            if (i == module.lines.size()) {
+                break;
+            }
+        }
+
+        auto const &tokens = module.tokens[i];
+        SourceLine source = { &module.lines[i], &tokens, file,
+                              static_cast<unsigned int>(firstLine + i) };
+
+        if (tokens.empty()) {
+            // Skip empty lines and comment lines
+            continue;
+        }
+
+        if (tokens.size() >= 2
+                && (tokens[1] == Instructions::Directive_INCLUDE
+                    || tokens[1] == Instructions::Directive_IF
+                    || tokens[1] == Instructions::Directive_ELSE
+                    || tokens[1] == Instructions::Directive_ENDIF)) {
+            sourceError(source, "%s cannot have a label", tokens[1].c_str());
+            return false;
+        }
+
+        if (tokens[0] == Instructions::Directive_IF
+                || tokens[0] == Instructions::Directive_ELSE
+                || tokens[0] == Instructions::Directive_ENDIF) {
+            if (!conditional(source)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (tokens[0] != Instructions::Directive_INCLUDE) {
+            m_input.push_back(source);
+            continue;
+        }
+
+        std::string name;
+        if (!getIncludeName(source, &name)) {
+            return false;
+        }
+
+        // Relative names are relative to the including file
+        std::string path = name;
+        std::size_t slash = m_files[file].rfind('/');
+        if (name[0] != '/' && slash != std::string::npos) {
+            path = m_files[file].substr(0, slash + 1) + name;
+        }
+
+        unsigned int included = std::find(m_files.begin(), m_files.end(), path)
+                - m_files.begin();
+        if (std::find(stack->begin(), stack->end(), included) != stack->end()) {
+            sourceError(source, "Recursive INCLUDE of %s", path.c_str());
+            return false;
+        }
+
+        // A file included more than once is only checked for changes the
+        // first time
+        const Module *includedModule;
+        if (included == m_files.size()) {
+            includedModule = loadModule(path);
+            if (!includedModule) {
+                sourceError(source, "%s: %s", path.c_str(), m_error.c_str());
+                return false;
+            }
+            m_files.push_back(path);
+        } else {
+            includedModule = &m_modules[path];
+        }
+
+        // Every inclusion counts, as each adds the lines again
+        if (!addInput(includedModule->size)) {
+            sourceError(source, "%s: Input larger than the limit of %zu bytes",
+                        path.c_str(), m_options.maxInputSize);
+            return false;
+        }
+
+        if (!expandIncludes(included, *includedModule, 1, stack)) {
+            return false;
+        }
+    }
+
+    // The main file may still continue in the next batch in pipelined mode,
+    // so its IFs are checked at the end of the input
+    if (stack->size() > 1 && !m_conditions.empty()
+            && m_conditions.back().file == file) {
+        conditionError(m_conditions.back(), "IF without ENDIF");
+        return false;
+    }
+
+    stack->pop_back();
+    return true;
+}
+
+/* Get the file name of an INCLUDE directive. A name in double quotes may
+ * contain spaces and comment characters, so it is taken from the text of the
+ * line, as the scanner splits it into several tokens. */
+bool Assembler::getIncludeName(const SourceLine &source, std::string *out)
+{
+    auto const &tokens = *source.tokens;
+    if (tokens.size() < 2) {
+        sourceError(source, "INCLUDE accepts 1 argument");
+        return false;
+    }
+
+    if (tokens[1][0] != '"') {
+        if (tokens.size() != 2) {
+            sourceError(source, "INCLUDE accepts 1 argument");
+            return false;
+        }
+        *out = tokens[1];
+        return true;
+    }
+
+    const std::string &line = *source.line;
+    std::size_t open = line.find('"');
+    std::size_t close = line.find('"', open + 1);
+    if (close == std::string::npos) {
+        sourceError(source, "Missing closing quote in file name");
+        return false;
+    }
+
+    // Only a comment may follow the name
+    std::size_t rest = line.find_first_not_of(" \t", close + 1);
+    if (rest != std::string::npos && line[rest] != '.' && line[rest] != ';') {
+        sourceError(source, "INCLUDE accepts 1 argument");
+        return false;
+    }
+
+    *out = line.substr(open + 1, close - open - 1);
+    if (out->empty()) {
+        sourceError(source, "Invalid file name: \"\"");
+        return false;
+    }
+
+    return true;
+}
+
+/* Handle an IF, ELSE or ENDIF directive in a region that is assembled, or
+ * the ELSE or ENDIF that ends a region that is not. A condition cannot span
+ * files, so the ELSE and ENDIF must be in the file of their IF. */
+bool Assembler::conditional(const SourceLine &source)
+{
+    auto const &tokens = *source.tokens;
+    const std::string &directive = tokens[0];
+
+    if (directive == Instructions::Directive_IF) {
+        if (tokens.size() != 2) {
+            sourceError(source, "IF accepts 1 argument");
+            return false;
+        }
+
+        bool value;
+        if (!evaluateCondition(tokens[1], &value)) {
+            sourceError(source, "%s", m_error.c_str());
+            return false;
+        }
+
+        m_conditions.push_back({ source.file, source.lineNumber, *source.line,
+                                 value, value, false });
+        return true;
+    }
+
+    if (m_conditions.empty() || m_conditions.back().file != source.file) {
+        sourceError(source, "%s without IF", directive.c_str());
+        return false;
+    }
+
+    if (tokens.size() != 1) {
+        sourceError(source, "%s accepts no arguments", directive.c_str());
+        return false;
+    }
+
+    Condition &condition = m_conditions.back();
+    if (directive == Instructions::Directive_ELSE) {
+        if (condition.hasElse) {
+            sourceError(source, "ELSE after ELSE");
+            return false;
+        }
+
+        condition.hasElse = true;
+        condition.active = !condition.taken;
+        condition.taken = true;
+    } else {
+        m_conditions.pop_back();
+    }
+
+    return true;
+}
+
+/* Evaluate the operand of an IF. It is a name defined on the command line,
+ * which is true if its value is not 0, or a comparison of the value with a
+ * decimal number, ie. BUFSIZE>=4096. Names that are not defined are 0. */
+bool Assembler::evaluateCondition(const std::string &expr, bool *out)
+{
+    std::size_t end = 0;
+    while (end < expr.size()
+            && (std::isalnum(static_cast<unsigned char>(expr[end]))
+                || expr[end] == '_')) {
+        ++end;
+    }
+
+    if (end == 0 || std::isdigit(static_cast<unsigned char>(expr[0]))) {
+        m_error = "Invalid condition: " + expr;
+        return false;
+    }
+
+    auto it = m_options.definitions.find(expr.substr(0, end));
+    int value = it != m_options.definitions.end() ? it->second : 0;
+
+    if (end == expr.size()) {
+        *out = value != 0;
+        return true;
+    }
+
+    static const char *operators[] = { "<=", ">=", "<>", "=", "<", ">" };
+    std::string op;
+    for (const char *candidate : operators) {
+        if (expr.compare(end, std::strlen(candidate), candidate) == 0) {
+            op = candidate;
+            break;
+        }
+    }
+
+    int operand;
+    if (op.empty() || end + op.size() == expr.size()
+            || !strtolWrap(expr.c_str() + end + op.size(), 10, &operand)) {
+        m_error = "Invalid condition: " + expr;
+        return false;
+    }
+
+    if (op == "=") {
+        *out = value == operand;
+    } else if (op == "<>") {
+        *out = value != operand;
+    } else if (op == "<") {
+        *out = value < operand;
+    } else if (op == ">") {
+        *out = value > operand;
+    } else if (op == "<=") {
+        *out = value <= operand;
+    } else {
+        *out = value >= operand;
+    }
+
+    return true;
+}
+
+/* Skip the lines of a region that is not assembled, up to the ELSE or ENDIF
+ * that ends it. Only the first token of each line is looked at, and the lines
+ * are not parsed or checked. Nested IFs are counted in m_skipDepth, so that a
+ * region can continue in the next batch of the pipelined mode. Returns the
+ * index of the line that ends the region, or the number of lines. */
+std::size_t Assembler::skipInactive(const Module &module, std::size_t i)
+{
+    for (; i < module.lines.size(); ++i) {
+        auto const &tokens = module.tokens[i];
+        if (tokens.empty()) {
+            continue;
+        }
+
+        const std::string &first = tokens[0];
+        if (first == Instructions::Directive_IF) {
+            ++m_skipDepth;
+        } else if (first == Instructions::Directive_ENDIF) {
+            if (m_skipDepth == 0) {
+                return i;
+            }
+            --m_skipDepth;
+        } else if (first == Instructions::Directive_ELSE && m_skipDepth == 0) {
+            return i;
+        }
+    }
+
+    return i;
+}
+
+void Assembler::conditionError(const Condition &condition, const char *msg)
+{
+    SourceLine source = { &condition.line, nullptr, condition.file,
+                          condition.lineNumber };
+    sourceError(source, "%s", msg);
+}
+
+/* Reader thread of the pipelined mode. The input is read in pieces that end
+ * at a line break, and each piece is lexed into a batch of lines. */
+void Assembler::readBatches(int fd)
+{
+    // Start of a line that continues in the next piece
+    std::string rest;
+    unsigned int lineNumber = 1;
+    // Bytes read, to stop reading once the input is over the size limit
+    std::size_t total = 0;
+    std::size_t limit = m_options.maxInputSize;
+    bool eof = false;
+    bool failed = false;
+
+    for (;;) {
+        Batch *batch = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_batchMutex);
+            m_batchCond.wait(lock, [&] {
+                return (batch = m_batches.beginPush()) != nullptr ||
+                       m_stopReader.load(std::memory_order_relaxed);
+            });
+        }
+        if (batch == nullptr) {
+            return;
+        }
+
+        std::string &text = batch->text;
+        text.swap(rest);
+        rest.clear();
+
+        // Read until the piece has at least one complete line
+        std::size_t end = std::string::npos;
+        while (end == std::string::npos && !eof && !failed) {
+            if (!waitForInput(fd, -1)) {
+                return;
+            }
+
+            std::size_t size = text.size();
+            text.resize(size + PipelineBatchBytes);
+            ssize_t n = read(fd, &text[size], PipelineBatchBytes);
+            if (n < 0) {
+                text.resize(size);
+                if (errno != EINTR && errno != EAGAIN) {
+                    failed = true;
+                }
+                continue;
+            }
+
+            text.resize(size + n);
+            total += n;
+            eof = n == 0;
+            end = text.rfind('\n');
+        }
+
+        // Pass 1 reports the size once it has counted the text of the
+        // batches, so the whole input does not have to be read first
+        bool tooLarge = limit != 0 && total > limit;
+        bool last = eof || failed || tooLarge;
+
+        if (!last && end + 1 < text.size()) {
+            rest.assign(text, end + 1, std::string::npos);
+            text.resize(end + 1);
+        }
+
+        m_scanner.split(text, &batch->module.lines, &batch->module.tokens);
+        batch->firstLine = lineNumber;
+        batch->last = last;
+        batch->failed = failed;
+        lineNumber += batch->module.lines.size();
+
+        m_batches.endPush();
+        signalBatches();
+
+        if (last) {
+            return;
+        }
+    }
+}
+
+/* Wait until fd can be read without blocking. Returns false if pass 1
+ * stopped the pipelined reader in the meantime, or once timeoutMs has passed
+ * if it is not negative. */
+bool Assembler::waitForInput(int fd, int timeoutMs)
+{
+    for (;;) {
+        // poll() skips the stop pipe while it is closed (-1)
+        struct pollfd fds[2] = {
+            { fd, POLLIN, 0 },
+            { m_stopPipe[0], POLLIN, 0 }
+        };
+
+        int ready = poll(fds, 2, timeoutMs);
+        if (ready == 0) {
+            return false;
+        }
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Let the read report the error
+            return true;
+        }
+
+        if (fds[1].revents != 0) {
+            return false;
+        }
+        if (fds[0].revents != 0) {
+            return true;
+        }
+    }
+}
+
+/* Read a whole descriptor into the buffer of a previous file, like
+ * readText(). The input may stall, so cancellation and the time limit are
+ * checked while it is read. Errors are reported. */
+bool Assembler::readInput(int fd, std::string *text, std::size_t limit)
+{
+    char buf[65536];
+
+    text->clear();
+    for (;;) {
+        if (shouldStop()) {
+            return false;
+        }
+        if (!waitForInput(fd, InterruptCheckMs)) {
+            continue;
+        }
+
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            error(nullptr, "%s: Read failed", m_files[0].c_str());
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+
+        text->append(buf, n);
+        if (limit != 0 && text->size() > limit) {
+            return true;
+        }
+    }
+}
+
+/* Wake up the side of the ring that waits for the other one */
+void Assembler::signalBatches()
+{
+    // The lock orders the change of the ring before the check in the wait
+    // predicate, so that a wakeup is not lost
+    {
+        std::lock_guard<std::mutex> lock(m_batchMutex);
+    }
+    m_batchCond.notify_all();
+}
+
+/* Run pass 1 while the input is read and lexed on another thread, so that
+ * I/O and lexing overlap with assigning locations, and errors early in a
+ * large file are found before the rest of it has been read */
+bool Assembler::pass1Pipelined(int fd)
+{
+    if (pipe(m_stopPipe) != 0) {
+        error(nullptr, "%s: %s", m_files[0].c_str(), std::strerror(errno));
+        return false;
+    }
+
+    m_batches.clear();
+    m_batch = nullptr;
+    m_stopReader = false;
+
+    std::thread reader(&Assembler::readBatches, this, fd);
+
+    bool ok = pass1();
+
+    // Pass 1 stops at the first error, possibly before the whole input has
+    // been read. The reader may be waiting for a free batch or for input.
+    m_stopReader = true;
+    char stop = 0;
+    while (write(m_stopPipe[1], &stop, 1) < 0 && errno == EINTR) {
+    }
+    signalBatches();
+    reader.join();
+    m_batch = nullptr;
+
+    close(m_stopPipe[0]);
+    close(m_stopPipe[1]);
+    m_stopPipe[0] = -1;
+    m_stopPipe[1] = -1;
+
+    return ok;
+}
+
+/* Take the next line for pass 1. The end of the input is a null line. In
+ * pipelined mode, the includes of a batch are expanded when pass 1 gets to
+ * it, and the batch is only handed back to the reader when pass 1 is done
+ * with its lines. */
+bool Assembler::nextSourceLine(const SourceLine **out)
+{
+    while (m_inputPos == m_input.size()) {
+        if (!m_options.pipeline || (m_batch && m_batch->last)) {
+            if (!m_conditions.empty()) {
+                conditionError(m_conditions.back(), "IF without ENDIF");
+                return false;
+            }
+
+            *out = nullptr;
+            return true;
+        }
+
+        if (m_batch) {
+            m_batches.pop();
+            signalBatches();
+        }
+        for (;;) {
+            // The input may arrive slowly as well as stall, so the check is
+            // also made for every batch. The reader is stopped once pass 1
+            // returns.
+            if (shouldStop()) {
+                return false;
+            }
+
+            std::unique_lock<std::mutex> lock(m_batchMutex);
+            if (m_batchCond.wait_for(lock,
+                    std::chrono::milliseconds(InterruptCheckMs), [this] {
+                        return (m_batch = m_batches.front()) != nullptr;
+                    })) {
+                break;
+            }
+        }
+
+        m_input.clear();
+        m_inputPos = 0;
+
+        if (!addInput(m_batch->text.size())) {
+            error(nullptr, "%s: Input larger than the limit of %zu bytes",
+                  m_files[0].c_str(), m_options.maxInputSize);
+            return false;
+        }
+
+        std::vector<unsigned int> stack;
+        if (!expandIncludes(0, m_batch->module, m_batch->firstLine, &stack)) {
+            return false;
+        }
+
+        if (m_batch->failed) {
+            error(nullptr, "%s: Read failed", m_files[0].c_str());
+            return false;
+        }
+    }
+
+    *out = &m_input[m_inputPos++];
+    return true;
+}
+
+bool Assembler::pass1()
+{
+    m_entry.clear();
+    m_maxLineLength = 0;
+
+    // Lines before the first CSECT belong to an unnamed default section
+    Section *section = newSection();
+    section->start = 0;
+    section->loc = 0;
+    section->blocks.push_back({ std::string(), 0, 0, 0, false, false });
+    m_sections.push_back(section);
+
+    // Current program block of the current section
+    Block *block = &section->blocks[0];
+
+    // End of the address space, as a 64-bit value so that locations past
+    // it cannot wrap around
+    uint64_t addressLimit = m_options.addressSpace != 0
+        ? m_options.addressSpace : uint64_t(1) << 32;
+
+    for (;;) {
+        if (m_lines.size() % InterruptCheckLines == 0 && shouldStop()) {
+            return false;
+        }
+
+        const SourceLine *next;
+        if (!nextSourceLine(&next)) {
+            return false;
+        }
+        if (next == nullptr) {
+            break;
+        }
+
+        auto const &source = *next;
+        auto const &line = *source.line;
+        auto const &tokens = *source.tokens;
+
+        if (m_options.maxLines != 0 && m_lines.size() >= m_options.maxLines) {
+            error(nullptr, "%s: More than the limit of %zu lines",
+                  m_files[0].c_str(), m_options.maxLines);
+            return false;
+        }
+
+        ASMLine *asmLine = newLine();
+        m_lines.push_back(asmLine);
+        asmLine->line = line;
+        asmLine->file = source.file;
+        asmLine->lineNumber = source.lineNumber;
+
+        // Object code in the listing is aligned after the longest line
+        m_maxLineLength = std::max(m_maxLineLength, line.size());
+
+        std::string label;
+        std::string instr;
+        int paramIndex;
+
+        if (m_instrs.isValid(tokens[0])) {
+            // First token is instruction and there's no label
+            instr = tokens[0];
+            paramIndex = 1;
+        } else if (tokens.size() >= 2 && m_instrs.isValid(tokens[1])) {
+            // First token is label, second token is instruction
+            label = tokens[0];
+            instr = tokens[1];
+            paramIndex = 2;
+        } else {
+            error(asmLine, "Invalid instruction %s", tokens[0].c_str());
+            return false;
+        }
+
+        if (Instructions::getRegister(label) >= 0) {
+            error(asmLine, "Label cannot be the name of a register: %s",
+                  label.c_str());
+            return false;
+        }
+
+        // Treat remaining tokens in the line as parameters and split them at each
+        // comma if necessary
+        for (unsigned int i = paramIndex; i < tokens.size(); ++i) {
+            if (!tokens[i].empty() && (tokens[i][0] == '.' || tokens[i][0] == ';')) {
+                break;
+            }
+
+            std::vector<std::string> commaSplit;
+            splitString(&commaSplit, tokens[i], ",");
+            if (!tokens[i].empty()) {
+                asmLine->params.insert(asmLine->params.end(),
+                                       commaSplit.begin(), commaSplit.end());
+            }
+        }
+
+        // Replace ie. BUFFER[%RX] with BUFFER,X
+        convertIndexing(&asmLine->params);
+
+        if (Instructions::stripModifiers(instr) == Instructions::Additional_MOV) {
+            std::string newInstr;
+            std::vector<std::string> newParams;
+
+            bool ret = convertMovToSicXE(asmLine->params,
+                                        Instructions::isExtended(instr),
+                                        &newInstr, &newParams);
+            if (!ret) {
+                error(asmLine, "%s", m_error.c_str());
+                return false;
+            }
+
+            instr = newInstr;
+            asmLine->params.swap(newParams);
+        } else if (Instructions::stripModifiers(instr) == Instructions::Additional_LD
+                || Instructions::stripModifiers(instr) == Instructions::Additional_ST) {
+            std::string newInstr;
+            std::vector<std::string> newParams;
+
+            bool ret = convertLdStToSicXE(Instructions::stripModifiers(instr),
+                                          asmLine->params,
+                                          Instructions::isExtended(instr),
+                                          &newInstr, &newParams);
+            if (!ret) {
+                error(asmLine, "%s", m_error.c_str());
+                return false;
+            }
+
+            instr = newInstr;
+            asmLine->params.swap(newParams);
+        }
+
+        if (!label.empty()) {
+            asmLine->label = m_symbols.intern(label);
+        }
+        asmLine->instr = instr;
+
+        if ((instr == Instructions::Directive_START
+             || instr == Instructions::Directive_CSECT) && label.size() > 6) {
+            // The name goes in the 6 columns of the H record, and M records
+            // name the section to relocate it
+            error(asmLine, "Program name longer than 6 characters: %s",
+                  label.c_str());
+            return false;
+        }
+
+        if (instr == Instructions::Directive_CSECT) {
+            if (label.empty()) {
+                error(asmLine, "CSECT requires a label");
+                return false;
+            }
+
+            // A section with no lines yet (ie. CSECT is the first statement)
+            // is reused instead of emitting an empty program
+            if (!section->lines.empty()) {
+                section = newSection();
+                section->blocks.push_back(
+                        { std::string(), 0, 0, 0, false, false });
+                m_sections.push_back(section);
+                block = &section->blocks[0];
+            }
+
+            section->name = label;
+            section->start = 0;
+            section->loc = 0;
+            asmLine->listLocation = true;
+        } else if (instr == Instructions::Directive_USE) {
+            if (asmLine->params.size() > 1) {
+                error(asmLine, "USE accepts 0 or 1 arguments");
+                return false;
+            }
+
+            // No argument switches back to the default block
+            std::string name;
+            if (!asmLine->params.empty()) {
+                name = asmLine->params[0];
+            }
+
+            auto it = std::find_if(
+                    section->blocks.begin(), section->blocks.end(),
+                    [&](const Block &b) { return b.name == name; });
+            if (it == section->blocks.end()) {
+                section->blocks.push_back({ name, 0, 0, 0, false, false });
+                block = &section->blocks.back();
+            } else {
+                block = &*it;
+            }
+        }
+
+        section->lines.push_back(asmLine);
+
+        if (asmLine->label != SymbolPool::None) {
+            unsigned int addr;
+            if (findSymbol(section, asmLine->label, &addr)) {
+                error(asmLine, "Duplicate label: %s", label.c_str());
+                return false;
+            }
+            // Locations are relative to the block until the blocks are laid
+            // out at the end of pass 1
+            defineSymbol(section, asmLine->label, block->loc);
+        }
+
+        // Calculate locations
+
+        asmLine->block = block - section->blocks.data();
+        asmLine->location = block->loc;
+        // Bytes the line takes
+        uint64_t size = 0;
+
+        if (instr == Instructions::Directive_START) {
+            if (asmLine->params.size() != 1) {
+                error(asmLine, "START accepts 1 argument");
+                return false;
+            }
+
+            // Set initial location to the parameter (in hex)
+            if (!strtoulWrap(asmLine->params[0].c_str(), 16, &section->start)) {
+                error(asmLine, "Invalid hex address: %s",
+                      asmLine->params[0].c_str());
+                return false;
+            }
+
+            // The default block is placed at the starting address
+            section->name = label;
+            asmLine->listLocation = true;
+        } else if (instr == Instructions::Directive_END) {
+            // The optional operand is the program's entry point
+            if (!asmLine->params.empty()) {
+                m_entry = asmLine->params[0];
+            }
+        } else if (instr == Instructions::Directive_BASE
+                || instr == Instructions::Directive_NOBASE
+                || instr == Instructions::Directive_CSECT
+                || instr == Instructions::Directive_USE) {
+            // Base, section and block directives do not affect the location
+        } else if (instr == Instructions::Directive_EXTDEF
+                || instr == Instructions::Directive_EXTREF) {
+            if (asmLine->params.empty()) {
+                error(asmLine, "%s requires at least 1 symbol", instr.c_str());
+                return false;
+            }
+
+            auto *names = instr == Instructions::Directive_EXTDEF
+                    ? &section->extDefs : &section->extRefs;
+            for (auto const &name : asmLine->params) {
+                if (name.size() > 6) {
+                    error(asmLine, "External symbol longer than 6 characters: %s",
+                          name.c_str());
+                    return false;
+                }
+                names->push_back(m_symbols.intern(name));
+            }
+        } else if (m_instrs.isSicXE(instr)) {
+            auto *info = m_instrs[instr];
+            asmLine->info = info;
+
+            block->hasCode = true;
+            asmLine->listLocation = true;
+
+            // Symbols referenced by operands are interned here, because
+            // pass 2 runs in parallel and can only look them up
+            if (info->length == Instructions::Length::ThreeOrFour
+                    && !asmLine->params.empty()) {
+                std::string target = Instructions::stripModifiers(
+                        asmLine->params[0]);
+                int number;
+                if (!strtolWrap(target.c_str(), 10, &number)) {
+                    asmLine->operand = m_symbols.intern(target);
+                }
+            }
+
+            // Increment location appropriately
+            switch (info->length) {
+            case Instructions::Length::One:
+                size = 1;
+                break;
+            case Instructions::Length::Two:
+                size = 2;
+                break;
+            case Instructions::Length::ThreeOrFour:
+                if (m_instrs.isExtended(instr)) {
+                    size = 4;
+                } else {
+                    size = 3;
+                }
+                break;
+            }
+        } else if (instr == Instructions::Variable_WORD) {
+            if (asmLine->params.size() != 1) {
+                error(asmLine, "WORD accepts 1 argument");
+                return false;
+            }
+
+            block->hasData = true;
+
+            // A word is 3 bytes
+            size = 3;
+            asmLine->listLocation = true;
+        } else if (instr == Instructions::Variable_RESW) {
+            if (asmLine->params.size() != 1) {
+                error(asmLine, "RESW accepts 1 argument");
+                return false;
+            }
+
+            // An array of words is: 3 bytes * length
+            unsigned int length;
+            if (!strtoulWrap(asmLine->params[0].c_str(), 10, &length)) {
+                error(asmLine, "Invalid length: %s",
+                      asmLine->params[0].c_str());
+                return false;
+            }
+
+            size = 3 * static_cast<uint64_t>(length);
+            asmLine->listLocation = true;
+        } else if (instr == Instructions::Variable_RESB) {
+            if (asmLine->params.size() != 1) {
+                error(asmLine, "RESB accepts 1 argument");
+                return false;
+            }
+
+            // An array of bytes is: 1 byte * length
+            unsigned int length;
+            if (!strtoulWrap(asmLine->params[0].c_str(), 10, &length)) {
+                error(asmLine, "Invalid length: %s",
+                      asmLine->params[0].c_str());
+                return false;
+            }
+
+            size = length;
+            asmLine->listLocation = true;
+        } else if (instr == Instructions::Variable_BYTE) {
+            if (asmLine->params.size() != 1) {
+                error(asmLine, "BYTE accepts 1 argument");
+                return false;
+            }
+
+            std::string quoted = getQuoted(asmLine->params[0]);
+            if (quoted.empty()) {
+                error(asmLine, "Invalid value for BYTE variable: %s",
+                      asmLine->params[0].c_str());
+                return false;
+            }
+
+            block->hasData = true;
+
+            size = quoted.length();
+            asmLine->listLocation = true;
+        } else {
+            // Programmer's error
+            assert(false);
+        }
+
+        // Checking each line against the address space also keeps ie.
+        // RESB 4294967295 from wrapping the location counter around
+        uint64_t end = uint64_t(section->start) + block->loc + size;
+        if (end > addressLimit) {
+            error(asmLine, "Location out of the address space: %06" PRIX64,
+                  end);
+            return false;
+        }
+        block->loc += size;
+
+        asmLine->locationNext = block->loc;
+    }
+
+    if (m_lines.empty()) {
+        error(nullptr, "Empty assembly file");
+        return false;
+    }
+
+    for (auto *s : m_sections) {
+        // Blocks that fit on their own may not fit together
+        uint64_t end = s->start;
+        for (auto const &b : s->blocks) {
+            end += b.loc;
+        }
+        if (end > addressLimit) {
+            error(nullptr, "Section %s out of the address space: %06" PRIX64,
+                  s->name.c_str(), end);
+            return false;
+        }
+
+        layoutBlocks(s);
+    }
+    m_located = true;
+
+    for (auto *s : m_sections) {
+        unsigned int addr;
+
+        for (uint32_t id : s->extDefs) {
+            if (!findSymbol(s, id, &addr)) {
+                error(nullptr, "EXTDEF symbol not defined in section %s: %s",
+                      s->name.c_str(), m_symbols.name(id));
+                return false;
+            }
+        }
+
+        for (uint32_t id : s->extRefs) {
+            if (findSymbol(s, id, &addr)) {
+                error(nullptr, "EXTREF symbol also defined in section %s: %s",
+                      s->name.c_str(), m_symbols.name(id));
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Place the program blocks of a section one after another and convert the
+ * block-relative locations from pass 1 to addresses. Blocks containing
+ * instructions come first, then initialized data, then blocks that only
+ * reserve space. Keeping the code together leaves more of it within reach of
+ * PC-relative format 3 instructions. */
+void Assembler::layoutBlocks(Section *section)
+{
+    std::vector<Block *> order;
+    for (auto &block : section->blocks) {
+        order.push_back(&block);
+    }
+
+    // Empty blocks keep their place so that ie. the START label of an
+    // otherwise unused default block stays at the starting address
+    auto rank = [](const Block *b) {
+        return (b->hasCode || b->loc == 0) ? 0 : (b->hasData ? 1 : 2);
+    };
+    std::stable_sort(order.begin(), order.end(),
+                     [&](const Block *a, const Block *b) {
+        return rank(a) < rank(b);
+    });
+
+    unsigned int address = section->start;
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        order[i]->order = i;
+        order[i]->address = address;
+        address += order[i]->loc;
+    }
+    section->loc = address;
+
+    for (ASMLine *asmLine : section->lines) {
+        const Block &block = section->blocks[asmLine->block];
+        asmLine->location += block.address;
+        asmLine->locationNext += block.address;
+
+        if (asmLine->label != SymbolPool::None) {
+            defineSymbol(section, asmLine->label, asmLine->location);
+        }
+    }
+}
+
+/* Remove the lines that the program never uses, in every section, and
+ * report how much space that saved */
+void Assembler::removeUnused()
+{
+    std::size_t lines = 0;
+    unsigned int bytes = 0;
+    for (std::size_t i = 0; i < m_sections.size(); ++i) {
+        removeUnused(m_sections[i], i == 0, &lines, &bytes);
+    }
+
+    if (m_options.printDiagnostics) {
+        std::fprintf(stderr, "%s: Removed %zu unused lines, %u bytes\n",
+                     m_files[0].c_str(), lines, bytes);
+    }
+}
+
+/* Lines of a section are grouped into units that start at each label, since
+ * code runs on from one label into the next and data is addressed relative
+ * to its label. Units are kept if they can be reached from the start of the
+ * section, the entry point, an external definition or a BASE directive,
+ * following the symbols of operands and WORD values, and the fall through of
+ * code that does not end with J or RSUB. Directives are always kept. The
+ * locations of the section are then assigned again without the removed
+ * lines. */
+void Assembler::removeUnused(Section *section, bool first, std::size_t *lines,
+                             unsigned int *bytes)
+{
+    struct Unit {
+        std::vector<ASMLine *> lines;
+        // Next unit in the same block, or -1
+        int next;
+        bool code;
+        bool fallsThrough;
+        bool used;
+    };
+
+    std::vector<Unit> units;
+    std::vector<int> unitOf(section->lines.size(), -1);
+    // Last unit of each block so far, and unit of each label
+    std::vector<int> last(section->blocks.size(), -1);
+    std::vector<int> symbolUnit(m_symbols.size(), -1);
+
+    for (std::size_t i = 0; i < section->lines.size(); ++i) {
+        ASMLine *asmLine = section->lines[i];
+        bool code = asmLine->info != nullptr;
+        if (!code && !Instructions::isVariable(asmLine->instr)) {
+            continue;
+        }
+
+        int &current = last[asmLine->block];
+        if (asmLine->label != SymbolPool::None || current < 0) {
+            units.push_back({ std::vector<ASMLine *>(), -1, false, false,
+                              false });
+            int unit = units.size() - 1;
+            if (current >= 0) {
+                units[current].next = unit;
+            }
+            current = unit;
+        }
+
+        Unit &unit = units[current];
+        unit.lines.push_back(asmLine);
+        unit.code = unit.code || code;
+        unitOf[i] = current;
+        if (asmLine->label != SymbolPool::None) {
+            symbolUnit[asmLine->label] = current;
+        }
+
+        // Whether a unit runs on into the next one depends on its last line
+        unit.fallsThrough = false;
+        if (code) {
+            auto instr = asmLine->info->instr;
+            unit.fallsThrough = instr != Instructions::SicXE::J
+                    && instr != Instructions::SicXE::RSUB;
+        }
+    }
+
+    std::vector<int> work;
+    auto use = [&](int unit) {
+        if (unit >= 0 && !units[unit].used) {
+            units[unit].used = true;
+            work.push_back(unit);
+        }
+    };
+
+    // Data that is indexed or that a WORD refers to, ie. a table of
+    // addresses or BUFEND-BUFFER, may be addressed past its own label, so
+    // the data that follows it up to the next code is kept with it
+    auto useSymbol = [&](uint32_t id, bool following) {
+        if (id >= symbolUnit.size() || symbolUnit[id] < 0) {
+            return;
+        }
+
+        int unit = symbolUnit[id];
+        use(unit);
+        if (following && !units[unit].code) {
+            for (unit = units[unit].next; unit >= 0 && !units[unit].code;
+                    unit = units[unit].next) {
+                use(unit);
+            }
+        }
+    };
+
+    // The section starts at its first line of the default block
+    for (std::size_t i = 0; i < section->lines.size(); ++i) {
+        if (unitOf[i] >= 0 && section->lines[i]->block == 0) {
+            use(unitOf[i]);
+            break;
+        }
+    }
+
+    if (first && !m_entry.empty()) {
+        useSymbol(m_symbols.find(Instructions::stripModifiers(m_entry)),
+                  false);
+    }
+
+    for (uint32_t id : section->extDefs) {
+        useSymbol(id, true);
+    }
+
+    for (ASMLine *asmLine : section->lines) {
+        if (asmLine->instr == Instructions::Directive_BASE
+                && asmLine->params.size() == 1) {
+            useSymbol(m_symbols.find(
+                    Instructions::stripModifiers(asmLine->params[0])), false);
+        }
+    }
+
+    while (!work.empty()) {
+        int unit = work.back();
+        work.pop_back();
+
+        if (units[unit].fallsThrough) {
+            use(units[unit].next);
+        }
+
+        for (ASMLine *asmLine : units[unit].lines) {
+            if (asmLine->operand != SymbolPool::None) {
+                useSymbol(asmLine->operand,
+                          Instructions::isParamIndex(asmLine->params));
+            } else if (asmLine->instr == Instructions::Variable_WORD
+                    && asmLine->params.size() == 1) {
+                std::vector<std::string> terms;
+                splitString(&terms, asmLine->params[0], "+-");
+                for (auto const &term : terms) {
+                    useSymbol(m_symbols.find(term), true);
+                }
+            }
+        }
+    }
+
+    // Assign locations again, as pass 1 did, skipping the removed lines
+    for (auto &block : section->blocks) {
+        block.loc = 0;
+        block.hasCode = false;
+        block.hasData = false;
+    }
+
+    for (std::size_t i = 0; i < section->lines.size(); ++i) {
+        ASMLine *asmLine = section->lines[i];
+        Block &block = section->blocks[asmLine->block];
+        unsigned int size = asmLine->locationNext - asmLine->location;
+
+        if (unitOf[i] >= 0 && !units[unitOf[i]].used) {
+            asmLine->removed = true;
+            asmLine->listLocation = false;
+            ++*lines;
+            *bytes += size;
+            size = 0;
+        } else if (asmLine->info) {
+            block.hasCode = true;
+        } else if (asmLine->instr == Instructions::Variable_WORD
+                || asmLine->instr == Instructions::Variable_BYTE) {
+            block.hasData = true;
+        }
+
+        asmLine->location = block.loc;
+        block.loc += size;
+        asmLine->locationNext = block.loc;
+
+        if (asmLine->label != SymbolPool::None) {
+            defineSymbol(section, asmLine->label, asmLine->location);
+        }
+    }
+
+    layoutBlocks(section);
+}
+
+bool Assembler::pass2(Section *section)
+{
+    // Base-relative addressing is off until the first BASE directive
+    unsigned int base = -1;
+    PendingFormat3 pending;
+
+    std::size_t count = 0;
+    for (ASMLine *asmLine : section->lines) {
+        // An interrupted section fails without a diagnostic of its own, the
+        // reason is reported once for all sections
+        if (count++ % InterruptCheckLines == 0 && interruption()) {
+            return false;
+        }
+
+        if (asmLine->removed) {
+            continue;
+        }
+
+        std::size_t reported = section->diagnostics.size();
+        if (!encodeLine(section, asmLine, &base, &pending)) {
+            // The lines still in the batch come before this one, so an error
+            // among them is the one to report
+            std::vector<Diagnostic> later(
+                    section->diagnostics.begin() + reported,
+                    section->diagnostics.end());
+            section->diagnostics.erase(
+                    section->diagnostics.begin() + reported,
+                    section->diagnostics.end());
+            if (flushFormat3(section, &pending)) {
+                section->diagnostics.insert(section->diagnostics.end(),
+                                            later.begin(), later.end());
+            }
+            return false;
+        }
+
+        if (pending.batch.full() && !flushFormat3(section, &pending)) {
+            return false;
+        }
+    }
+
+    return flushFormat3(section, &pending);
+}
+
+/* Encode a line in pass 2, or queue it for batch encoding. The base register
+ * changes with BASE and NOBASE directives. */
+bool Assembler::encodeLine(Section *section, ASMLine *asmLine,
+                           unsigned int *base, PendingFormat3 *pending)
+{
+    if (asmLine->info) {
+        auto *instr = asmLine->info;
+
+        std::size_t length = 0;
+        if (instr->type == Instructions::Type::OneOp) {
+            length = 1;
+        } else if (instr->type == Instructions::Type::TwoOp) {
+            length = 2;
+        }
+
+        std::size_t paramSize = asmLine->params.size();
+
+        // Instruction with non-register parameters and index mode will
+        // have an extra "X" parameter
+        if (instr->type == Instructions::Type::OneOp
+                && Instructions::isParamIndex(asmLine->params)) {
+            --paramSize;
+        }
+
+        if (paramSize != length) {
+            sectionError(section, asmLine, "%s accepts %zu arguments",
+                  Instructions::stripModifiers(asmLine->instr).c_str(),
+                  length);
+            return false;
+        }
+
+        // Each line is dispatched once to the encoder of its format
+        bool ok = true;
+        unsigned int format;
+
+        if (instr->length == Instructions::Length::One) {
+            format = 1;
+            asmLine->objectCode = getObjCode1Byte(instr);
+        } else if (instr->length == Instructions::Length::Two) {
+            format = 2;
+
+            std::string reg2;
+            if (instr->type == Instructions::Type::TwoOp) {
+                // Swap parameters if the registers are in the form
+                // %E{register}X and the instruction takes two registers
+                // as arguments
+                std::vector<std::string> newParams;
+                convertSwapParams(asmLine->params, &newParams);
+                asmLine->params.swap(newParams);
+                reg2 = asmLine->params[1];
+            }
+
+            ok = getObjCode2Bytes(section, instr, asmLine->params[0], reg2,
+                                  &asmLine->objectCode);
+        } else if (!Instructions::isExtended(asmLine->instr)
+                && queueFormat3(section, asmLine, *base, pending)) {
+            // Encoded with the rest of the batch
+            return true;
+        } else {
+            format = Instructions::isExtended(asmLine->instr) ? 4 : 3;
+            ok = getObjCode3Or4Bytes(
+                    section,                // Section being encoded
+                    instr,                  // Instruction info
+                    asmLine,                // Instruction and parameters
+                    *base,                  // Base register value
+                    &asmLine->objectCode);
+        }
+
+        if (!ok) {
+            sectionError(section, asmLine,
+                         "Failed to generate object code: %s",
+                         section->error.c_str());
+            return false;
+        }
+
+        // Format 3 and 4 are counted while encoding
+        if (statsEnabled() && format <= 2) {
+            section->stats.addInstruction(format);
+        }
+    } else if (asmLine->instr == Instructions::Variable_WORD) {
+        int value;
+        if (!getWordValue(section, asmLine, &value)) {
+            sectionError(section, asmLine, "Invalid value for WORD: %s",
+                         section->error.c_str());
+            return false;
+        }
+
+        // Only the low 24 bits are written
+        asmLine->objectCode = value;
+    } else if (asmLine->instr == Instructions::Directive_BASE) {
+        if (asmLine->params.size() != 1) {
+            sectionError(section, asmLine, "BASE accepts 1 parameter");
+            return false;
+        }
+
+        // Set base value appropriately
+        if (!findLabelAddr(section, asmLine->params[0], base)) {
+            sectionError(section, asmLine, "Label not found: %s",
+                         asmLine->params[0].c_str());
+            return false;
+        }
+    } else if (asmLine->instr == Instructions::Directive_NOBASE) {
+        // Disable use of base-relative addressing
+        *base = -1;
+    }
+
+    return true;
+}
+
+/* Queue a format 3 line with a label operand for batch encoding. Lines that
+ * need anything else, ie. a constant, an external reference or statistics,
+ * are encoded on their own. */
+bool Assembler::queueFormat3(Section *section, ASMLine *asmLine, int base,
+                             PendingFormat3 *pending)
+{
+    unsigned int labelAddr;
+    if (statsEnabled() || asmLine->operand == SymbolPool::None
+            || isExtRef(section, asmLine->operand)
+            || !findSymbol(section, asmLine->operand, &labelAddr)) {
+        return false;
+    }
+
+    const std::vector<std::string> &params = asmLine->params;
+    bool indirect = Instructions::isParamIndirect(params);
+    bool immediate = Instructions::isParamImmediate(params);
+
+    // For SIC/XE, the n-bit and i-bit should be 1 if they're both disabled
+    if (!indirect && !immediate) {
+        indirect = true;
+        immediate = true;
+    }
+
+    AddressFlags flags = { indirect, immediate,
+                           Instructions::isParamIndex(params), false, false };
+
+    pending->lines[pending->batch.size()] = asmLine;
+    pending->batch.add(FormatEncoder<3>::encode(asmLine->info->opcode, flags, 0),
+                       asmLine->locationNext, labelAddr, base);
+    return true;
+}
+
+/* Encode the queued format 3 lines. Lines out of reach of both PC-relative
+ * and base-relative addressing go through the scalar encoder again, which
+ * reports them exactly as if they had not been batched. */
+bool Assembler::flushFormat3(Section *section, PendingFormat3 *pending)
+{
+    Format3Batch &batch = pending->batch;
+    if (batch.empty()) {
+        return true;
+    }
+
+    uint32_t codes[Format3Batch::Capacity];
+    bool failed[Format3Batch::Capacity];
+    std::size_t failures = batch.encode(codes, failed);
+
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        pending->lines[i]->objectCode = codes[i];
+    }
+
+    for (std::size_t i = 0; failures > 0 && i < batch.size(); ++i) {
+        if (!failed[i]) {
+            continue;
+        }
+
+        ASMLine *asmLine = pending->lines[i];
+        if (!getObjCode3Or4Bytes(section, asmLine->info, asmLine,
+                                 batch.base(i), &asmLine->objectCode)) {
+            sectionError(section, asmLine,
+                         "Failed to generate object code: %s",
+                         section->error.c_str());
+            batch.clear();
+            return false;
+        }
+        --failures;
+    }
+
+    batch.clear();
+    return true;
+}
+
+/* Run pass 2 on every section. Control sections only share the external
+ * symbol names, so each one can be encoded on its own thread. */
+bool Assembler::encodeSections()
+{
+    parallelFor(m_sections.size(), [&](std::size_t i) {
+        m_sections[i]->encoded = pass2(m_sections[i]);
+    });
+
+    bool ok = true;
+    for (auto *section : m_sections) {
+        for (auto const &diagnostic : section->diagnostics) {
+            report(diagnostic);
+        }
+        ok = ok && section->encoded;
+    }
+
+    if (shouldStop()) {
+        return false;
+    }
+
+    return ok;
+}
+
+/* Write the object records to a file, or standard output if the path is
+ * "-" */
+bool Assembler::writeObjectFile(const std::string &path)
+{
+    // What was written to standard output cannot be taken back, so the
+    // records are only written once all of them fit in the limits
+    if (path == "-") {
+        char *buf = nullptr;
+        std::size_t size = 0;
+        std::FILE *mem = open_memstream(&buf, &size);
+        if (mem == nullptr) {
+            error(nullptr, "<stdout>: %s", std::strerror(errno));
+            return false;
+        }
+
+        bool ret = writeObject(mem);
+        ret = std::fclose(mem) == 0 && ret;
+        if (ret) {
+            ret = std::fwrite(buf, 1, size, stdout) == size
+                    && std::fflush(stdout) == 0;
+        }
+        std::free(buf);
+
+        if (!ret) {
+            if (!m_stopped) {
+                error(nullptr, "<stdout>: Write failed");
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // cstdio is better for writing hex information than iostream
+    std::FILE *obj = std::fopen(path.c_str(), "wb");
+    if (obj == nullptr) {
+        error(nullptr, "%s: %s", path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    bool ret = writeObject(obj);
+    if (std::fclose(obj) != 0 || !ret) {
+        if (!m_stopped) {
+            error(nullptr, "%s: Write failed", path.c_str());
+        }
+        std::remove(path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool Assembler::writeListingFile(const std::string &path)
+{
+    std::FILE *lst = std::fopen(path.c_str(), "wb");
+    if (lst == nullptr) {
+        error(nullptr, "%s: %s", path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    bool ret = writeListing(lst);
+    if (std::fclose(lst) != 0 || !ret) {
+        if (!m_stopped) {
+            error(nullptr, "%s: Write failed", path.c_str());
+        }
+        std::remove(path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/* Write the listing to a file descriptor opened by the caller, ie. a pipe.
+ * The descriptor itself stays open. */
+bool Assembler::writeListingFd(int fd)
+{
+    int dupFd = dup(fd);
+    std::FILE *lst = dupFd >= 0 ? fdopen(dupFd, "wb") : nullptr;
+    if (lst == nullptr) {
+        if (dupFd >= 0) {
+            close(dupFd);
+        }
+        error(nullptr, "Listing file descriptor %d: %s", fd,
+              std::strerror(errno));
+        return false;
+    }
+
+    bool ret = writeListing(lst);
+    if (std::fclose(lst) != 0 || !ret) {
+        if (!m_stopped) {
+            error(nullptr, "Listing file descriptor %d: Write failed", fd);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/* Write the H/D/R/T/M/E records of all sections. Writing stops at the
+ * output size limit, or when the program is interrupted. */
+bool Assembler::writeObject(std::FILE *obj)
+{
+    for (std::size_t i = 0; i < m_sections.size(); ++i) {
+        Section *section = m_sections[i];
+
+        if (section->lines.empty()) {
+            continue;
+        }
+
+        if (shouldStop()) {
+            return false;
+        }
+
+        // Bytes of the records other than text records
+        long written = 0;
+
+        // Write object code header
+        // Col 1:     H
+        // Col 2-7:   Program name
+        // Col 8-13:  Starting address
+        // Col 14-19: Length of program
+        written += std::fprintf(obj, "H%-6s%06X%06X\n",
+                                section->name.c_str(), section->start,
+                                section->loc - section->start);
+
+        // Write define records
+        // Col 1:     D
+        // Col 2-73:  Up to 6 pairs of symbol name (6 chars) and address
+        for (std::size_t d = 0; d < section->extDefs.size(); d += 6) {
+            written += std::fprintf(obj, "D");
+            for (std::size_t k = d; k < d + 6 && k < section->extDefs.size(); ++k) {
+                uint32_t id = section->extDefs[k];
+                written += std::fprintf(obj, "%-6s%06X", m_symbols.name(id),
+                                        section->symbols[id]);
+            }
+            written += std::fprintf(obj, "\n");
+        }
+
+        // Write refer records
+        // Col 1:     R
+        // Col 2-73:  Up to 12 symbol names (6 chars each)
+        for (std::size_t r = 0; r < section->extRefs.size(); r += 12) {
+            written += std::fprintf(obj, "R");
+            for (std::size_t k = r; k < r + 12 && k < section->extRefs.size(); ++k) {
+                written += std::fprintf(obj, "%-6s",
+                                        m_symbols.name(section->extRefs[k]));
             }
+            written += std::fprintf(obj, "\n");
+        }
 
-            m_loc += 3 * length;
-        } else if (instr == Instructions::Variable_RESB) {
-            if (asmLine->params.size() != 1) {
-                error(asmLine, "RESB accepts 1 argument");
+        // Text records are written block by block in address order
+        std::vector<ASMLine *> lines(section->lines);
+        std::stable_sort(lines.begin(), lines.end(),
+                         [&](const ASMLine *a, const ASMLine *b) {
+            return section->blocks[a->block].order
+                    < section->blocks[b->block].order;
+        });
+
+        // Each record holds a run of contiguous bytes. A record ends where
+        // the next byte is not at the following address, ie. after space
+        // reserved with RESW or RESB, or when it is full. Lines that do not
+        // fit in the rest of a record continue in the next one.
+        unsigned char record[MaxTextRecordBytes];
+        std::size_t recordSize = 0;
+        unsigned int recordAddr = 0;
+        std::vector<unsigned char> bytes;
+        std::size_t count = 0;
+
+        for (ASMLine *asmLine : lines) {
+            if (++count % InterruptCheckLines == 0 && shouldStop()) {
                 return false;
             }
 
-            asmLine->location = m_loc;
+            bytes.clear();
+            getObjCodeBytes(asmLine, &bytes);
+            if (bytes.empty()) {
+                continue;
+            }
 
-            // An array of bytes is: 1 byte * length
-            unsigned int length;
-            if (!strtoulWrap(asmLine->params[0].c_str(), 10, &length)) {
-                error(asmLine, "Invalid length: %s",
-                      asmLine->params[0].c_str());
-                return false;
+            if (recordSize > 0 && asmLine->location != recordAddr + recordSize) {
+                if (!addOutput(writeTextRecord(obj, recordAddr, record,
+                                               recordSize))) {
+                    return false;
+                }
+                recordSize = 0;
             }
 
-            m_loc += length;
-        } else if (instr == Instructions::Variable_BYTE) {
-            if (asmLine->params.size() != 1) {
-                error(asmLine, "BYTE accepts 1 argument");
-                return false;
+            for (std::size_t done = 0; done < bytes.size(); ) {
+                if (recordSize == 0) {
+                    recordAddr = asmLine->location + done;
+                }
+
+                std::size_t count = std::min(MaxTextRecordBytes - recordSize,
+                                             bytes.size() - done);
+                std::memcpy(record + recordSize, bytes.data() + done, count);
+                recordSize += count;
+                done += count;
+
+                if (recordSize == MaxTextRecordBytes) {
+                    if (!addOutput(writeTextRecord(obj, recordAddr, record,
+                                                   recordSize))) {
+                        return false;
+                    }
+                    recordSize = 0;
+                }
             }
+        }
 
-            asmLine->location = m_loc;
+        if (recordSize > 0 && !addOutput(writeTextRecord(obj, recordAddr,
+                                                         record, recordSize))) {
+            return false;
+        }
 
-            std::string quoted = getQuoted(asmLine->params[0]);
-            if (quoted.empty()) {
-                error(asmLine, "Invalid value for BYTE variable: %s",
-                      asmLine->params[0].c_str());
-                return false;
+        // Write modification records
+        // Col 1:     M
+        // Col 2-7:   Starting address of the field to modify
+        // Col 8-9:   Length of the field in half-bytes
+        // Col 10:    Sign of the adjustment
+        // Col 11-16: External symbol or section name to add or subtract
+        // A section without a name is relocated by records that end after
+        // the length, or after the sign to subtract
+        for (auto const &mod : section->mods) {
+            if (!mod.symbol.empty()) {
+                written += std::fprintf(obj, "M%06X%02X%c%s\n", mod.address,
+                                        mod.halfBytes, mod.sign,
+                                        mod.symbol.c_str());
+            } else if (mod.sign == '-') {
+                written += std::fprintf(obj, "M%06X%02X-\n", mod.address,
+                                        mod.halfBytes);
+            } else {
+                written += std::fprintf(obj, "M%06X%02X\n", mod.address,
+                                        mod.halfBytes);
             }
+        }
 
-            m_loc += quoted.length();
+        // End header
+        // Col 1:   E
+        // Col 2-7: Address of first executable instruction (first section)
+        if (i == 0) {
+            written += std::fprintf(obj, "E%06X\n", getEntryAddr());
         } else {
-            // Programmer's error
-            assert(false);
+            written += std::fprintf(obj, "E\n");
         }
 
-        asmLine->locationNext = m_loc;
+        // fprintf gives a negative count on errors, which ferror catches
+        if (!addOutput(std::max(written, 0L))) {
+            return false;
+        }
     }
 
-    if (m_lines.empty()) {
-        error(nullptr, "Empty assembly file");
-        return false;
+    return !std::ferror(obj);
+}
+
+/* Write a text record
+ * Col 1:     T
+ * Col 2-7:   Starting address for object code
+ * Col 8-9:   Length of object code
+ * Col 10-69: Object code in hex
+ * Returns the size of the record. */
+std::size_t Assembler::writeTextRecord(std::FILE *obj, unsigned int address,
+                                const unsigned char *bytes, std::size_t size)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+
+    char line[10 + 2 * MaxTextRecordBytes + 1];
+    std::snprintf(line, sizeof(line), "T%06X%02zX", address, size);
+
+    char *p = line + 9;
+    for (std::size_t i = 0; i < size; ++i) {
+        *p++ = hexDigits[bytes[i] >> 4];
+        *p++ = hexDigits[bytes[i] & 0xF];
     }
+    *p++ = '\n';
 
-    return true;
+    std::fwrite(line, 1, p - line, obj);
+    return p - line;
 }
 
-bool Assembler::pass2()
+/* Write the source lines with their locations and object code. The listing
+ * is formatted in chunks of lines, in parallel for large programs, and the
+ * chunks are written in order. */
+bool Assembler::writeListing(std::FILE *lst)
 {
-    for (unsigned int index = 0; index < m_lines.size(); ++index) {
-        ASMLine *asmLine = m_lines[index];
+    std::size_t chunks = (m_lines.size() + ListingChunkLines - 1)
+            / ListingChunkLines;
+    std::vector<std::string> buffers(chunks);
 
-        if (m_instrs.isSicXE(asmLine->instr)) {
-            auto *instr = m_instrs[asmLine->instr];
+    parallelFor(chunks, [&](std::size_t chunk) {
+        if (interruption()) {
+            return;
+        }
 
-            std::size_t length;
-            switch (instr->type) {
-            case Instructions::Type::ZeroOp:
-                length = 0;
-                break;
-            case Instructions::Type::OneOp:
-                length = 1;
-                break;
-            case Instructions::Type::TwoOp:
-                length = 2;
-                break;
-            default:
-                // Programmer's error
-                assert(false);
-            }
+        std::size_t first = chunk * ListingChunkLines;
+        std::size_t last = std::min(first + ListingChunkLines, m_lines.size());
+        formatListing(first, last, &buffers[chunk]);
+    });
 
-            std::size_t paramSize = asmLine->params.size();
+    if (shouldStop()) {
+        return false;
+    }
 
-            // Instruction with non-register parameters and index mode will
-            // have an extra "X" parameter
-            if (instr->type == Instructions::Type::OneOp
-                    && Instructions::isParamIndex(asmLine->params)) {
-                --paramSize;
-            }
+    // The whole listing is formatted before anything is written, so nothing
+    // is written if it is over the size limit
+    std::size_t size = 0;
+    for (auto const &buffer : buffers) {
+        size += buffer.size();
+    }
+    if (!addOutput(size)) {
+        return false;
+    }
 
-            if (paramSize != length) {
-                error(asmLine, "%s accepts %zu arguments",
-                      Instructions::stripModifiers(asmLine->instr).c_str(),
-                      length);
-                return false;
-            }
+    for (auto const &buffer : buffers) {
+        if (std::fwrite(buffer.data(), 1, buffer.size(), lst) != buffer.size()) {
+            return false;
+        }
+    }
 
-            if (instr->length == Instructions::Length::One) {
-                // One byte instructions
-                asmLine->objectCode = getObjCode1Byte(instr);
-            } else if (instr->length == Instructions::Length::Two) {
-                switch (instr->type) {
-                case Instructions::Type::OneOp:
-                    // Two byte, one operand instructions
-                    asmLine->objectCode = getObjCode2Bytes(
-                            instr, asmLine->params[0], std::string());
-                    break;
-                case Instructions::Type::TwoOp: {
-                    // Swap parameters if the registers are in the form %E{register}X
-                    // and the instruction takes two registers as arguments
-                    std::vector<std::string> newParams;
-                    convertSwapParams(asmLine->params, &newParams);
-                    asmLine->params.swap(newParams);
-
-                    // Two byte, two operand instructions
-                    asmLine->objectCode = getObjCode2Bytes(
-                            instr, asmLine->params[0], asmLine->params[1]);
-                    break;
-                }
-                case Instructions::Type::ZeroOp:
-                    // Programmer error
-                    assert(false);
-                }
-            } else if (instr->length == Instructions::Length::ThreeOrFour) {
-                // Three or four byte, zero or two operand instructions
-                asmLine->objectCode = getObjCode3Or4Bytes(
-                        instr,                  // Instruction info
-                        asmLine->instr,         // Instruction
-                        asmLine->params,        // Instruction parameters
-                        asmLine->locationNext,  // Program counter value
-                        m_base);                // Base register value
-            } else {
-                // Programmer's error
-                assert(false);
-            }
+    return true;
+}
 
-            if (asmLine->objectCode < 0) {
-                error(asmLine, "Failed to generate object code: %s",
-                      m_error.c_str());
-                return false;
+void Assembler::formatListing(std::size_t first, std::size_t last,
+                              std::string *out)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+
+    // Object code of the current line, reused for all lines of the chunk
+    std::vector<unsigned char> bytes;
+
+    for (std::size_t i = first; i < last; ++i) {
+        ASMLine *asmLine = m_lines[i];
+
+        // Print location
+        if (asmLine->listLocation) {
+            // At least 4 hex digits, like %04X
+            unsigned int loc = asmLine->location;
+            int digits = 4;
+            while (digits < 8 && (loc >> (4 * digits)) != 0) {
+                ++digits;
             }
-        } else if (asmLine->instr == Instructions::Directive_BASE) {
-            if (asmLine->params.size() != 1) {
-                error(asmLine, "BASE accepts 1 parameter");
-                return false;
+            for (int d = digits - 1; d >= 0; --d) {
+                *out += hexDigits[(loc >> (4 * d)) & 0xF];
             }
+            out->append(4, ' ');
+        } else {
+            out->append(8, ' ');
+        }
 
-            // Set base value appropriately
-            if (!findLabelAddr(asmLine->params[0], &m_base)) {
-                error(asmLine, "Label not found: %s",
-                      asmLine->params[0].c_str());
-                return false;
+        // Print original code
+        *out += asmLine->line;
+
+        bytes.clear();
+        getObjCodeBytes(asmLine, &bytes);
+        if (asmLine->removed) {
+            out->append(m_maxLineLength - asmLine->line.size() + 4, ' ');
+            *out += "(removed)";
+        } else if (!bytes.empty()) {
+            out->append(m_maxLineLength - asmLine->line.size() + 4, ' ');
+            for (unsigned char c : bytes) {
+                *out += hexDigits[c >> 4];
+                *out += hexDigits[c & 0xF];
             }
-        } else if (asmLine->instr == Instructions::Directive_NOBASE) {
-            // Disable use of base-relative addressing
-            m_base = -1;
         }
-    }
 
-    return true;
+        *out += '\n';
+    }
 }
 
-bool Assembler::writeOutput(const std::string &listingFile,
-                            const std::string &objectFile)
+/* Write a Make rule for the object file, so that it is rebuilt when any of
+ * the files it was assembled from changes. Included files also get an empty
+ * rule, so that removing one does not break the build. */
+bool Assembler::writeDepFile(const std::string &path, const std::string &target)
 {
-    // cstdio is better for writing hex information than iostream
-    std::FILE *lst = std::fopen(listingFile.c_str(), "wb");
-    if (lst == nullptr) {
+    std::string rules = makeEscape(target) + ":";
+    for (auto const &file : m_files) {
+        if (file != StdinName) {
+            rules += " " + makeEscape(file);
+        }
+    }
+    rules += "\n";
+
+    for (std::size_t i = 1; i < m_files.size(); ++i) {
+        rules += "\n" + makeEscape(m_files[i]) + ":\n";
+    }
+
+    if (!addOutput(rules.size())) {
         return false;
     }
 
-    std::FILE *obj = std::fopen(objectFile.c_str(), "wb");
-    if (obj == nullptr) {
-        std::fclose(lst);
+    std::FILE *out = std::fopen(path.c_str(), "wb");
+    if (out == nullptr) {
+        error(nullptr, "%s: %s", path.c_str(), std::strerror(errno));
         return false;
     }
 
-    // Write object code header
-    // Col 1:     H
-    // Col 2-7:   Program name
-    // Col 8-13:  Starting address
-    // Col 14-19: Length of program
-    std::fprintf(obj, "H%-6s%06X%06x\n", m_name.c_str(), m_start, m_loc);
+    bool ret = std::fwrite(rules.data(), 1, rules.size(), out) == rules.size();
+    ret = std::fclose(out) == 0 && ret;
 
-    //int objLinePos = 0;
-    unsigned int lineIndex = 0;
+    if (!ret) {
+        error(nullptr, "%s: Write failed", path.c_str());
+    }
 
-    // Current 60 char OP code
-    std::string curObjCode;
+    return ret;
+}
 
-    while (lineIndex < m_lines.size()) {
-        int startingAddr = m_lines[lineIndex]->location;
+/* Write the encoding statistics to a file, or standard output if the path is
+ * "-" */
+bool Assembler::writeStats(const EncodingStats &stats, const std::string &path,
+                           bool json)
+{
+    std::FILE *out = path == "-" ? stdout : std::fopen(path.c_str(), "wb");
+    if (out == nullptr) {
+        error(nullptr, "%s: %s", path.c_str(), std::strerror(errno));
+        return false;
+    }
 
-        while (curObjCode.size() <= 60 && lineIndex < m_lines.size()) {
-            std::string objCode = getObjCodeStr(m_lines[lineIndex]);
-            if (curObjCode.size() + objCode.size() > 60) {
-                break;
-            }
+    bool ret = json ? stats.writeJson(out) : stats.writeTable(out);
+    if (out == stdout) {
+        ret = std::fflush(out) == 0 && ret;
+    } else {
+        ret = std::fclose(out) == 0 && ret;
+    }
+
+    if (!ret) {
+        error(nullptr, "%s: Write failed", path.c_str());
+    }
+
+    return ret;
+}
+
+/* Write the program in the binary object format. The format has no D, R or
+ * M records, so it only holds a single control section without external
+ * references. */
+bool Assembler::writeBinaryObject(const std::string &path)
+{
+    if (m_sections.size() != 1 || hasExternalRefs(m_sections[0])) {
+        error(nullptr, "Binary object format does not support control "
+              "sections or external references");
+        return false;
+    }
 
-            curObjCode += objCode;
-            lineIndex++;
+    Section *section = m_sections[0];
+
+    BinaryObject binObj;
+    binObj.name = section->name;
+    binObj.start = section->start;
+    binObj.length = section->loc - section->start;
+    binObj.entry = getEntryAddr();
+
+    std::vector<ASMLine *> lines(section->lines);
+    std::stable_sort(lines.begin(), lines.end(),
+                     [](const ASMLine *a, const ASMLine *b) {
+        return a->location < b->location;
+    });
+
+    // Object code for all lines, split into segments of contiguous addresses
+    std::vector<unsigned char> bytes;
+    std::vector<std::size_t> offsets;
+    unsigned int nextAddr = 0;
+
+    for (ASMLine *asmLine : lines) {
+        std::size_t size = bytes.size();
+        getObjCodeBytes(asmLine, &bytes);
+        if (bytes.size() == size) {
+            continue;
         }
 
-        // Write text header
-        // Col 1:     T
-        // Col 2-7:   Starting address for object code
-        // Col 8-9:   Length of object code
-        // Col 10-69: Object code in hex
-        std::fprintf(obj, "T%06X%02lX%s\n", startingAddr,
-                     curObjCode.size() / 2, curObjCode.c_str());
+        if (binObj.segments.empty() || asmLine->location != nextAddr) {
+            binObj.segments.push_back({ asmLine->location, 0, nullptr });
+            offsets.push_back(size);
+        }
 
-        curObjCode.clear();
+        binObj.segments.back().size += bytes.size() - size;
+        nextAddr = asmLine->location + (bytes.size() - size);
     }
 
-    // End header
-    // Col 1:   E
-    // Col 2-7: Address of first executable instruction
-    std::fprintf(obj, "E%06X\n", m_start);
+    for (std::size_t i = 0; i < binObj.segments.size(); ++i) {
+        binObj.segments[i].data = bytes.data() + offsets[i];
+    }
 
+    if (!addOutput(bytes.size())) {
+        return false;
+    }
 
-    // Write listing file
-    std::size_t maxLength = 0;
-    for (ASMLine *line : m_lines) {
-        if (line->line.size() > maxLength) {
-            maxLength = line->line.size();
-        }
+    if (!binObj.save(path)) {
+        error(nullptr, "%s", binObj.error().c_str());
+        return false;
     }
 
-    for (ASMLine *asmLine : m_lines) {
-        // Print location
-        if (asmLine->instr == Instructions::Directive_START
-                || m_instrs.isSicXE(asmLine->instr)
-                || m_instrs.isVariable(asmLine->instr)) {
-            std::fprintf(lst, "%04X    ", asmLine->location);
-        } else {
-            std::fprintf(lst, "        ");
+    return true;
+}
+
+/* Write the memory of the loaded program from its start to its end as raw
+ * bytes. Bytes come straight from the encoded lines, and memory that is only
+ * reserved is left as holes in the file. */
+bool Assembler::writeImage(const std::string &path)
+{
+    if (m_sections.size() != 1 || hasExternalRefs(m_sections[0])) {
+        error(nullptr, "Memory image does not support control sections or "
+              "external references");
+        return false;
+    }
+
+    Section *section = m_sections[0];
+
+    // Holes take no space on disk, but the file has the full size
+    if (!addOutput(section->loc - section->start)) {
+        return false;
+    }
+
+    MemoryImage image;
+    std::vector<unsigned char> bytes;
+
+    for (ASMLine *asmLine : section->lines) {
+        bytes.clear();
+        getObjCodeBytes(asmLine, &bytes);
+        if (!bytes.empty()) {
+            image.write(asmLine->location, bytes.data(), bytes.size());
         }
+    }
 
-        // Print original code
-        std::fprintf(lst, "%s", asmLine->line.c_str());
+    if (!image.save(path, section->start, section->loc)) {
+        error(nullptr, "%s", image.error().c_str());
+        return false;
+    }
 
-        std::string objCode = getObjCodeStr(asmLine);
-        if (!objCode.empty()) {
-            std::fprintf(lst, "%s", std::string(
-                    maxLength - asmLine->line.size(), ' ').c_str());
-            std::fprintf(lst, "    %s\n", objCode.c_str());
-        } else {
-            std::fprintf(lst, "\n");
+    return true;
+}
+
+/* Write the address, length and source line of every line that takes space
+ * in memory, and the labels of the program. Addresses of different control
+ * sections overlap, so like the memory image it holds a single section. */
+bool Assembler::writeLineTable(const std::string &path)
+{
+    if (m_sections.size() != 1) {
+        error(nullptr, "Line table does not support control sections");
+        return false;
+    }
+
+    Section *section = m_sections[0];
+
+    LineTable table;
+    for (auto const &file : m_files) {
+        table.addFile(file);
+    }
+
+    for (ASMLine *asmLine : section->lines) {
+        unsigned int size = asmLine->locationNext - asmLine->location;
+        if (!asmLine->removed && size > 0) {
+            table.addEntry({ asmLine->location, size, asmLine->file,
+                             asmLine->lineNumber });
+        }
+    }
+
+    for (std::size_t id = 0; id < section->symbols.size(); ++id) {
+        if (section->symbols[id] != NoAddress) {
+            table.addSymbol(m_symbols.name(id), section->symbols[id]);
         }
     }
 
-    std::fclose(lst);
-    std::fclose(obj);
+    if (!addOutput(table.build())) {
+        return false;
+    }
+
+    if (!table.save(path)) {
+        error(nullptr, "%s", table.error().c_str());
+        return false;
+    }
 
     return true;
 }
 
+/* Address of the END operand, or the start of the first section */
+unsigned int Assembler::getEntryAddr()
+{
+    Section *section = m_sections[0];
+    unsigned int entry = section->start;
+
+    if (!m_entry.empty()) {
+        findLabelAddr(section, m_entry, &entry);
+    }
+
+    return entry;
+}
+
 /* Split string using delimiter and keep only non-empty tokens */
 void Assembler::splitString(std::vector<std::string> *out, const std::string &in,
                             const std::string &delims)
@@ -551,14 +2744,54 @@ void Assembler::splitString(std::vector<std::string> *out, const std::string &in
 	out->swap(split);
 }
 
-/* Search table for the address of a label */
-bool Assembler::findLabelAddr(const std::string &label, unsigned int *out)
+/* Search the section's symbol table for the address of a label */
+bool Assembler::findLabelAddr(Section *section, const std::string &label,
+                              unsigned int *out)
+{
+    return findSymbol(section,
+                      m_symbols.find(Instructions::stripModifiers(label)), out);
+}
+
+bool Assembler::findSymbol(Section *section, uint32_t id, unsigned int *out)
+{
+    if (id >= section->symbols.size() || section->symbols[id] == NoAddress) {
+        return false;
+    }
+
+    *out = section->symbols[id];
+    return true;
+}
+
+void Assembler::defineSymbol(Section *section, uint32_t id, unsigned int addr)
+{
+    if (id >= section->symbols.size()) {
+        section->symbols.resize(m_symbols.size(), NoAddress);
+    }
+
+    section->symbols[id] = addr;
+}
+
+/* Check if a label was imported into the section with EXTREF */
+bool Assembler::isExtRef(Section *section, const std::string &label)
+{
+    return isExtRef(section,
+                    m_symbols.find(Instructions::stripModifiers(label)));
+}
+
+bool Assembler::isExtRef(Section *section, uint32_t id)
 {
-    std::string labelOnly = Instructions::stripModifiers(label);
+    return id != SymbolPool::None
+            && std::find(section->extRefs.begin(), section->extRefs.end(),
+                         id) != section->extRefs.end();
+}
 
-    for (ASMLine *line : m_lines) {
-        if (line->label == labelOnly) {
-            *out = line->location;
+/* Check if the loader has to patch a section with the addresses of other
+ * sections. M records that only relocate the section by its own name are
+ * not needed by formats that are loaded at the start address. */
+bool Assembler::hasExternalRefs(Section *section)
+{
+    for (auto const &mod : section->mods) {
+        if (mod.symbol != section->name) {
             return true;
         }
     }
@@ -566,6 +2799,70 @@ bool Assembler::findLabelAddr(const std::string &label, unsigned int *out)
     return false;
 }
 
+/* Evaluate the operand of a WORD variable. The operand is a sum or difference
+ * of decimal constants and labels, ie. BUFEND-BUFFER. External references
+ * evaluate to 0 and are patched by the loader using M records. Labels are
+ * addresses in the section, so a value with more labels added than
+ * subtracted also gets M records to relocate it with the section. */
+bool Assembler::getWordValue(Section *section, ASMLine *asmLine, int *out)
+{
+    const std::string &expr = asmLine->params[0];
+    int value = 0;
+    std::size_t pos = 0;
+    // Labels added minus labels subtracted
+    int relocations = 0;
+
+    while (pos < expr.size()) {
+        char sign = '+';
+        if (expr[pos] == '+' || expr[pos] == '-') {
+            sign = expr[pos];
+            ++pos;
+        } else if (pos != 0) {
+            section->error = expr;
+            return false;
+        }
+
+        std::size_t end = expr.find_first_of("+-", pos);
+        if (end == std::string::npos) {
+            end = expr.size();
+        }
+
+        std::string term = expr.substr(pos, end - pos);
+        int termValue;
+        unsigned int labelAddr;
+
+        if (term.empty()) {
+            section->error = expr;
+            return false;
+        } else if (strtolWrap(term.c_str(), 10, &termValue)) {
+            // Constant
+        } else if (findLabelAddr(section, term, &labelAddr)) {
+            termValue = labelAddr;
+            relocations += sign == '-' ? -1 : 1;
+        } else if (isExtRef(section, term)) {
+            termValue = 0;
+            section->mods.push_back(
+                    { asmLine->location, 6, sign, term });
+        } else {
+            section->error = "Label not found: ";
+            section->error += term;
+            return false;
+        }
+
+        value += sign == '-' ? -termValue : termValue;
+        pos = end;
+    }
+
+    for (int i = 0; i < std::abs(relocations); ++i) {
+        section->mods.push_back({ asmLine->location, 6,
+                                  relocations > 0 ? '+' : '-',
+                                  section->name });
+    }
+
+    *out = value & 0xFFFFFF;
+    return true;
+}
+
 /* Convert the additional MOV instruction to the SIC/XE equivalent */
 bool Assembler::convertMovToSicXE(const std::vector<std::string> &params,
                                   bool extended,
@@ -781,143 +3078,173 @@ int Assembler::hexCharToInt(unsigned char c)
     }
 }
 
-/* Return object code as a hex string */
-std::string Assembler::getObjCodeStr(ASMLine *asmLine)
+/* Append the object code of a line to a byte buffer */
+void Assembler::getObjCodeBytes(ASMLine *asmLine,
+                                std::vector<unsigned char> *out)
 {
-    std::vector<char> objCode;
+    unsigned int size = 0;
 
-    if (m_instrs.isSicXE(asmLine->instr)) {
-        auto *info = m_instrs[asmLine->instr];
+    if (asmLine->removed) {
+        return;
+    }
 
-        switch (info->length) {
+    if (asmLine->info) {
+        switch (asmLine->info->length) {
         case Instructions::Length::One:
-            objCode.resize(2 + 1);
-            std::sprintf(objCode.data(), "%02X", asmLine->objectCode);
+            size = 1;
             break;
         case Instructions::Length::Two:
-            objCode.resize(4 + 1);
-            std::sprintf(objCode.data(), "%04X", asmLine->objectCode);
+            size = 2;
             break;
         case Instructions::Length::ThreeOrFour:
-            if (Instructions::isExtended(asmLine->instr)) {
-                objCode.resize(8 + 1);
-                std::sprintf(objCode.data(), "%08X", asmLine->objectCode);
-            } else {
-                objCode.resize(6 + 1);
-                std::sprintf(objCode.data(), "%06X", asmLine->objectCode);
-            }
+            size = Instructions::isExtended(asmLine->instr) ? 4 : 3;
             break;
         }
+    } else if (asmLine->instr == Instructions::Variable_WORD) {
+        size = 3;
     } else if (asmLine->instr == Instructions::Variable_BYTE) {
         std::string quoted = getQuoted(asmLine->params[0]);
-        objCode.resize(2 * quoted.size() + 1);
-        for (unsigned int i = 0; i < quoted.size(); ++i) {
-            unsigned char c = quoted[i];
-            std::sprintf(&objCode[2 * i], "%02X", c);
-        }
-    } else {
-        objCode.push_back('\0');
+        out->insert(out->end(), quoted.begin(), quoted.end());
+        return;
     }
 
-    return std::string(objCode.data());
+    // Object code is stored big endian
+    unsigned int objCode = asmLine->objectCode;
+    for (unsigned int i = size; i > 0; --i) {
+        out->push_back((objCode >> (8 * (i - 1))) & 0xFF);
+    }
 }
 
 /* Calculate object code for 1 byte instructions */
-int Assembler::getObjCode1Byte(const Instructions::InstrInfo *info)
+uint32_t Assembler::getObjCode1Byte(const Instructions::InstrInfo *info)
 {
-    return info->opcode;
+    return FormatEncoder<1>::encode(info->opcode);
 }
 
-/* Calculate object code for 2 byte instructions */
-int Assembler::getObjCode2Bytes(const Instructions::InstrInfo *info,
-                                const std::string &reg1, const std::string &reg2)
+/* Calculate object code for 2 byte instructions. The second register is
+ * empty for instructions with one operand. */
+bool Assembler::getObjCode2Bytes(Section *section,
+                                 const Instructions::InstrInfo *info,
+                                 const std::string &reg1,
+                                 const std::string &reg2, uint32_t *out)
 {
-    int regId1, regId2;
-
-    switch (info->type) {
-    case Instructions::Type::OneOp:
-        regId1 = Instructions::getRegister(reg1);
-        regId2 = 0;
-
-        if (regId1 < 0) {
-            // Invalid register
-            return -1;
-        }
-
-        break;
-
-    case Instructions::Type::TwoOp:
-        regId1 = Instructions::getRegister(reg1);
+    int regId1 = Instructions::getRegister(reg1);
+    int regId2 = 0;
+    if (!reg2.empty()) {
         regId2 = Instructions::getRegister(reg2);
+    }
 
-        if (regId1 < 0 || regId2 < 0) {
-            // Invalid registers
-            return -1;
-        }
-
-        break;
-
-    default:
-        // Programmer's error
-        assert(false);
+    if (regId1 < 0 || regId2 < 0) {
+        section->error = "Invalid register: ";
+        section->error += regId1 < 0 ? reg1 : reg2;
+        return false;
     }
 
-    int objCode = 0;
-    objCode += (info->opcode << 8);
-    objCode += ((regId1 & 0xF) << 4); // Operand 1 (maximum 4 bits)
-    objCode += (regId2 & 0xF);        // Operand 2 (maximum 4 bits)
-    return objCode;
+    *out = FormatEncoder<2>::encode(info->opcode, regId1, regId2);
+    return true;
 }
 
 /* Calculate object code for 3 byte and 4 byte instructions */
-int Assembler::getObjCode3Or4Bytes(const Instructions::InstrInfo *info,
-                                   const std::string &instr,
-                                   const std::vector<std::string> &params,
-                                   int prog, int base)
+bool Assembler::getObjCode3Or4Bytes(Section *section,
+                                    const Instructions::InstrInfo *info,
+                                    ASMLine *asmLine, int base, uint32_t *out)
 {
+    const std::vector<std::string> &params = asmLine->params;
+    int prog = asmLine->locationNext;
+
     bool indirect = Instructions::isParamIndirect(params);
     bool immediate = Instructions::isParamImmediate(params);
     bool index = Instructions::isParamIndex(params);
-    bool extended = Instructions::isExtended(instr);
+    bool extended = Instructions::isExtended(asmLine->instr);
 
     bool useBase = false;
     bool useProg = false;
 
     int target = 0;
-    int objCode;
+
+    // Only needed for the statistics
+    EncodingStats::Addressing addressing = EncodingStats::Absolute;
+    bool hasLabel = false;
+    unsigned int labelAddr = 0;
 
     if (info->type == Instructions::Type::ZeroOp) {
         // If there are no operands, then the remaining bits are 0
         target = 0;
-    } else if (info->type == Instructions::Type::TwoOp) {
-        // There are no 3 or 4 byte instructions with two operands
-        // Programmer error
-        assert(false);
     } else {
-        std::string targetStr = Instructions::stripModifiers(params[0]);
+        // One operand, there are no 3 or 4 byte instructions with two
+        // operands
+        uint32_t symbol = asmLine->operand;
 
-        if (strtolWrap(targetStr.c_str(), 10, &target)) {
+        if (symbol == SymbolPool::None) {
             // If target is a number, use the constant directly
+            strtolWrap(Instructions::stripModifiers(params[0]).c_str(), 10,
+                       &target);
+        } else if (isExtRef(section, symbol)) {
+            // External symbols are only known to the loader, which needs the
+            // full 20 bit address field to patch
+            if (!extended) {
+                section->error = "External reference requires format 4: ";
+                section->error += m_symbols.name(symbol);
+                return false;
+            }
+
+            target = 0;
+            section->mods.push_back(
+                    { asmLine->location + 1, 5, '+', m_symbols.name(symbol) });
+            addressing = EncodingStats::External;
         } else {
             // Otherwise, it's a label
-            unsigned int labelAddr;
-            if (!findLabelAddr(targetStr, &labelAddr)) {
-                m_error = "Label not found: ";
-                m_error += targetStr;
-                return -1;
+            if (!findSymbol(section, symbol, &labelAddr)) {
+                section->error = "Label not found: ";
+                section->error += m_symbols.name(symbol);
+                return false;
             }
 
             if (extended) {
-                // If extended, use absolute address
+                // If extended, use absolute address, which the loader
+                // relocates with the section
                 target = labelAddr;
+                section->mods.push_back(
+                        { asmLine->location + 1, 5, '+', section->name });
             } else {
                 // Otherwise, calculate displacement
-                int ret = getRelativeAddr(prog, base, labelAddr,
+                int ret = getRelativeAddr(section, prog, base, labelAddr,
                                           &useProg, &useBase, &target);
                 if (ret < 0) {
-                    return -1;
+                    if (!m_options.displacementWarnings) {
+                        return false;
+                    }
+
+                    // Encoded with no displacement so that the rest of the
+                    // section is still checked
+                    sectionWarning(section, asmLine, "%s",
+                                   section->error.c_str());
+                    target = 0;
                 }
+
+                addressing = useProg ? EncodingStats::PcRelative
+                                     : EncodingStats::BaseRelative;
             }
+            hasLabel = true;
+        }
+    }
+
+    if (statsEnabled()) {
+        EncodingStats::Mode mode = EncodingStats::Simple;
+        if (indirect && !immediate) {
+            mode = EncodingStats::Indirect;
+        } else if (immediate && !indirect) {
+            mode = EncodingStats::Immediate;
+        }
+
+        section->stats.addInstruction(extended ? 4 : 3);
+        section->stats.addOperand(addressing, mode, index);
+        section->stats.addDisplacement(addressing, target);
+
+        std::string fix;
+        if (extended && getFormat3Fix(section, asmLine, base,
+                                      hasLabel ? labelAddr : target, &fix)) {
+            section->stats.addCandidate(asmLine->lineNumber, asmLine->line, fix);
         }
     }
 
@@ -927,34 +3254,85 @@ int Assembler::getObjCode3Or4Bytes(const Instructions::InstrInfo *info,
         immediate = true;
     }
 
-    objCode = 0;
-
+    AddressFlags flags = { indirect, immediate, index, useBase, useProg };
     if (extended) {
-        objCode += (info->opcode << 24);    // op code
-        objCode += (indirect << 25);        // n
-        objCode += (immediate << 24);       // i
-        objCode += (index << 23);           // x
-        objCode += (0 << 22);               // b (always 0)
-        objCode += (0 << 21);               // p (always 0)
-        objCode += (1 << 20);               // e (always 1)
-        objCode += (target & 0xFFFFF);      // Target (20 bits)
+        *out = FormatEncoder<4>::encode(info->opcode, flags, target);
     } else {
-        objCode += (info->opcode << 16);    // op code
-        objCode += (indirect << 17);        // n
-        objCode += (immediate << 16);       // i
-        objCode += (index << 15);           // x
-        objCode += (useBase << 14);         // b
-        objCode += (useProg << 13);         // p
-        objCode += (extended << 12);        // e
-        objCode += (target & 0xFFF);        // Target (12 bits)
+        *out = FormatEncoder<3>::encode(info->opcode, flags, target);
+    }
+
+    return true;
+}
+
+/* Find out whether a format 4 instruction would also fit in format 3, and
+ * what it would take. The location of the next instruction is assumed to move
+ * back by one byte. */
+bool Assembler::getFormat3Fix(Section *section, ASMLine *asmLine, int base,
+                              unsigned int target, std::string *fix)
+{
+    auto *info = asmLine->info;
+    const std::vector<std::string> &params = asmLine->params;
+
+    if (info->type == Instructions::Type::ZeroOp) {
+        *fix = "no operand";
+        return true;
+    }
+
+    if (asmLine->operand == SymbolPool::None) {
+        int number;
+        strtolWrap(Instructions::stripModifiers(params[0]).c_str(), 10,
+                   &number);
+        if (number >= 0 && number <= 4095) {
+            *fix = "constant fits in 12 bits";
+            return true;
+        }
+        return false;
+    }
+
+    if (isExtRef(section, asmLine->operand)) {
+        // The loader needs the 20 bit field
+        return false;
+    }
+
+    int progDiff = target - (asmLine->location + 3);
+    if (progDiff >= -2048 && progDiff <= 2047) {
+        *fix = "PC-relative";
+        return true;
     }
 
-    return objCode;
+    if (base >= 0 && target >= static_cast<unsigned int>(base)
+            && target - base <= 4095) {
+        *fix = "current BASE";
+        return true;
+    }
+
+    // The lowest label in range reaches the most targets after it
+    uint32_t best = SymbolPool::None;
+    unsigned int bestAddr = 0;
+    for (uint32_t id = 0; id < section->symbols.size(); ++id) {
+        unsigned int addr = section->symbols[id];
+        if (addr != NoAddress && addr <= target && target - addr <= 4095
+                && (best == SymbolPool::None || addr < bestAddr
+                    || (addr == bestAddr && std::strcmp(m_symbols.name(id),
+                                                        m_symbols.name(best)) < 0))) {
+            best = id;
+            bestAddr = addr;
+        }
+    }
+
+    if (best != SymbolPool::None) {
+        *fix = "BASE ";
+        *fix += m_symbols.name(best);
+        return true;
+    }
+
+    return false;
 }
 
 /* Get address relative to base register or program counter register */
-int Assembler::getRelativeAddr(int prog, int base, int target,
-                               bool *useProg, bool *useBase, int *addr)
+int Assembler::getRelativeAddr(Section *section, int prog, int base,
+                               int target, bool *useProg, bool *useBase,
+                               int *addr)
 {
     int progDiff = target - prog;
     int baseDiff = target - base;
@@ -973,10 +3351,10 @@ int Assembler::getRelativeAddr(int prog, int base, int target,
         // Try base counter relative
         if (base < 0) {
             // Base register turned off
-            m_error = "Base register not used and program counter out of range";
-            m_error += " (prog. disp.: ";
-            m_error += std::to_string(progDiff);
-            m_error += ")";
+            section->error = "Base register not used and program counter out of range";
+            section->error += " (prog. disp.: ";
+            section->error += std::to_string(progDiff);
+            section->error += ")";
             return -1;
         }
 
@@ -986,12 +3364,12 @@ int Assembler::getRelativeAddr(int prog, int base, int target,
             targetAddr = baseDiff;
         } else {
             // Base out of range
-            m_error = "Base and program counter displacement out of range";
-            m_error += " (prog. disp.: ";
-            m_error += std::to_string(progDiff);
-            m_error += ", base disp.: ";
-            m_error += std::to_string(baseDiff);
-            m_error += ")";
+            section->error = "Base and program counter displacement out of range";
+            section->error += " (prog. disp.: ";
+            section->error += std::to_string(progDiff);
+            section->error += ", base disp.: ";
+            section->error += std::to_string(baseDiff);
+            section->error += ")";
             return -1;
         }
     }
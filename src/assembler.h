@@ -1,42 +1,337 @@
 #pragma once
 
+#include "cancellation.h"
+#include "encodingstats.h"
+#include "format3batch.h"
 #include "instructions.h"
+#include "scanner.h"
+#include "spscring.h"
+#include "symbolpool.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <iosfwd>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/types.h>
 
 class Assembler
 {
 public:
+    struct Options {
+        Options();
+
+        // Also write the program in the binary object format (.sxo)
+        bool binaryObject;
+        // Also write a flat image of the program's memory (.img)
+        bool image;
+        // Also write a table mapping addresses to source lines (.sxl)
+        bool lineTable;
+        // Write the listing file (.lst)
+        bool listing;
+        // Object file to write, "-" for standard output. By default it is
+        // named after the input file.
+        std::string objectFile;
+        // Write the listing to this file descriptor instead of a file
+        int listingFd;
+        // Write encoding statistics as a table or as JSON to these files,
+        // "-" for standard output
+        std::string statsFile;
+        std::string statsJsonFile;
+        // Write a Make rule listing the source and included files of the
+        // object file to this file
+        std::string depFile;
+        // Read and lex the input on a separate thread while pass 1 runs
+        bool pipeline;
+        // Print diagnostics to standard error as they are found
+        bool printDiagnostics;
+        // Report format 3 operands that are out of reach of both PC-relative
+        // and base-relative addressing as warnings and keep encoding, instead
+        // of failing
+        bool displacementWarnings;
+
+        // Limits for assembling untrusted input, 0 for none. The input size
+        // includes the included files, and the output size counts every
+        // output file.
+        std::size_t maxInputSize;
+        std::size_t maxLines;
+        std::size_t maxOutputSize;
+        // Wall time for the whole program, in milliseconds
+        unsigned int timeLimitMs;
+        // Size of the address space, which the location counter has to stay
+        // in. It is the 20 bits of SIC/XE by default.
+        uint32_t addressSpace;
+        // Stop and fail once this is cancelled
+        const CancellationToken *cancel;
+        // Remove data that nothing refers to and code that cannot be
+        // reached before encoding
+        bool removeUnused;
+        // Names for IF conditions and their values
+        std::unordered_map<std::string, int> definitions;
+    };
+
+    struct Diagnostic {
+        enum Severity
+        {
+            Error,
+            Warning
+        };
+
+        Severity severity;
+        // Index into sourceFiles(), and line number, which is 0 if the
+        // diagnostic is not about a line
+        unsigned int file;
+        unsigned int lineNumber;
+        std::string message;
+        // Source text of the line
+        std::string line;
+    };
+
+    // A line of the last program, with the object code of its section if
+    // the section could be encoded
+    struct LineInfo {
+        unsigned int file;
+        unsigned int lineNumber;
+        unsigned int address;
+        // The line has an address of its own, as shown in the listing
+        bool hasAddress;
+        bool encoded;
+        std::vector<unsigned char> objectCode;
+    };
+
     Assembler();
     ~Assembler();
 
+    Assembler(const Assembler &) = delete;
+    Assembler & operator=(const Assembler &) = delete;
+
+    void setOptions(const Options &options);
+
+    void reset();
+
     bool assembleFile(const std::string &path);
 
+    // Assemble source held in memory, without writing any output. The name
+    // is used in diagnostics and INCLUDE paths are relative to it.
+    bool assembleText(const std::string &name, const std::string &text);
+
+    // Files read by the last program, the input first
+    const std::vector<std::string> & sourceFiles() const;
+
+    // Errors and warnings of the last program
+    const std::vector<Diagnostic> & diagnostics() const;
+
+    // Lines of the last program in source order. There are none if pass 1
+    // did not complete, since locations are not final until then.
+    void getLineInfo(std::vector<LineInfo> *out);
+
 private:
+    // A source file split into lines and tokens, without comments. Included
+    // files are kept across programs and only read again when they change on
+    // disk.
+    struct Module {
+        bool loaded;
+        struct timespec mtime;
+        off_t size;
+        std::vector<std::string> lines;
+        std::vector<std::vector<std::string>> tokens;
+    };
+
+    // Lines of the input lexed by the reader thread in pipelined mode
+    struct Batch {
+        Module module;
+        // Line number of the first line
+        unsigned int firstLine;
+        // Last batch of the input
+        bool last;
+        // Reading failed after the lines of this batch
+        bool failed;
+        // Read buffer, reused for the next batch in this slot
+        std::string text;
+    };
+
+    // A line of the program after INCLUDE directives have been expanded
+    struct SourceLine {
+        const std::string *line;
+        const std::vector<std::string> *tokens;
+        unsigned int file;
+        unsigned int lineNumber;
+    };
+
+    // An IF directive whose ENDIF has not been reached yet. Only the
+    // innermost one can be inactive, as the IFs nested in a region that is
+    // not assembled are skipped along with it.
+    struct Condition {
+        unsigned int file;
+        unsigned int lineNumber;
+        std::string line;
+        // The lines up to the next ELSE or ENDIF are assembled
+        bool active;
+        // A branch has been assembled
+        bool taken;
+        bool hasElse;
+    };
+
     struct ASMLine {
+        // Index into m_files
+        unsigned int file;
         unsigned int lineNumber;
         std::string line;
         unsigned int location;
         unsigned int locationNext;
-        std::string label;
+        unsigned int block;
+        // Symbol IDs of the label and of a format 3/4 operand
+        uint32_t label;
+        uint32_t operand;
         std::string instr;
+        // Instruction looked up in pass 1, null for directives and variables
+        const Instructions::InstrInfo *info;
         std::vector<std::string> params;
-        int objectCode;
+        uint32_t objectCode;
+        // The listing shows the location of this line
+        bool listLocation;
+        // Removed as unused, the line takes no space and has no object code
+        bool removed;
+    };
+
+    // Location of an address field that must be patched by the loader, with
+    // the address of an external symbol, or with the load address of the
+    // section if the symbol is the name of the section
+    struct Modification {
+        unsigned int address;
+        unsigned int halfBytes;
+        char sign;
+        std::string symbol;
+    };
+
+    // A program block has its own location counter within a section. Blocks
+    // are laid out one after another at the end of pass 1.
+    struct Block {
+        std::string name;
+        unsigned int loc;
+        unsigned int address;
+        unsigned int order;
+        bool hasCode;
+        bool hasData;
+    };
+
+    // A control section has its own location counter and symbol table, so
+    // pass 2 can run on each section independently. Anything written during
+    // pass 2 lives here rather than in the Assembler so that sections can be
+    // encoded concurrently.
+    struct Section {
+        std::string name;
+        unsigned int start;
+        unsigned int loc;
+        std::vector<Block> blocks;
+        std::vector<ASMLine *> lines;
+        // Address of each symbol ID, NoAddress if it is not defined here
+        std::vector<unsigned int> symbols;
+        std::vector<uint32_t> extDefs;
+        std::vector<uint32_t> extRefs;
+        std::vector<Modification> mods;
+        std::string error;
+        std::vector<Diagnostic> diagnostics;
+        // Pass 2 completed
+        bool encoded;
+        EncodingStats stats;
+    };
+
+    // Format 3 lines of a section waiting to be encoded as a batch
+    struct PendingFormat3 {
+        Format3Batch batch;
+        ASMLine *lines[Format3Batch::Capacity];
     };
 
     void error(ASMLine *asmLine, const char *fmt, ...);
+    void sourceError(const SourceLine &source, const char *fmt, ...);
+    void sectionError(Section *section, ASMLine *asmLine, const char *fmt, ...);
+    void sectionWarning(Section *section, ASMLine *asmLine,
+                        const char *fmt, ...);
+    Diagnostic makeDiagnostic(Diagnostic::Severity severity,
+                              unsigned int file, unsigned int lineNumber,
+                              const std::string *line, const char *fmt,
+                              va_list ap);
+    std::string formatDiagnostic(const Diagnostic &diagnostic);
+    void report(const Diagnostic &diagnostic);
+
+    const char * interruption() const;
+    bool shouldStop();
+    bool addInput(std::size_t bytes);
+    bool addOutput(std::size_t bytes);
+
+    ASMLine * newLine();
+    Section * newSection();
+
+    const Module * loadModule(const std::string &path);
+    bool expandIncludes(unsigned int file, const Module &module,
+                        unsigned int firstLine,
+                        std::vector<unsigned int> *stack);
+    bool getIncludeName(const SourceLine &source, std::string *out);
+    bool conditional(const SourceLine &source);
+    bool evaluateCondition(const std::string &expr, bool *out);
+    std::size_t skipInactive(const Module &module, std::size_t i);
+    void conditionError(const Condition &condition, const char *msg);
 
-    bool pass1(const std::vector<std::string> &lines);
+    void readBatches(int fd);
+    bool waitForInput(int fd, int timeoutMs);
+    bool readInput(int fd, std::string *text, std::size_t limit);
+    void signalBatches();
+    bool pass1Pipelined(int fd);
+    bool nextSourceLine(const SourceLine **out);
 
-    bool pass2();
+    bool pass1();
 
-    bool writeOutput(const std::string &listingFile,
-                     const std::string &objectFile);
+    void layoutBlocks(Section *section);
+    void removeUnused();
+    void removeUnused(Section *section, bool first, std::size_t *lines,
+                      unsigned int *bytes);
+
+    bool pass2(Section *section);
+    bool encodeLine(Section *section, ASMLine *asmLine, unsigned int *base,
+                    PendingFormat3 *pending);
+    bool queueFormat3(Section *section, ASMLine *asmLine, int base,
+                      PendingFormat3 *pending);
+    bool flushFormat3(Section *section, PendingFormat3 *pending);
+    bool encodeSections();
+
+    bool writeObjectFile(const std::string &path);
+    bool writeListingFile(const std::string &path);
+    bool writeListingFd(int fd);
+    bool writeObject(std::FILE *obj);
+    std::size_t writeTextRecord(std::FILE *obj, unsigned int address,
+                                const unsigned char *bytes, std::size_t size);
+    bool writeListing(std::FILE *lst);
+    void formatListing(std::size_t first, std::size_t last, std::string *out);
+    bool writeBinaryObject(const std::string &path);
+    bool writeImage(const std::string &path);
+    bool writeLineTable(const std::string &path);
+    bool writeDepFile(const std::string &path, const std::string &target);
+    bool writeStats(const EncodingStats &stats, const std::string &path,
+                    bool json);
+
+    unsigned int getEntryAddr();
+
+    bool statsEnabled() const;
 
     void splitString(std::vector<std::string> *out, const std::string &in,
                      const std::string &delims);
 
-    bool findLabelAddr(const std::string &label, unsigned int *out);
+    bool findLabelAddr(Section *section, const std::string &label,
+                       unsigned int *out);
+    bool findSymbol(Section *section, uint32_t id, unsigned int *out);
+    void defineSymbol(Section *section, uint32_t id, unsigned int addr);
+    bool isExtRef(Section *section, const std::string &label);
+    bool isExtRef(Section *section, uint32_t id);
+    bool hasExternalRefs(Section *section);
+
+    bool getWordValue(Section *section, ASMLine *asmLine, int *out);
 
     bool convertMovToSicXE(const std::vector<std::string> &params,
                            bool extended,
@@ -54,25 +349,63 @@ private:
     std::string getQuoted(const std::string &str);
     int hexCharToInt(unsigned char c);
 
-    std::string getObjCodeStr(ASMLine *asmLine);
+    void getObjCodeBytes(ASMLine *asmLine, std::vector<unsigned char> *out);
 
-    int getObjCode1Byte(const Instructions::InstrInfo *info);
-    int getObjCode2Bytes(const Instructions::InstrInfo *info,
-                         const std::string &reg1, const std::string &reg2);
-    int getObjCode3Or4Bytes(const Instructions::InstrInfo *info,
-                            const std::string &instr,
-                            const std::vector<std::string> &params,
-                            int prog, int base);
+    uint32_t getObjCode1Byte(const Instructions::InstrInfo *info);
+    bool getObjCode2Bytes(Section *section, const Instructions::InstrInfo *info,
+                          const std::string &reg1, const std::string &reg2,
+                          uint32_t *out);
+    bool getObjCode3Or4Bytes(Section *section,
+                             const Instructions::InstrInfo *info,
+                             ASMLine *asmLine, int base, uint32_t *out);
 
-    int getRelativeAddr(int prog, int base, int target,
+    int getRelativeAddr(Section *section, int prog, int base, int target,
                         bool *useProg, bool *useBase, int *addr);
+    bool getFormat3Fix(Section *section, ASMLine *asmLine, int base,
+                       unsigned int target, std::string *fix);
 
-    std::string m_path;
+    Options m_options;
+    // The input file and the files it includes
+    std::vector<std::string> m_files;
+    Scanner m_scanner;
+    // Text of the file being read, reused for every file
+    std::string m_text;
+    Module m_main;
+    std::unordered_map<std::string, Module> m_modules;
+    std::vector<SourceLine> m_input;
+    // Next line of m_input for pass 1
+    std::size_t m_inputPos;
+    // Open IF directives, and IFs nested in the region being skipped
+    std::vector<Condition> m_conditions;
+    unsigned int m_skipDepth;
+    // Batches from the reader thread, and the batch m_input points into
+    SpscRing<Batch> m_batches;
+    Batch *m_batch;
+    std::atomic<bool> m_stopReader;
+    // Both sides of m_batches sleep on m_batchCond while the ring is full or
+    // empty. The reader also polls m_stopPipe, so that it can be stopped
+    // while it waits for input.
+    std::mutex m_batchMutex;
+    std::condition_variable m_batchCond;
+    int m_stopPipe[2];
     std::vector<ASMLine *> m_lines;
+    SymbolPool m_symbols;
+    std::size_t m_maxLineLength;
+    std::vector<Section *> m_sections;
+    // Pass 1 completed, so line locations are final
+    bool m_located;
+    std::vector<Diagnostic> m_diagnostics;
+    // Limits of the program being assembled
+    std::chrono::steady_clock::time_point m_deadline;
+    std::size_t m_inputSize;
+    std::size_t m_outputSize;
+    // A limit was reached or the program was cancelled, and this has been
+    // reported
+    bool m_stopped;
+    // Lines and sections of previous programs, kept for reuse
+    std::vector<ASMLine *> m_freeLines;
+    std::vector<Section *> m_freeSections;
     Instructions m_instrs;
-    unsigned int m_loc;
-    unsigned int m_base;
-    unsigned int m_start;
-    std::string m_name;
+    std::string m_entry;
     std::string m_error;
 };
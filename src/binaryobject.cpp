@@ -0,0 +1,222 @@
+#include "binaryobject.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+const char BinaryObject::Magic[4] = { 'S', 'X', 'O', 'B' };
+const uint32_t BinaryObject::Version = 1;
+
+static const std::size_t HeaderSize = 32;
+static const std::size_t SegmentEntrySize = 16;
+static const std::size_t SegmentAlignment = 16;
+
+static void putLE32(unsigned char *p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t getLE32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static std::size_t alignUp(std::size_t value)
+{
+    return (value + SegmentAlignment - 1) & ~(SegmentAlignment - 1);
+}
+
+BinaryObject::BinaryObject()
+    : start(0), length(0), entry(0), m_map(nullptr), m_mapSize(0)
+{
+}
+
+BinaryObject::~BinaryObject()
+{
+    unmap();
+}
+
+void BinaryObject::unmap()
+{
+    if (m_map) {
+        munmap(m_map, m_mapSize);
+        m_map = nullptr;
+        m_mapSize = 0;
+    }
+}
+
+const std::string & BinaryObject::error() const
+{
+    return m_error;
+}
+
+bool BinaryObject::save(const std::string &path)
+{
+    std::size_t tableSize = SegmentEntrySize * segments.size();
+
+    // Build the header and segment table in memory so the file can be written
+    // with a few large writes
+    std::vector<unsigned char> head(alignUp(HeaderSize + tableSize), 0);
+
+    std::memcpy(&head[0], Magic, sizeof(Magic));
+    putLE32(&head[4], Version);
+    std::memcpy(&head[8], name.data(), std::min<std::size_t>(name.size(), 8));
+    putLE32(&head[16], start);
+    putLE32(&head[20], length);
+    putLE32(&head[24], entry);
+    putLE32(&head[28], segments.size());
+
+    std::size_t offset = head.size();
+    for (std::size_t i = 0; i < segments.size(); ++i) {
+        unsigned char *p = &head[HeaderSize + SegmentEntrySize * i];
+        putLE32(p, segments[i].address);
+        putLE32(p + 4, segments[i].size);
+        putLE32(p + 8, offset);
+        putLE32(p + 12, 0);
+        offset = alignUp(offset + segments[i].size);
+    }
+
+    std::FILE *fp = std::fopen(path.c_str(), "wb");
+    if (fp == nullptr) {
+        m_error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    static const unsigned char padding[SegmentAlignment] = { 0 };
+
+    bool ok = std::fwrite(head.data(), 1, head.size(), fp) == head.size();
+    for (std::size_t i = 0; ok && i < segments.size(); ++i) {
+        std::size_t size = segments[i].size;
+        std::size_t pad = alignUp(size) - size;
+        ok = std::fwrite(segments[i].data, 1, size, fp) == size
+                && std::fwrite(padding, 1, pad, fp) == pad;
+    }
+
+    if (std::fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        m_error = path + ": Failed to write binary object";
+    }
+
+    return ok;
+}
+
+bool BinaryObject::load(const std::string &path)
+{
+    unmap();
+    segments.clear();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        m_error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        m_error = path + ": " + std::strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    if (static_cast<std::size_t>(sb.st_size) < HeaderSize) {
+        m_error = path + ": File too small for binary object header";
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        m_error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    m_map = map;
+    m_mapSize = sb.st_size;
+
+    auto *base = static_cast<const unsigned char *>(m_map);
+
+    if (std::memcmp(base, Magic, sizeof(Magic)) != 0) {
+        m_error = path + ": Not a binary object file";
+        return false;
+    }
+
+    if (getLE32(base + 4) != Version) {
+        m_error = path + ": Unsupported binary object version";
+        return false;
+    }
+
+    const char *namePtr = reinterpret_cast<const char *>(base + 8);
+    name.assign(namePtr, strnlen(namePtr, 8));
+    start = getLE32(base + 16);
+    length = getLE32(base + 20);
+    entry = getLE32(base + 24);
+    uint32_t count = getLE32(base + 28);
+
+    if (count > (m_mapSize - HeaderSize) / SegmentEntrySize) {
+        m_error = path + ": Segment table extends past end of file";
+        return false;
+    }
+
+    segments.reserve(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const unsigned char *p = base + HeaderSize + SegmentEntrySize * i;
+        uint32_t address = getLE32(p);
+        uint32_t size = getLE32(p + 4);
+        uint32_t offset = getLE32(p + 8);
+
+        if (offset > m_mapSize || size > m_mapSize - offset) {
+            m_error = path + ": Segment " + std::to_string(i)
+                    + " extends past end of file";
+            return false;
+        }
+
+        if (address < start || size > length
+                || address - start > length - size) {
+            m_error = path + ": Segment " + std::to_string(i)
+                    + " is outside of the program";
+            return false;
+        }
+
+        segments.push_back({ address, size, base + offset });
+    }
+
+    return true;
+}
+
+/* Convert to the standard H/T/E text records */
+bool BinaryObject::writeText(std::FILE *out)
+{
+    std::fprintf(out, "H%-6s%06X%06X\n", name.c_str(), start, length);
+
+    for (auto const &segment : segments) {
+        // Text records hold at most 30 bytes
+        for (uint32_t offset = 0; offset < segment.size; offset += 30) {
+            uint32_t size = std::min<uint32_t>(segment.size - offset, 30);
+
+            std::fprintf(out, "T%06X%02X", segment.address + offset, size);
+            for (uint32_t i = 0; i < size; ++i) {
+                std::fprintf(out, "%02X", segment.data[offset + i]);
+            }
+            std::fprintf(out, "\n");
+        }
+    }
+
+    std::fprintf(out, "E%06X\n", entry);
+
+    return !std::ferror(out);
+}
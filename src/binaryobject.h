@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* Compact binary alternative to the H/T/E text records. All integers are
+ * little endian.
+ *
+ * Header (32 bytes):
+ *   0:  Magic "SXOB"
+ *   4:  Format version (1)
+ *   8:  Program name, padded with NUL bytes (8 bytes)
+ *   16: Starting address
+ *   20: Length of program
+ *   24: Address of first executable instruction
+ *   28: Number of segments
+ *
+ * Segment table (16 bytes per segment, sorted by address):
+ *   0:  Load address
+ *   4:  Size in bytes
+ *   8:  File offset of the raw bytes
+ *   12: Reserved (0)
+ *
+ * The raw bytes of each segment follow the table, each starting on a 16 byte
+ * boundary. A loaded file is mmapped and the segments point directly into the
+ * mapping. */
+class BinaryObject
+{
+public:
+    struct Segment {
+        uint32_t address;
+        uint32_t size;
+        const unsigned char *data;
+    };
+
+    static const char Magic[4];
+    static const uint32_t Version;
+
+    BinaryObject();
+    ~BinaryObject();
+
+    BinaryObject(const BinaryObject &) = delete;
+    BinaryObject & operator=(const BinaryObject &) = delete;
+
+    bool save(const std::string &path);
+    bool load(const std::string &path);
+
+    bool writeText(std::FILE *out);
+
+    std::string name;
+    uint32_t start;
+    uint32_t length;
+    uint32_t entry;
+    std::vector<Segment> segments;
+
+    const std::string & error() const;
+
+private:
+    void unmap();
+
+    void *m_map;
+    std::size_t m_mapSize;
+    std::string m_error;
+};
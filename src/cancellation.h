@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+
+/* Lets another thread stop a running assembly. The assembler checks the
+ * token every few lines and in its output loops, and fails with a diagnostic
+ * once it has been cancelled. A token stays cancelled until it is reset. */
+class CancellationToken
+{
+public:
+    CancellationToken() : m_cancelled(false)
+    {
+    }
+
+    CancellationToken(const CancellationToken &) = delete;
+    CancellationToken & operator=(const CancellationToken &) = delete;
+
+    void cancel()
+    {
+        m_cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        m_cancelled.store(false, std::memory_order_relaxed);
+    }
+
+    bool isCancelled() const
+    {
+        return m_cancelled.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<bool> m_cancelled;
+};
@@ -0,0 +1,850 @@
+#include "disassembler.h"
+
+#include "binaryobject.h"
+#include "objectloader.h"
+
+#include <cstring>
+
+#include <fstream>
+
+
+// Per byte flags
+static const uint8_t FlagLoaded = 1 << 0;   // Byte came from a text record
+static const uint8_t FlagCode = 1 << 1;     // Byte is part of an instruction
+static const uint8_t FlagInstr = 1 << 2;    // First byte of an instruction
+static const uint8_t FlagLabel = 1 << 3;    // Address needs a label
+static const uint8_t FlagWord = 1 << 4;     // Data is used as a word
+
+// Maximum number of bytes in one BYTE variable
+static const uint32_t MaxDataBytes = 16;
+
+static const uint32_t AddrMask = (1 << 20) - 1;
+
+static std::string trim(const char *str, std::size_t len)
+{
+    std::string result(str, len);
+    result.erase(result.find_last_not_of(' ') + 1);
+    return result;
+}
+
+static uint32_t parseHex(const char *str, std::size_t len)
+{
+    uint32_t value = 0;
+    for (std::size_t i = 0; i < len; ++i) {
+        char c = str[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        }
+    }
+    return value;
+}
+
+static void appendHex(std::string *out, const unsigned char *bytes, std::size_t size)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+
+    for (std::size_t i = 0; i < size; ++i) {
+        *out += hexDigits[bytes[i] >> 4];
+        *out += hexDigits[bytes[i] & 0xF];
+    }
+}
+
+static std::string hexAddr(uint32_t addr)
+{
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "%04X", addr);
+    return buf;
+}
+
+Disassembler::Disassembler()
+{
+}
+
+const std::string & Disassembler::error() const
+{
+    return m_error;
+}
+
+bool Disassembler::disassembleFile(const std::string &path, std::FILE *out)
+{
+    std::vector<Image> images;
+    if (!loadImages(path, &images)) {
+        return false;
+    }
+
+    std::string text;
+
+    for (std::size_t i = 0; i < images.size(); ++i) {
+        Image *image = &images[i];
+
+        findCode(image);
+        disassemble(image, i == 0, &text);
+    }
+
+    // The entry point is an operand of END
+    const Image &first = images[0];
+    std::string entry;
+    if (first.hasEntry && isPlaceable(first, first.entry)) {
+        entry = labelName(first, first.entry);
+    }
+    writeLine(&text, std::string(), Instructions::Directive_END, entry,
+              std::string());
+
+    if (std::fwrite(text.data(), 1, text.size(), out) != text.size()) {
+        m_error = "Failed to write output";
+        return false;
+    }
+
+    return true;
+}
+
+/* Read each program of a text or binary object into its own memory image */
+bool Disassembler::loadImages(const std::string &path,
+                              std::vector<Image> *images)
+{
+    char magic[4] = { 0 };
+    std::ifstream file(path, std::ios::binary);
+    file.read(magic, sizeof(magic));
+    file.close();
+
+    if (std::memcmp(magic, BinaryObject::Magic, sizeof(magic)) == 0) {
+        BinaryObject binObj;
+        if (!binObj.load(path)) {
+            m_error = binObj.error();
+            return false;
+        }
+
+        Image image;
+        image.name = binObj.name;
+        image.start = binObj.start;
+        image.length = binObj.length;
+        image.entry = binObj.entry;
+        image.hasEntry = true;
+        image.bytes.assign(image.length, 0);
+        image.flags.assign(image.length, 0);
+
+        for (auto const &segment : binObj.segments) {
+            uint32_t offset = segment.address - image.start;
+            std::memcpy(&image.bytes[offset], segment.data, segment.size);
+            std::memset(&image.flags[offset], FlagLoaded, segment.size);
+        }
+
+        images->push_back(std::move(image));
+        return true;
+    }
+
+    ObjectLoader loader;
+    if (!loader.open(path)) {
+        m_error = loader.error();
+        return false;
+    }
+
+    for (auto const &prog : loader.programs()) {
+        Image image;
+        image.name = prog.name;
+        image.start = prog.start;
+        image.length = prog.length;
+        image.entry = prog.entry;
+        image.hasEntry = prog.hasEntry;
+        image.bytes.assign(image.length, 0);
+        image.flags.assign(image.length, 0);
+
+        for (auto const &record : prog.text) {
+            uint32_t offset = record.address - image.start;
+            if (!ObjectLoader::decodeHex(record.hex, record.size,
+                                         &image.bytes[offset])) {
+                m_error = path + ":" + std::to_string(record.line)
+                        + ": Invalid hex digit in text record";
+                return false;
+            }
+            std::memset(&image.flags[offset], FlagLoaded, record.size);
+        }
+
+        // Col 2-73: Pairs of symbol name (6 chars) and address
+        for (auto const &record : prog.defs) {
+            for (uint32_t i = 1; i + 12 <= record.size; i += 12) {
+                std::string name = trim(record.data + i, 6);
+                uint32_t addr = parseHex(record.data + i + 6, 6);
+                image.defs.push_back(std::make_pair(name, addr));
+
+                if (addr >= image.start && addr - image.start < image.length) {
+                    image.names[addr] = name;
+                }
+            }
+        }
+
+        // Col 2-73: Symbol names (6 chars)
+        for (auto const &record : prog.refs) {
+            for (uint32_t i = 1; i < record.size; i += 6) {
+                image.refs.push_back(trim(record.data + i,
+                                          std::min<uint32_t>(6, record.size - i)));
+            }
+        }
+
+        // Col 2-7: Address, Col 8-9: Half-bytes, Col 10: Sign, Col 11-: Symbol
+        for (auto const &record : prog.mods) {
+            uint32_t addr = parseHex(record.data + 1, 6);
+            Modification mod;
+            mod.halfBytes = parseHex(record.data + 7, 2);
+            // Records without a sign or symbol relocate the program
+            mod.sign = record.size > 9 ? record.data[9] : '+';
+            if (record.size > 10) {
+                mod.symbol = trim(record.data + 10, record.size - 10);
+            }
+            if (mod.symbol.empty()) {
+                mod.symbol = image.name;
+            }
+            image.mods[addr].push_back(mod);
+
+            // Words patched by the loader must stay words
+            if (mod.halfBytes == 6 && addr >= image.start
+                    && addr - image.start < image.length) {
+                image.flags[addr - image.start] |= FlagWord;
+            }
+        }
+
+        images->push_back(std::move(image));
+    }
+
+    return true;
+}
+
+/* Decode the instruction at an offset. Fails if the opcode is invalid or the
+ * instruction overlaps bytes that are not loaded. */
+bool Disassembler::decodeAt(const Image &image, uint32_t offset, Decoded *d)
+{
+    if (offset >= image.length) {
+        return false;
+    }
+
+    const unsigned char *p = &image.bytes[offset];
+    d->info = m_instrs.byOpcode(p[0]);
+    if (d->info == nullptr) {
+        return false;
+    }
+
+    d->n = d->i = d->x = d->b = d->p = d->e = false;
+    d->disp = 0;
+    d->r1 = d->r2 = 0;
+
+    switch (d->info->length) {
+    case Instructions::Length::One:
+        d->length = 1;
+        break;
+    case Instructions::Length::Two:
+        d->length = 2;
+        break;
+    case Instructions::Length::ThreeOrFour:
+        d->length = (offset + 1 < image.length && (p[1] & 0x10)) ? 4 : 3;
+        break;
+    }
+
+    if (offset + d->length > image.length) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < d->length; ++i) {
+        if (!(image.flags[offset + i] & FlagLoaded)) {
+            return false;
+        }
+    }
+
+    if (d->length == 2) {
+        d->r1 = p[1] >> 4;
+        d->r2 = p[1] & 0xF;
+    } else if (d->length >= 3) {
+        d->n = p[0] & 0x2;
+        d->i = p[0] & 0x1;
+        d->x = p[1] & 0x80;
+        d->b = p[1] & 0x40;
+        d->p = p[1] & 0x20;
+        d->e = p[1] & 0x10;
+
+        if (d->e) {
+            d->disp = ((p[1] & 0xF) << 16) | (p[2] << 8) | p[3];
+        } else {
+            d->disp = ((p[1] & 0xF) << 8) | p[2];
+        }
+    }
+
+    return true;
+}
+
+/* Target address of a format 3 or 4 instruction, if it can be determined
+ * statically. A negative base means the base register is unknown. */
+bool Disassembler::getTargetAddr(const Image &image, uint32_t offset,
+                                 const Decoded &d, int64_t base,
+                                 uint32_t *target)
+{
+    if (d.length < 3 || d.x) {
+        return false;
+    }
+
+    uint32_t addr = image.start + offset;
+
+    if (d.e) {
+        // External references are resolved by the loader
+        if (d.b || d.p || hasExternalMod(image, addr + 1)) {
+            return false;
+        }
+        *target = d.disp;
+    } else if (d.p && d.b) {
+        return false;
+    } else if (d.p) {
+        *target = (addr + 3 + ((d.disp ^ 0x800) - 0x800)) & AddrMask;
+    } else if (d.b) {
+        if (base < 0) {
+            return false;
+        }
+        *target = (base + d.disp) & AddrMask;
+    } else {
+        *target = d.disp;
+    }
+
+    return true;
+}
+
+static bool overlapsCode(const std::vector<uint8_t> &flags, uint32_t offset,
+                         uint32_t length)
+{
+    for (uint32_t i = 0; i < length; ++i) {
+        if (flags[offset + i] & FlagCode) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Mark the instructions reachable from the entry point */
+void Disassembler::findCode(Image *image)
+{
+    std::vector<uint32_t> pending;
+
+    if (image->hasEntry) {
+        pending.push_back(image->entry - image->start);
+    } else {
+        pending.push_back(0);
+    }
+
+    while (!pending.empty()) {
+        uint32_t offset = pending.back();
+        pending.pop_back();
+
+        Decoded d;
+        while (decodeAt(*image, offset, &d)
+                && !overlapsCode(image->flags, offset, d.length)) {
+            // The assembler never writes SIC format instructions, so these are
+            // most likely data following the code
+            if (d.length >= 3 && !d.n && !d.i) {
+                break;
+            }
+
+            image->flags[offset] |= FlagInstr;
+            for (uint32_t i = 0; i < d.length; ++i) {
+                image->flags[offset + i] |= FlagCode;
+            }
+
+            Instructions::SicXE instr = d.info->instr;
+
+            if (instr == Instructions::SicXE::J
+                    || instr == Instructions::SicXE::JEQ
+                    || instr == Instructions::SicXE::JGT
+                    || instr == Instructions::SicXE::JLT
+                    || instr == Instructions::SicXE::JSUB) {
+                uint32_t target;
+                if (d.n && d.i && getTargetAddr(*image, offset, d, -1, &target)
+                        && target >= image->start
+                        && target - image->start < image->length) {
+                    pending.push_back(target - image->start);
+                }
+            }
+
+            // Execution does not continue after unconditional jumps
+            if (instr == Instructions::SicXE::J
+                    || instr == Instructions::SicXE::RSUB) {
+                break;
+            }
+
+            offset += d.length;
+        }
+    }
+}
+
+/* Check if the loader patches the field at an address with another program.
+ * Relocation by the program's own name leaves the assembled address. */
+bool Disassembler::hasExternalMod(const Image &image, uint32_t addr)
+{
+    auto it = image.mods.find(addr);
+    if (it == image.mods.end()) {
+        return false;
+    }
+
+    for (auto const &mod : it->second) {
+        if (mod.symbol != image.name) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Net count of relocations by the program's own name of the word at an
+ * address. A word holding one address of the program has a count of 1. */
+int Disassembler::getRelocations(const Image &image, uint32_t addr)
+{
+    int count = 0;
+    auto it = image.mods.find(addr);
+    if (it != image.mods.end()) {
+        for (auto const &mod : it->second) {
+            if (mod.symbol == image.name) {
+                count += mod.sign == '-' ? -1 : 1;
+            }
+        }
+    }
+
+    return count;
+}
+
+/* Labels can only be placed at the start of an instruction or on data */
+bool Disassembler::isPlaceable(const Image &image, uint32_t addr)
+{
+    if (addr < image.start || addr - image.start >= image.length) {
+        return false;
+    }
+
+    uint8_t flags = image.flags[addr - image.start];
+    return !(flags & FlagCode) || (flags & FlagInstr);
+}
+
+std::string Disassembler::labelName(const Image &image, uint32_t addr)
+{
+    auto it = image.names.find(addr);
+    if (it != image.names.end()) {
+        return it->second;
+    }
+
+    return "L" + hexAddr(addr);
+}
+
+std::string Disassembler::getRegisterName(uint32_t reg)
+{
+    static const char *names[] = {
+        "A", "X", "L", "B", "S", "T", "F", nullptr, "PC", "SW"
+    };
+
+    if (reg < sizeof(names) / sizeof(names[0]) && names[reg]) {
+        return names[reg];
+    }
+
+    return std::string();
+}
+
+/* Build the operand that assembles back to the decoded instruction. Returns
+ * false if there is no such operand, ie. for base-relative addressing where
+ * the assembler would choose PC-relative addressing. If the operand requires a
+ * BASE directive, the base address is returned in needBase. */
+bool Disassembler::getOperand(Image *image, uint32_t offset, const Decoded &d,
+                              int64_t base, std::string *operand,
+                              int64_t *needBase)
+{
+    uint32_t addr = image->start + offset;
+
+    operand->clear();
+    *needBase = -1;
+
+    if (d.length == 1) {
+        return true;
+    }
+
+    if (d.length == 2) {
+        std::string reg1 = getRegisterName(d.r1);
+        std::string reg2 = getRegisterName(d.r2);
+
+        if (reg1.empty()) {
+            return false;
+        }
+
+        if (d.info->type == Instructions::Type::OneOp) {
+            if (d.r2 != 0) {
+                return false;
+            }
+            *operand = reg1;
+        } else {
+            if (reg2.empty()) {
+                return false;
+            }
+            *operand = reg1 + "," + reg2;
+        }
+
+        return true;
+    }
+
+    // The assembler always sets n and i for simple addressing, so SIC
+    // compatible instructions cannot be reproduced
+    if (!d.n && !d.i) {
+        return false;
+    }
+
+    if (d.info->type == Instructions::Type::ZeroOp) {
+        // Only the opcode is set
+        if (d.x || d.b || d.p || d.disp != 0 || !d.n || !d.i) {
+            return false;
+        }
+        return true;
+    }
+
+    std::string prefix;
+    if (d.n && !d.i) {
+        prefix = "@";
+    } else if (!d.n && d.i) {
+        prefix = "#";
+    }
+
+    bool immediate = !d.n && d.i;
+    bool hasTarget = false;
+    uint32_t target = 0;
+    std::string value;
+
+    if (d.e) {
+        if (d.b || d.p) {
+            return false;
+        }
+
+        bool relocated = false;
+        auto it = image->mods.find(addr + 1);
+        if (it != image->mods.end()) {
+            // External reference patched by the loader, or an address of the
+            // program that the loader relocates
+            const auto &mods = it->second;
+            if (mods.size() != 1 || mods[0].halfBytes != 5
+                    || mods[0].sign != '+') {
+                return false;
+            }
+
+            if (mods[0].symbol != image->name) {
+                if (d.disp != 0) {
+                    return false;
+                }
+                value = mods[0].symbol;
+            } else {
+                relocated = true;
+            }
+        }
+
+        if (value.empty()) {
+            // Immediate values are usually constants, except for LDB which
+            // loads the base address and for relocated addresses
+            if ((immediate && !relocated
+                 && d.info->instr != Instructions::SicXE::LDB)
+                    || !isPlaceable(*image, d.disp)) {
+                value = std::to_string(d.disp);
+            } else {
+                hasTarget = true;
+                target = d.disp;
+            }
+        }
+    } else if (d.p && d.b) {
+        return false;
+    } else if (d.p) {
+        target = (addr + 3 + ((d.disp ^ 0x800) - 0x800)) & AddrMask;
+        if (!isPlaceable(*image, target)) {
+            return false;
+        }
+        hasTarget = true;
+    } else if (d.b) {
+        if (base < 0) {
+            return false;
+        }
+
+        target = (base + d.disp) & AddrMask;
+
+        // The assembler prefers PC-relative addressing when it is in range
+        int64_t progDiff = static_cast<int64_t>(target) - (addr + 3);
+        if (progDiff >= -2048 && progDiff <= 2047) {
+            return false;
+        }
+
+        if (!isPlaceable(*image, target) || !isPlaceable(*image, base)) {
+            return false;
+        }
+
+        hasTarget = true;
+        *needBase = base;
+        image->flags[base - image->start] |= FlagLabel;
+    } else {
+        // Constant displacement
+        value = std::to_string(d.disp);
+    }
+
+    if (hasTarget) {
+        image->flags[target - image->start] |= FlagLabel;
+        value = labelName(*image, target);
+
+        // Remember which data is accessed as words
+        switch (d.info->instr) {
+        case Instructions::SicXE::LDCH:
+        case Instructions::SicXE::STCH:
+        case Instructions::SicXE::RD:
+        case Instructions::SicXE::WD:
+        case Instructions::SicXE::TD:
+        case Instructions::SicXE::LDF:
+        case Instructions::SicXE::STF:
+        case Instructions::SicXE::ADDF:
+        case Instructions::SicXE::SUBF:
+        case Instructions::SicXE::MULF:
+        case Instructions::SicXE::DIVF:
+        case Instructions::SicXE::COMPF:
+            break;
+        default:
+            if (!immediate && !(image->flags[target - image->start] & FlagCode)) {
+                image->flags[target - image->start] |= FlagWord;
+            }
+            break;
+        }
+    }
+
+    *operand = prefix + value;
+    if (d.x) {
+        *operand += ",X";
+    }
+
+    return true;
+}
+
+void Disassembler::writeLine(std::string *out, const std::string &label,
+                             const std::string &instr,
+                             const std::string &operand,
+                             const std::string &comment)
+{
+    std::size_t lineStart = out->size();
+
+    *out += label;
+    out->append(label.size() < 9 ? 9 - label.size() : 1, ' ');
+    *out += instr;
+
+    if (!operand.empty() || !comment.empty()) {
+        out->append(instr.size() < 8 ? 8 - instr.size() : 1, ' ');
+        *out += operand;
+    }
+
+    if (!comment.empty()) {
+        std::size_t col = out->size() - lineStart;
+        out->append(col < 40 ? 40 - col : 1, ' ');
+        *out += comment;
+    }
+
+    // Strip trailing whitespace
+    while (out->size() > lineStart && out->back() == ' ') {
+        out->pop_back();
+    }
+
+    *out += '\n';
+}
+
+void Disassembler::disassemble(Image *image, bool first, std::string *out)
+{
+    struct InstrText {
+        bool symbolic;
+        std::string operand;
+        int64_t needBase;
+    };
+
+    if (image->hasEntry && isPlaceable(*image, image->entry)) {
+        image->flags[image->entry - image->start] |= FlagLabel;
+    }
+
+    for (auto const &def : image->defs) {
+        if (isPlaceable(*image, def.second)) {
+            image->flags[def.second - image->start] |= FlagLabel;
+        }
+    }
+
+    // Relocated words hold the address of a label
+    for (auto const &mod : image->mods) {
+        uint32_t offset = mod.first - image->start;
+        if (mod.first < image->start || offset + 3 > image->length
+                || !(image->flags[offset] & FlagWord)
+                || getRelocations(*image, mod.first) != 1) {
+            continue;
+        }
+
+        const unsigned char *p = &image->bytes[offset];
+        uint32_t value = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (isPlaceable(*image, value)) {
+            image->flags[value - image->start] |= FlagLabel;
+        }
+    }
+
+    // Pass 1: Choose the operand of every instruction and collect labels. The
+    // base register is tracked through LDB instructions in address order.
+    std::vector<InstrText> texts;
+    int64_t base = -1;
+
+    for (uint32_t offset = 0; offset < image->length; ++offset) {
+        if (!(image->flags[offset] & FlagInstr)) {
+            continue;
+        }
+
+        Decoded d;
+        decodeAt(*image, offset, &d);
+
+        InstrText text;
+        text.symbolic = getOperand(image, offset, d, base, &text.operand,
+                                   &text.needBase);
+        texts.push_back(text);
+
+        if (d.info->instr == Instructions::SicXE::LDB) {
+            uint32_t value;
+            if (!d.n && d.i && getTargetAddr(*image, offset, d, base, &value)) {
+                base = value;
+            } else {
+                base = -1;
+            }
+        } else if (d.length == 2 && d.r2 == 3
+                && d.info->type == Instructions::Type::TwoOp) {
+            // Register to register instructions overwriting B
+            base = -1;
+        }
+
+        offset += d.length - 1;
+    }
+
+    // Pass 2: Write the program in address order
+    std::string name = image->name;
+    if (first) {
+        char start[16];
+        std::snprintf(start, sizeof(start), "%X", image->start);
+        writeLine(out, name, Instructions::Directive_START, start, std::string());
+    } else {
+        writeLine(out, name, Instructions::Directive_CSECT, std::string(),
+                  std::string());
+    }
+
+    if (!image->defs.empty()) {
+        std::string names;
+        for (auto const &def : image->defs) {
+            names += (names.empty() ? "" : ",") + def.first;
+        }
+        writeLine(out, std::string(), Instructions::Directive_EXTDEF, names,
+                  std::string());
+    }
+
+    if (!image->refs.empty()) {
+        std::string names;
+        for (auto const &ref : image->refs) {
+            names += (names.empty() ? "" : ",") + ref;
+        }
+        writeLine(out, std::string(), Instructions::Directive_EXTREF, names,
+                  std::string());
+    }
+
+    int64_t declaredBase = -1;
+    std::size_t textIndex = 0;
+    uint32_t offset = 0;
+
+    while (offset < image->length) {
+        uint32_t addr = image->start + offset;
+        uint8_t flags = image->flags[offset];
+        std::string label;
+        if (flags & FlagLabel) {
+            label = labelName(*image, addr);
+        }
+
+        std::string comment = ". " + hexAddr(addr);
+
+        if (flags & FlagInstr) {
+            Decoded d;
+            decodeAt(*image, offset, &d);
+
+            const InstrText &text = texts[textIndex++];
+            comment += " ";
+            appendHex(&comment, &image->bytes[offset], d.length);
+
+            std::string instr = d.info->name;
+            if (d.e) {
+                instr.insert(instr.begin(), '+');
+            }
+
+            if (text.symbolic) {
+                if (text.needBase >= 0 && text.needBase != declaredBase) {
+                    writeLine(out, std::string(), Instructions::Directive_BASE,
+                              labelName(*image, text.needBase), std::string());
+                    declaredBase = text.needBase;
+                }
+
+                writeLine(out, label, instr, text.operand, comment);
+            } else {
+                std::string bytes = "X'";
+                appendHex(&bytes, &image->bytes[offset], d.length);
+                bytes += "'";
+                writeLine(out, label, Instructions::Variable_BYTE, bytes,
+                          comment + " " + instr);
+            }
+
+            offset += d.length;
+        } else if (!(flags & FlagLoaded)) {
+            // Space that is not initialized by any text record
+            uint32_t end = offset + 1;
+            while (end < image->length
+                    && !(image->flags[end] & (FlagLoaded | FlagLabel))) {
+                ++end;
+            }
+
+            writeLine(out, label, Instructions::Variable_RESB,
+                      std::to_string(end - offset), comment);
+            offset = end;
+        } else if ((flags & FlagWord) && offset + 3 <= image->length
+                && (image->flags[offset + 1] & (FlagLoaded | FlagCode | FlagLabel)) == FlagLoaded
+                && (image->flags[offset + 2] & (FlagLoaded | FlagCode | FlagLabel)) == FlagLoaded) {
+            const unsigned char *p = &image->bytes[offset];
+            int32_t value = static_cast<int32_t>(
+                    ((p[0] << 16) | (p[1] << 8) | p[2]) << 8) >> 8;
+
+            // External symbols in the word are added by the loader
+            std::string expr;
+            auto it = image->mods.find(addr);
+            if (it != image->mods.end()) {
+                for (auto const &mod : it->second) {
+                    if (mod.symbol != image->name) {
+                        expr += mod.sign + mod.symbol;
+                    }
+                }
+            }
+
+            // A relocated address is written as its label, so that the
+            // assembler relocates it again
+            uint32_t target = (p[0] << 16) | (p[1] << 8) | p[2];
+            if (getRelocations(*image, addr) == 1
+                    && isPlaceable(*image, target)) {
+                expr = labelName(*image, target) + expr;
+            } else if (value != 0 || expr.empty()) {
+                expr = std::to_string(value) + expr;
+            } else if (expr[0] == '+') {
+                expr.erase(0, 1);
+            }
+
+            comment += " ";
+            appendHex(&comment, p, 3);
+            writeLine(out, label, Instructions::Variable_WORD, expr, comment);
+            offset += 3;
+        } else {
+            uint32_t end = offset + 1;
+            while (end < image->length && end - offset < MaxDataBytes
+                    && (image->flags[end] & (FlagLoaded | FlagCode | FlagLabel
+                                             | FlagWord)) == FlagLoaded) {
+                ++end;
+            }
+
+            std::string bytes = "X'";
+            appendHex(&bytes, &image->bytes[offset], end - offset);
+            bytes += "'";
+            writeLine(out, label, Instructions::Variable_BYTE, bytes, comment);
+            offset = end;
+        }
+    }
+}
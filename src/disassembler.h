@@ -0,0 +1,83 @@
+#pragma once
+
+#include "instructions.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Converts object records back to assembly source.
+ *
+ * Code is found by following the control flow from the entry point and the
+ * targets of jumps and subroutine calls. Everything else is data. Targets of
+ * PC-relative, base-relative and extended instructions get synthesized labels
+ * (ie. L1036), or the external symbol names from D records.
+ *
+ * Each instruction is only written in symbolic form if assembling that form
+ * gives back the same bytes. Otherwise, it is written as a BYTE variable with
+ * the decoded instruction in a comment. Assembling the output reproduces the
+ * original memory image. */
+class Disassembler
+{
+public:
+    Disassembler();
+
+    bool disassembleFile(const std::string &path, std::FILE *out);
+
+    const std::string & error() const;
+
+private:
+    struct Modification {
+        uint32_t halfBytes;
+        char sign;
+        std::string symbol;
+    };
+
+    // One program (control section) of the object file
+    struct Image {
+        std::string name;
+        uint32_t start;
+        uint32_t length;
+        uint32_t entry;
+        bool hasEntry;
+        std::vector<unsigned char> bytes;
+        std::vector<uint8_t> flags;
+        std::vector<std::pair<std::string, uint32_t>> defs;
+        std::vector<std::string> refs;
+        std::unordered_map<uint32_t, std::vector<Modification>> mods;
+        std::unordered_map<uint32_t, std::string> names;
+    };
+
+    struct Decoded {
+        const Instructions::InstrInfo *info;
+        uint32_t length;
+        bool n, i, x, b, p, e;
+        uint32_t disp;
+        uint32_t r1, r2;
+    };
+
+    bool loadImages(const std::string &path, std::vector<Image> *images);
+
+    bool decodeAt(const Image &image, uint32_t offset, Decoded *d);
+    bool getTargetAddr(const Image &image, uint32_t offset, const Decoded &d,
+                       int64_t base, uint32_t *target);
+    void findCode(Image *image);
+    bool hasExternalMod(const Image &image, uint32_t addr);
+    int getRelocations(const Image &image, uint32_t addr);
+    bool isPlaceable(const Image &image, uint32_t addr);
+    std::string labelName(const Image &image, uint32_t addr);
+
+    bool getOperand(Image *image, uint32_t offset, const Decoded &d,
+                    int64_t base, std::string *operand, int64_t *needBase);
+    std::string getRegisterName(uint32_t reg);
+
+    void disassemble(Image *image, bool first, std::string *out);
+    void writeLine(std::string *out, const std::string &label,
+                   const std::string &instr, const std::string &operand,
+                   const std::string &comment);
+
+    Instructions m_instrs;
+    std::string m_error;
+};
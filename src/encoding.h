@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+
+/* Bit layout of the SIC/XE instruction formats, described once as field
+ * descriptors, and an encoder per format built from them.
+ *
+ *   Format 1: opcode(8)
+ *   Format 2: opcode(8) r1(4) r2(4)
+ *   Format 3: opcode(6) n i x b p e disp(12)
+ *   Format 4: opcode(6) n i x b p e address(20)
+ *
+ * The opcode of format 3 and 4 has its two lowest bits cleared, which is
+ * where n and i go. Everything is constexpr, so the encoders are inlined into
+ * the caller, and the known encodings at the end of this file are checked at
+ * compile time. */
+template<unsigned int Shift, unsigned int Width>
+struct BitField
+{
+    static constexpr uint32_t mask = (Width == 32) ? ~0u : (1u << Width) - 1;
+
+    // Move a value into the field. Bits that do not fit are dropped.
+    static constexpr uint32_t place(uint32_t value)
+    {
+        return (value & mask) << Shift;
+    }
+};
+
+template<unsigned int Format>
+struct FormatLayout;
+
+template<>
+struct FormatLayout<1>
+{
+    static constexpr unsigned int size = 1;
+    typedef BitField<0, 8> Opcode;
+};
+
+template<>
+struct FormatLayout<2>
+{
+    static constexpr unsigned int size = 2;
+    typedef BitField<8, 8> Opcode;
+    typedef BitField<4, 4> R1;
+    typedef BitField<0, 4> R2;
+};
+
+template<>
+struct FormatLayout<3>
+{
+    static constexpr unsigned int size = 3;
+    typedef BitField<16, 8> Opcode;
+    typedef BitField<17, 1> N;
+    typedef BitField<16, 1> I;
+    typedef BitField<15, 1> X;
+    typedef BitField<14, 1> B;
+    typedef BitField<13, 1> P;
+    typedef BitField<12, 1> E;
+    typedef BitField<0, 12> Disp;
+};
+
+template<>
+struct FormatLayout<4>
+{
+    static constexpr unsigned int size = 4;
+    typedef BitField<24, 8> Opcode;
+    typedef BitField<25, 1> N;
+    typedef BitField<24, 1> I;
+    typedef BitField<23, 1> X;
+    typedef BitField<22, 1> B;
+    typedef BitField<21, 1> P;
+    typedef BitField<20, 1> E;
+    typedef BitField<0, 20> Address;
+};
+
+// Addressing flags shared by format 3 and 4
+struct AddressFlags
+{
+    bool n;
+    bool i;
+    bool x;
+    bool b;
+    bool p;
+};
+
+template<unsigned int Format>
+struct FormatEncoder;
+
+template<>
+struct FormatEncoder<1>
+{
+    typedef FormatLayout<1> L;
+
+    static constexpr uint32_t encode(uint32_t opcode)
+    {
+        return L::Opcode::place(opcode);
+    }
+};
+
+template<>
+struct FormatEncoder<2>
+{
+    typedef FormatLayout<2> L;
+
+    static constexpr uint32_t encode(uint32_t opcode, uint32_t r1, uint32_t r2)
+    {
+        return L::Opcode::place(opcode) | L::R1::place(r1) | L::R2::place(r2);
+    }
+};
+
+template<>
+struct FormatEncoder<3>
+{
+    typedef FormatLayout<3> L;
+
+    static constexpr uint32_t encode(uint32_t opcode, AddressFlags flags,
+                                     uint32_t disp)
+    {
+        return L::Opcode::place(opcode & 0xFC)
+                | L::N::place(flags.n) | L::I::place(flags.i)
+                | L::X::place(flags.x) | L::B::place(flags.b)
+                | L::P::place(flags.p) | L::E::place(0)
+                | L::Disp::place(disp);
+    }
+};
+
+template<>
+struct FormatEncoder<4>
+{
+    typedef FormatLayout<4> L;
+
+    // Format 4 addresses are absolute, so b and p are ignored
+    static constexpr uint32_t encode(uint32_t opcode, AddressFlags flags,
+                                     uint32_t address)
+    {
+        return L::Opcode::place(opcode & 0xFC)
+                | L::N::place(flags.n) | L::I::place(flags.i)
+                | L::X::place(flags.x) | L::E::place(1)
+                | L::Address::place(address);
+    }
+};
+
+// Known encodings, mostly from the COPY program in Beck's System Software.
+// Flags are n, i, x, b, p.
+static_assert(FormatEncoder<1>::encode(0xC4) == 0xC4, "FIX");
+static_assert(FormatEncoder<2>::encode(0xB4, 1, 0) == 0xB410, "CLEAR X");
+static_assert(FormatEncoder<2>::encode(0xA0, 0, 4) == 0xA004, "COMPR A,S");
+static_assert(FormatEncoder<3>::encode(
+        0x14, { true, true, false, false, true }, 0x02D) == 0x17202D,
+        "STL RETADR");
+static_assert(FormatEncoder<3>::encode(
+        0x00, { false, true, false, false, false }, 3) == 0x010003,
+        "LDA #3");
+static_assert(FormatEncoder<3>::encode(
+        0x3C, { true, false, false, false, true }, 3) == 0x3E2003,
+        "J @RETADR");
+static_assert(FormatEncoder<3>::encode(
+        0x54, { true, true, true, true, false }, 3) == 0x57C003,
+        "STCH BUFFER,X");
+static_assert(FormatEncoder<3>::encode(
+        0x3C, { true, true, false, false, true }, -20) == 0x3F2FEC,
+        "J CLOOP (negative displacement)");
+static_assert(FormatEncoder<3>::encode(
+        0x4C, { true, true, false, false, false }, 0) == 0x4F0000,
+        "RSUB");
+static_assert(FormatEncoder<4>::encode(
+        0x48, { true, true, false, false, false }, 0x1036) == 0x4B101036,
+        "+JSUB RDREC");
+static_assert(FormatEncoder<4>::encode(
+        0x74, { false, true, false, false, false }, 4096) == 0x75101000,
+        "+LDT #4096");
+static_assert(FormatEncoder<4>::encode(
+        0xE0, { true, true, false, false, false }, 0) == 0xE3100000u,
+        "+TD (opcode with the top bit set)");
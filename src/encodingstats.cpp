@@ -0,0 +1,211 @@
+#include "encodingstats.h"
+
+#include <cstdlib>
+#include <cstring>
+
+
+static const char *AddressingNames[] = {
+    "absolute", "pc_relative", "base_relative", "external"
+};
+
+static const char *ModeNames[] = {
+    "simple", "immediate", "indirect"
+};
+
+static int bucketOf(int disp)
+{
+    unsigned int magnitude = std::abs(disp);
+    int bits = 0;
+    while (magnitude != 0 && bits < EncodingStats::DisplacementBuckets - 1) {
+        magnitude >>= 1;
+        ++bits;
+    }
+    return bits;
+}
+
+// Range of magnitudes counted in a displacement bucket, ie. "16-31"
+static std::string bucketRange(int bucket)
+{
+    if (bucket == 0) {
+        return "0";
+    } else if (bucket == 1) {
+        return "1";
+    }
+
+    return std::to_string(1 << (bucket - 1)) + "-"
+            + std::to_string((1 << bucket) - 1);
+}
+
+static std::string jsonString(const std::string &str)
+{
+    std::string result = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            result += buf;
+        } else {
+            result += c;
+        }
+    }
+    result += "\"";
+    return result;
+}
+
+EncodingStats::EncodingStats()
+{
+    clear();
+}
+
+void EncodingStats::clear()
+{
+    std::memset(formats, 0, sizeof(formats));
+    std::memset(addressing, 0, sizeof(addressing));
+    std::memset(modes, 0, sizeof(modes));
+    indexed = 0;
+    std::memset(pcDisplacements, 0, sizeof(pcDisplacements));
+    std::memset(baseDisplacements, 0, sizeof(baseDisplacements));
+    candidates.clear();
+}
+
+void EncodingStats::merge(const EncodingStats &other)
+{
+    for (int i = 0; i < 5; ++i) {
+        formats[i] += other.formats[i];
+    }
+    for (int i = 0; i < AddressingCount; ++i) {
+        addressing[i] += other.addressing[i];
+    }
+    for (int i = 0; i < ModeCount; ++i) {
+        modes[i] += other.modes[i];
+    }
+    indexed += other.indexed;
+    for (int i = 0; i < DisplacementBuckets; ++i) {
+        pcDisplacements[i] += other.pcDisplacements[i];
+        baseDisplacements[i] += other.baseDisplacements[i];
+    }
+    candidates.insert(candidates.end(), other.candidates.begin(),
+                      other.candidates.end());
+}
+
+void EncodingStats::addInstruction(unsigned int format)
+{
+    ++formats[format];
+}
+
+void EncodingStats::addOperand(Addressing addr, Mode mode, bool index)
+{
+    ++addressing[addr];
+    ++modes[mode];
+    if (index) {
+        ++indexed;
+    }
+}
+
+void EncodingStats::addDisplacement(Addressing addr, int disp)
+{
+    if (addr == PcRelative) {
+        ++pcDisplacements[bucketOf(disp)];
+    } else if (addr == BaseRelative) {
+        ++baseDisplacements[bucketOf(disp)];
+    }
+}
+
+void EncodingStats::addCandidate(unsigned int lineNumber,
+                                 const std::string &line,
+                                 const std::string &fix)
+{
+    candidates.push_back({ lineNumber, line, fix });
+}
+
+bool EncodingStats::writeTable(std::FILE *out) const
+{
+    unsigned long instrs = 0;
+    unsigned long bytes = 0;
+    for (unsigned int i = 1; i <= 4; ++i) {
+        instrs += formats[i];
+        bytes += i * formats[i];
+    }
+
+    std::fprintf(out, "Instructions: %lu (%lu bytes)\n\n", instrs, bytes);
+
+    std::fprintf(out, "Format          Count\n");
+    for (int i = 1; i <= 4; ++i) {
+        std::fprintf(out, "%-14d %6lu\n", i, formats[i]);
+    }
+
+    std::fprintf(out, "\nAddressing      Count\n");
+    for (int i = 0; i < AddressingCount; ++i) {
+        std::fprintf(out, "%-14s %6lu\n", AddressingNames[i], addressing[i]);
+    }
+    for (int i = 0; i < ModeCount; ++i) {
+        std::fprintf(out, "%-14s %6lu\n", ModeNames[i], modes[i]);
+    }
+    std::fprintf(out, "%-14s %6lu\n", "indexed", indexed);
+
+    std::fprintf(out, "\nDisplacement   PC-rel  Base-rel\n");
+    for (int i = 0; i < DisplacementBuckets; ++i) {
+        std::fprintf(out, "%-12s %8lu %9lu\n", bucketRange(i).c_str(),
+                     pcDisplacements[i], baseDisplacements[i]);
+    }
+
+    std::fprintf(out, "\nFormat 4 instructions that fit in format 3: %zu\n",
+                 candidates.size());
+    for (auto const &candidate : candidates) {
+        std::fprintf(out, "%6u  %-40s  %s\n", candidate.lineNumber,
+                     candidate.line.c_str(), candidate.fix.c_str());
+    }
+
+    return !std::ferror(out);
+}
+
+bool EncodingStats::writeJson(std::FILE *out) const
+{
+    unsigned long instrs = 0;
+    unsigned long bytes = 0;
+    for (unsigned int i = 1; i <= 4; ++i) {
+        instrs += formats[i];
+        bytes += i * formats[i];
+    }
+
+    std::fprintf(out, "{\n  \"instructions\": %lu,\n  \"bytes\": %lu,\n",
+                 instrs, bytes);
+    std::fprintf(out, "  \"formats\": {");
+    for (int i = 1; i <= 4; ++i) {
+        std::fprintf(out, "%s\"%d\": %lu", i == 1 ? "" : ", ", i, formats[i]);
+    }
+
+    std::fprintf(out, "},\n  \"addressing\": {");
+    for (int i = 0; i < AddressingCount; ++i) {
+        std::fprintf(out, "%s\"%s\": %lu", i == 0 ? "" : ", ",
+                     AddressingNames[i], addressing[i]);
+    }
+
+    std::fprintf(out, "},\n  \"modes\": {");
+    for (int i = 0; i < ModeCount; ++i) {
+        std::fprintf(out, "\"%s\": %lu, ", ModeNames[i], modes[i]);
+    }
+    std::fprintf(out, "\"indexed\": %lu},\n", indexed);
+
+    std::fprintf(out, "  \"displacements\": [");
+    for (int i = 0; i < DisplacementBuckets; ++i) {
+        std::fprintf(out, "%s\n    {\"range\": \"%s\", \"pc_relative\": %lu, "
+                     "\"base_relative\": %lu}", i == 0 ? "" : ",",
+                     bucketRange(i).c_str(), pcDisplacements[i],
+                     baseDisplacements[i]);
+    }
+
+    std::fprintf(out, "\n  ],\n  \"format4_candidates\": [");
+    for (std::size_t i = 0; i < candidates.size(); ++i) {
+        std::fprintf(out, "%s\n    {\"line\": %u, \"source\": %s, \"fix\": %s}",
+                     i == 0 ? "" : ",", candidates[i].lineNumber,
+                     jsonString(candidates[i].line).c_str(),
+                     jsonString(candidates[i].fix).c_str());
+    }
+    std::fprintf(out, "%s]\n}\n", candidates.empty() ? "" : "\n  ");
+
+    return !std::ferror(out);
+}
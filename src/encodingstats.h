@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* Counts how the instructions of a program were encoded: by format, by
+ * addressing mode and by displacement size. Format 4 instructions whose
+ * operand would also fit in format 3 are listed with the change that would
+ * make them fit, since each of them costs a byte.
+ *
+ * Every section collects its own statistics during pass 2, and they are
+ * merged in section order afterwards. */
+class EncodingStats
+{
+public:
+    enum Addressing
+    {
+        Absolute,
+        PcRelative,
+        BaseRelative,
+        External,
+        AddressingCount
+    };
+
+    enum Mode
+    {
+        Simple,
+        Immediate,
+        Indirect,
+        ModeCount
+    };
+
+    // Displacements are counted by the number of bits of their magnitude
+    static const int DisplacementBuckets = 13;
+
+    struct Candidate {
+        unsigned int lineNumber;
+        std::string line;
+        std::string fix;
+    };
+
+    EncodingStats();
+
+    void clear();
+    void merge(const EncodingStats &other);
+
+    void addInstruction(unsigned int format);
+    void addOperand(Addressing addr, Mode mode, bool index);
+    void addDisplacement(Addressing addr, int disp);
+    void addCandidate(unsigned int lineNumber, const std::string &line,
+                      const std::string &fix);
+
+    bool writeTable(std::FILE *out) const;
+    bool writeJson(std::FILE *out) const;
+
+    // Index 1-4 is the format
+    unsigned long formats[5];
+    unsigned long addressing[AddressingCount];
+    unsigned long modes[ModeCount];
+    unsigned long indexed;
+    unsigned long pcDisplacements[DisplacementBuckets];
+    unsigned long baseDisplacements[DisplacementBuckets];
+    std::vector<Candidate> candidates;
+};
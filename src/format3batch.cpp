@@ -0,0 +1,156 @@
+#include "format3batch.h"
+
+#include "encoding.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const std::size_t Format3Batch::Capacity;
+
+typedef FormatLayout<3> Layout;
+
+// Lines encoded by one vector
+static const std::size_t Lanes = 4;
+
+Format3Batch::Format3Batch() : m_size(0)
+{
+}
+
+void Format3Batch::clear()
+{
+    m_size = 0;
+}
+
+std::size_t Format3Batch::size() const
+{
+    return m_size;
+}
+
+bool Format3Batch::empty() const
+{
+    return m_size == 0;
+}
+
+bool Format3Batch::full() const
+{
+    return m_size == Capacity;
+}
+
+void Format3Batch::add(uint32_t head, int32_t prog, int32_t target,
+                       int32_t base)
+{
+    m_head[m_size] = head;
+    m_prog[m_size] = prog;
+    m_target[m_size] = target;
+    m_base[m_size] = base;
+    ++m_size;
+}
+
+int32_t Format3Batch::base(std::size_t i) const
+{
+    return m_base[i];
+}
+
+/* The output arrays must have room for Capacity lines */
+std::size_t Format3Batch::encode(uint32_t *out, bool *failed)
+{
+    std::size_t first = 0;
+
+#ifdef __SSE2__
+    // Fill the last vector with lines that encode to nothing
+    std::size_t padded = (m_size + Lanes - 1) / Lanes * Lanes;
+    for (std::size_t i = m_size; i < padded; ++i) {
+        m_head[i] = 0;
+        m_prog[i] = 0;
+        m_target[i] = 0;
+        m_base[i] = -1;
+    }
+
+    const __m128i pcMin = _mm_set1_epi32(-2048 - 1);
+    const __m128i pcMax = _mm_set1_epi32(2047 + 1);
+    const __m128i baseMax = _mm_set1_epi32(4095 + 1);
+    const __m128i minusOne = _mm_set1_epi32(-1);
+    const __m128i dispMask = _mm_set1_epi32(Layout::Disp::mask);
+    const __m128i pBit = _mm_set1_epi32(Layout::P::place(1));
+    const __m128i bBit = _mm_set1_epi32(Layout::B::place(1));
+
+    for (std::size_t i = 0; i < padded; i += Lanes) {
+        __m128i head = _mm_load_si128(
+                reinterpret_cast<const __m128i *>(m_head + i));
+        __m128i prog = _mm_load_si128(
+                reinterpret_cast<const __m128i *>(m_prog + i));
+        __m128i target = _mm_load_si128(
+                reinterpret_cast<const __m128i *>(m_target + i));
+        __m128i base = _mm_load_si128(
+                reinterpret_cast<const __m128i *>(m_base + i));
+
+        __m128i pcDisp = _mm_sub_epi32(target, prog);
+        __m128i pcOk = _mm_and_si128(_mm_cmpgt_epi32(pcDisp, pcMin),
+                                     _mm_cmplt_epi32(pcDisp, pcMax));
+
+        __m128i baseDisp = _mm_sub_epi32(target, base);
+        __m128i baseOk = _mm_and_si128(
+                _mm_cmpgt_epi32(base, minusOne),
+                _mm_and_si128(_mm_cmpgt_epi32(baseDisp, minusOne),
+                              _mm_cmplt_epi32(baseDisp, baseMax)));
+
+        // PC-relative wins when both reach the target
+        __m128i useBase = _mm_andnot_si128(pcOk, baseOk);
+        __m128i ok = _mm_or_si128(pcOk, useBase);
+
+        __m128i disp = _mm_and_si128(
+                _mm_or_si128(_mm_and_si128(pcOk, pcDisp),
+                             _mm_and_si128(useBase, baseDisp)),
+                dispMask);
+        __m128i flags = _mm_or_si128(_mm_and_si128(pcOk, pBit),
+                                     _mm_and_si128(useBase, bBit));
+        __m128i code = _mm_and_si128(
+                _mm_or_si128(head, _mm_or_si128(flags, disp)), ok);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), code);
+
+        int okMask = _mm_movemask_ps(_mm_castsi128_ps(ok));
+        for (std::size_t lane = 0; lane < Lanes; ++lane) {
+            failed[i + lane] = !(okMask & (1 << lane));
+        }
+    }
+
+    first = m_size;
+#endif
+
+    encodeScalar(first, out, failed);
+
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < m_size; ++i) {
+        count += failed[i];
+    }
+
+    return count;
+}
+
+void Format3Batch::encodeScalar(std::size_t first, uint32_t *out,
+                                bool *failed)
+{
+    for (std::size_t i = first; i < m_size; ++i) {
+        int32_t pcDisp = m_target[i] - m_prog[i];
+        int32_t baseDisp = m_target[i] - m_base[i];
+
+        AddressFlags flags = { false, false, false, false, false };
+        int32_t disp;
+        if (pcDisp >= -2048 && pcDisp <= 2047) {
+            flags.p = true;
+            disp = pcDisp;
+        } else if (m_base[i] >= 0 && baseDisp >= 0 && baseDisp <= 4095) {
+            flags.b = true;
+            disp = baseDisp;
+        } else {
+            out[i] = 0;
+            failed[i] = true;
+            continue;
+        }
+
+        out[i] = m_head[i] | FormatEncoder<3>::encode(0, flags, disp);
+        failed[i] = false;
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* Encodes format 3 instructions with a label operand in batches. Pass 2
+ * decodes each line into its opcode and flags, its PC value, the address of
+ * the label and the base register, and the displacements, range checks and
+ * object code of the whole batch are then computed at once, four lines at a
+ * time with SSE2 when it is available.
+ *
+ * PC-relative addressing is used when it reaches the target, as in the
+ * scalar encoder, and base-relative addressing otherwise. Lines that neither
+ * reaches are marked as failed and left for the caller to encode one by one,
+ * which gives them the exact diagnostics. */
+class Format3Batch
+{
+public:
+    static const std::size_t Capacity = 256;
+
+    Format3Batch();
+
+    void clear();
+    std::size_t size() const;
+    bool empty() const;
+    bool full() const;
+
+    // The head is the encoding of the line without a displacement, so it
+    // has the opcode and the n, i and x bits. The base is -1 if
+    // base-relative addressing is off.
+    void add(uint32_t head, int32_t prog, int32_t target, int32_t base);
+
+    int32_t base(std::size_t i) const;
+
+    // Encode every line into out. Failed lines are set in failed and their
+    // object code is left 0. Returns the number of failed lines.
+    std::size_t encode(uint32_t *out, bool *failed);
+
+private:
+    void encodeScalar(std::size_t first, uint32_t *out, bool *failed);
+
+    std::size_t m_size;
+    // One entry per line, padded to whole vectors
+    alignas(16) uint32_t m_head[Capacity];
+    alignas(16) int32_t m_prog[Capacity];
+    alignas(16) int32_t m_target[Capacity];
+    alignas(16) int32_t m_base[Capacity];
+};
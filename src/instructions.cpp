@@ -7,6 +7,14 @@ const std::string Instructions::Directive_START = "START";
 const std::string Instructions::Directive_END = "END";
 const std::string Instructions::Directive_BASE = "BASE";
 const std::string Instructions::Directive_NOBASE = "NOBASE";
+const std::string Instructions::Directive_CSECT = "CSECT";
+const std::string Instructions::Directive_EXTDEF = "EXTDEF";
+const std::string Instructions::Directive_EXTREF = "EXTREF";
+const std::string Instructions::Directive_USE = "USE";
+const std::string Instructions::Directive_INCLUDE = "INCLUDE";
+const std::string Instructions::Directive_IF = "IF";
+const std::string Instructions::Directive_ELSE = "ELSE";
+const std::string Instructions::Directive_ENDIF = "ENDIF";
 const std::string Instructions::Variable_WORD = "WORD";
 const std::string Instructions::Variable_RESW = "RESW";
 const std::string Instructions::Variable_RESB = "RESB";
@@ -90,6 +98,11 @@ Instructions::Instructions()
         { SicXE::TIXR,   "TIXR",   0xB8, Length::Two,         Type::OneOp },
         { SicXE::WD,     "WD",     0xDC, Length::ThreeOrFour, Type::OneOp }
     };
+
+    m_opcodeIndex.assign(64, -1);
+    for (unsigned int i = 0; i < m_instrs.size(); ++i) {
+        m_opcodeIndex[m_instrs[i].opcode >> 2] = i;
+    }
 }
 
 const Instructions::InstrInfo * Instructions::operator[](const SicXE &instr)
@@ -110,6 +123,14 @@ const Instructions::InstrInfo * Instructions::operator[](const std::string &inst
     return nullptr;
 }
 
+/* Look up an instruction by the first byte of its object code. The n and i
+ * bits are ignored. */
+const Instructions::InstrInfo * Instructions::byOpcode(unsigned int opcode) const
+{
+    int index = m_opcodeIndex[(opcode & 0xFF) >> 2];
+    return index < 0 ? nullptr : &m_instrs[index];
+}
+
 bool Instructions::isValid(const std::string &instr)
 {
     return isSicXE(instr)
@@ -136,7 +157,15 @@ bool Instructions::isDirective(const std::string &instr)
     return instr == Directive_START
             || instr == Directive_END
             || instr == Directive_BASE
-            || instr == Directive_NOBASE;
+            || instr == Directive_NOBASE
+            || instr == Directive_CSECT
+            || instr == Directive_EXTDEF
+            || instr == Directive_EXTREF
+            || instr == Directive_USE
+            || instr == Directive_INCLUDE
+            || instr == Directive_IF
+            || instr == Directive_ELSE
+            || instr == Directive_ENDIF;
 }
 
 bool Instructions::isVariable(const std::string &instr)
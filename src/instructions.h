@@ -73,6 +73,14 @@ public:
     static const std::string Directive_END;
     static const std::string Directive_BASE;
     static const std::string Directive_NOBASE;
+    static const std::string Directive_CSECT;
+    static const std::string Directive_EXTDEF;
+    static const std::string Directive_EXTREF;
+    static const std::string Directive_USE;
+    static const std::string Directive_INCLUDE;
+    static const std::string Directive_IF;
+    static const std::string Directive_ELSE;
+    static const std::string Directive_ENDIF;
     static const std::string Variable_WORD;
     static const std::string Variable_RESW;
     static const std::string Variable_RESB;
@@ -119,6 +127,7 @@ public:
 
     const InstrInfo * operator[](const SicXE &instr);
     const InstrInfo * operator[](const std::string &instr);
+    const InstrInfo * byOpcode(unsigned int opcode) const;
 
     bool isValid(const std::string &instr);
     bool isSicXE(const std::string &instr);
@@ -137,4 +146,6 @@ public:
 
 private:
     std::vector<InstrInfo> m_instrs;
+    // Index into m_instrs for each opcode (upper 6 bits of the first byte)
+    std::vector<int> m_opcodeIndex;
 };
@@ -0,0 +1,601 @@
+#include "json.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <utility>
+
+
+// Nesting deeper than this is rejected rather than risking the stack
+static const int MaxDepth = 256;
+
+namespace {
+
+/* Recursive descent parser over a complete text */
+class Parser
+{
+public:
+    Parser(const std::string &text)
+        : m_pos(text.data()), m_end(text.data() + text.size()), m_depth(0)
+    {
+    }
+
+    bool parse(Json *out)
+    {
+        if (!value(out)) {
+            return false;
+        }
+        skipSpace();
+        return m_pos == m_end;
+    }
+
+private:
+    void skipSpace()
+    {
+        while (m_pos < m_end && (*m_pos == ' ' || *m_pos == '\t'
+                                 || *m_pos == '\n' || *m_pos == '\r')) {
+            ++m_pos;
+        }
+    }
+
+    bool literal(const char *word)
+    {
+        for (; *word; ++word, ++m_pos) {
+            if (m_pos == m_end || *m_pos != *word) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool value(Json *out)
+    {
+        skipSpace();
+        if (m_pos == m_end) {
+            return false;
+        }
+
+        switch (*m_pos) {
+        case '{':
+            return object(out);
+        case '[':
+            return array(out);
+        case '"': {
+            std::string str;
+            if (!string(&str)) {
+                return false;
+            }
+            *out = Json(str);
+            return true;
+        }
+        case 't':
+            *out = Json(true);
+            return literal("true");
+        case 'f':
+            *out = Json(false);
+            return literal("false");
+        case 'n':
+            *out = Json();
+            return literal("null");
+        default:
+            return number(out);
+        }
+    }
+
+    bool object(Json *out)
+    {
+        if (++m_depth > MaxDepth) {
+            return false;
+        }
+
+        ++m_pos;
+        *out = Json::object();
+
+        skipSpace();
+        if (m_pos < m_end && *m_pos == '}') {
+            ++m_pos;
+            --m_depth;
+            return true;
+        }
+
+        for (;;) {
+            std::string key;
+            Json member;
+
+            skipSpace();
+            if (m_pos == m_end || *m_pos != '"' || !string(&key)) {
+                return false;
+            }
+            skipSpace();
+            if (m_pos == m_end || *m_pos++ != ':') {
+                return false;
+            }
+            if (!value(&member)) {
+                return false;
+            }
+            out->set(key, member);
+
+            skipSpace();
+            if (m_pos == m_end) {
+                return false;
+            }
+            char c = *m_pos++;
+            if (c == '}') {
+                break;
+            } else if (c != ',') {
+                return false;
+            }
+        }
+
+        --m_depth;
+        return true;
+    }
+
+    bool array(Json *out)
+    {
+        if (++m_depth > MaxDepth) {
+            return false;
+        }
+
+        ++m_pos;
+        *out = Json::array();
+
+        skipSpace();
+        if (m_pos < m_end && *m_pos == ']') {
+            ++m_pos;
+            --m_depth;
+            return true;
+        }
+
+        for (;;) {
+            Json item;
+            if (!value(&item)) {
+                return false;
+            }
+            out->push(item);
+
+            skipSpace();
+            if (m_pos == m_end) {
+                return false;
+            }
+            char c = *m_pos++;
+            if (c == ']') {
+                break;
+            } else if (c != ',') {
+                return false;
+            }
+        }
+
+        --m_depth;
+        return true;
+    }
+
+    bool hex4(unsigned int *out)
+    {
+        if (m_end - m_pos < 4) {
+            return false;
+        }
+
+        unsigned int value = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = *m_pos++;
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                value |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                value |= c - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+
+        *out = value;
+        return true;
+    }
+
+    static void appendUtf8(std::string *out, unsigned int cp)
+    {
+        if (cp < 0x80) {
+            *out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            *out += static_cast<char>(0xC0 | (cp >> 6));
+            *out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            *out += static_cast<char>(0xE0 | (cp >> 12));
+            *out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            *out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            *out += static_cast<char>(0xF0 | (cp >> 18));
+            *out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            *out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            *out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    bool string(std::string *out)
+    {
+        ++m_pos;
+
+        for (;;) {
+            if (m_pos == m_end) {
+                return false;
+            }
+
+            char c = *m_pos++;
+            if (c == '"') {
+                return true;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                return false;
+            } else if (c != '\\') {
+                *out += c;
+                continue;
+            }
+
+            if (m_pos == m_end) {
+                return false;
+            }
+
+            c = *m_pos++;
+            switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                *out += c;
+                break;
+            case 'b':
+                *out += '\b';
+                break;
+            case 'f':
+                *out += '\f';
+                break;
+            case 'n':
+                *out += '\n';
+                break;
+            case 'r':
+                *out += '\r';
+                break;
+            case 't':
+                *out += '\t';
+                break;
+            case 'u': {
+                unsigned int cp;
+                if (!hex4(&cp)) {
+                    return false;
+                }
+
+                // Characters outside the BMP are escaped as surrogate pairs
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    unsigned int low;
+                    if (m_end - m_pos < 2 || m_pos[0] != '\\'
+                            || m_pos[1] != 'u') {
+                        return false;
+                    }
+                    m_pos += 2;
+                    if (!hex4(&low) || low < 0xDC00 || low > 0xDFFF) {
+                        return false;
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+
+                appendUtf8(out, cp);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+    }
+
+    bool number(Json *out)
+    {
+        const char *start = m_pos;
+        if (m_pos < m_end && *m_pos == '-') {
+            ++m_pos;
+        }
+        while (m_pos < m_end && ((*m_pos >= '0' && *m_pos <= '9')
+                                 || *m_pos == '.' || *m_pos == 'e'
+                                 || *m_pos == 'E' || *m_pos == '+'
+                                 || *m_pos == '-')) {
+            ++m_pos;
+        }
+        if (m_pos == start) {
+            return false;
+        }
+
+        // strtod needs a terminated string
+        std::string text(start, m_pos);
+        char *end;
+        double value = std::strtod(text.c_str(), &end);
+        if (*end != '\0') {
+            return false;
+        }
+
+        *out = Json(value);
+        return true;
+    }
+
+    const char *m_pos;
+    const char *m_end;
+    int m_depth;
+};
+
+}
+
+static void dumpString(const std::string &str, std::string *out)
+{
+    *out += '"';
+
+    // Characters that need no escape are copied in runs
+    std::size_t run = 0;
+    for (std::size_t i = 0; i < str.size(); ++i) {
+        char c = str[i];
+        if (c != '"' && c != '\\' && static_cast<unsigned char>(c) >= 0x20) {
+            continue;
+        }
+
+        out->append(str, run, i - run);
+        run = i + 1;
+
+        if (c == '"' || c == '\\') {
+            *out += '\\';
+            *out += c;
+        } else if (c == '\n') {
+            *out += "\\n";
+        } else if (c == '\r') {
+            *out += "\\r";
+        } else if (c == '\t') {
+            *out += "\\t";
+        } else {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            *out += buf;
+        }
+    }
+    out->append(str, run, std::string::npos);
+
+    *out += '"';
+}
+
+static const Json NullValue;
+static const std::string EmptyString;
+
+Json::Json() : m_type(Null), m_bool(false), m_number(0)
+{
+}
+
+Json::Json(bool value) : m_type(Bool), m_bool(value), m_number(0)
+{
+}
+
+Json::Json(int value) : m_type(Number), m_bool(false), m_number(value)
+{
+}
+
+Json::Json(unsigned int value) : m_type(Number), m_bool(false), m_number(value)
+{
+}
+
+Json::Json(long value) : m_type(Number), m_bool(false), m_number(value)
+{
+}
+
+Json::Json(unsigned long value)
+    : m_type(Number), m_bool(false), m_number(value)
+{
+}
+
+Json::Json(double value) : m_type(Number), m_bool(false), m_number(value)
+{
+}
+
+Json::Json(const char *value)
+    : m_type(String), m_bool(false), m_number(0), m_string(value)
+{
+}
+
+Json::Json(const std::string &value)
+    : m_type(String), m_bool(false), m_number(0), m_string(value)
+{
+}
+
+Json Json::array()
+{
+    Json json;
+    json.m_type = Array;
+    return json;
+}
+
+Json Json::object()
+{
+    Json json;
+    json.m_type = Object;
+    return json;
+}
+
+bool Json::parse(const std::string &text, Json *out)
+{
+    Parser parser(text);
+    return parser.parse(out);
+}
+
+Json::Type Json::type() const
+{
+    return m_type;
+}
+
+bool Json::isNull() const
+{
+    return m_type == Null;
+}
+
+bool Json::toBool() const
+{
+    return m_type == Bool && m_bool;
+}
+
+double Json::toNumber() const
+{
+    return m_type == Number ? m_number : 0;
+}
+
+long Json::toInt() const
+{
+    return m_type == Number ? static_cast<long>(m_number) : 0;
+}
+
+const std::string & Json::toString() const
+{
+    return m_type == String ? m_string : EmptyString;
+}
+
+std::size_t Json::size() const
+{
+    return m_items.size();
+}
+
+const Json & Json::at(std::size_t index) const
+{
+    if (m_type != Array || index >= m_items.size()) {
+        return NullValue;
+    }
+    return m_items[index];
+}
+
+const Json & Json::operator[](const std::string &key) const
+{
+    if (m_type == Object) {
+        for (std::size_t i = 0; i < m_keys.size(); ++i) {
+            if (m_keys[i] == key) {
+                return m_items[i];
+            }
+        }
+    }
+    return NullValue;
+}
+
+bool Json::has(const std::string &key) const
+{
+    if (m_type == Object) {
+        for (auto const &k : m_keys) {
+            if (k == key) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Json::push(const Json &value)
+{
+    push(Json(value));
+}
+
+void Json::push(Json &&value)
+{
+    if (m_type == Array) {
+        m_items.push_back(std::move(value));
+    }
+}
+
+Json & Json::set(const std::string &key, const Json &value)
+{
+    return set(key, Json(value));
+}
+
+Json & Json::set(const std::string &key, Json &&value)
+{
+    if (m_type != Object) {
+        return *this;
+    }
+
+    for (std::size_t i = 0; i < m_keys.size(); ++i) {
+        if (m_keys[i] == key) {
+            m_items[i] = std::move(value);
+            return *this;
+        }
+    }
+
+    // Most objects in a message have only a few members
+    if (m_keys.empty()) {
+        m_keys.reserve(4);
+        m_items.reserve(4);
+    }
+
+    m_keys.push_back(key);
+    m_items.push_back(std::move(value));
+    return *this;
+}
+
+void Json::dump(std::string *out) const
+{
+    switch (m_type) {
+    case Null:
+        *out += "null";
+        break;
+    case Bool:
+        *out += m_bool ? "true" : "false";
+        break;
+    case Number: {
+        char buf[32];
+        if (!std::isfinite(m_number)) {
+            // Not representable in JSON
+            std::snprintf(buf, sizeof(buf), "null");
+        } else if (m_number == std::floor(m_number)
+                && std::fabs(m_number) < 1e15) {
+            // Most numbers are line and column numbers
+            long long value = static_cast<long long>(m_number);
+            char *end = buf + sizeof(buf);
+            char *p = end;
+            unsigned long long digits = value < 0 ? -value : value;
+            do {
+                *--p = '0' + digits % 10;
+                digits /= 10;
+            } while (digits != 0);
+            if (value < 0) {
+                *--p = '-';
+            }
+            out->append(p, end - p);
+            break;
+        } else {
+            std::snprintf(buf, sizeof(buf), "%.17g", m_number);
+        }
+        *out += buf;
+        break;
+    }
+    case String:
+        dumpString(m_string, out);
+        break;
+    case Array:
+        *out += '[';
+        for (std::size_t i = 0; i < m_items.size(); ++i) {
+            if (i > 0) {
+                *out += ',';
+            }
+            m_items[i].dump(out);
+        }
+        *out += ']';
+        break;
+    case Object:
+        *out += '{';
+        for (std::size_t i = 0; i < m_items.size(); ++i) {
+            if (i > 0) {
+                *out += ',';
+            }
+            dumpString(m_keys[i], out);
+            *out += ':';
+            m_items[i].dump(out);
+        }
+        *out += '}';
+        break;
+    }
+}
+
+std::string Json::dump() const
+{
+    std::string out;
+    dump(&out);
+    return out;
+}
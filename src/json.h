@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/* A JSON value, as exchanged with the language server client. Objects keep
+ * their members in insertion order. Reading a missing member or item, or a
+ * value of another type, gives null, false, 0 or an empty string instead of
+ * failing, so optional fields of a message can be read without checking
+ * every level. */
+class Json
+{
+public:
+    enum Type
+    {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object
+    };
+
+    Json();
+    Json(bool value);
+    Json(int value);
+    Json(unsigned int value);
+    Json(long value);
+    Json(unsigned long value);
+    Json(double value);
+    Json(const char *value);
+    Json(const std::string &value);
+
+    static Json array();
+    static Json object();
+
+    // Parse a complete JSON text
+    static bool parse(const std::string &text, Json *out);
+
+    Type type() const;
+    bool isNull() const;
+
+    bool toBool() const;
+    double toNumber() const;
+    long toInt() const;
+    const std::string & toString() const;
+
+    // Items of an array, or members of an object
+    std::size_t size() const;
+    const Json & at(std::size_t index) const;
+    const Json & operator[](const std::string &key) const;
+    bool has(const std::string &key) const;
+
+    void push(const Json &value);
+    void push(Json &&value);
+    Json & set(const std::string &key, const Json &value);
+    Json & set(const std::string &key, Json &&value);
+
+    void dump(std::string *out) const;
+    std::string dump() const;
+
+private:
+    Type m_type;
+    bool m_bool;
+    double m_number;
+    std::string m_string;
+    // Array items, or object values in the order of m_keys
+    std::vector<Json> m_items;
+    std::vector<std::string> m_keys;
+};
@@ -0,0 +1,932 @@
+#include "languageserver.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+
+// JSON-RPC error codes
+static const int ParseError = -32700;
+static const int InvalidRequest = -32600;
+static const int MethodNotFound = -32601;
+
+// LSP values
+static const int SyncIncremental = 2;
+static const int SeverityError = 1;
+static const int SeverityWarning = 2;
+
+// Larger messages are not a client we can talk to
+static const std::size_t MaxMessageSize = 64 * 1024 * 1024;
+
+static bool isIdentStart(char c)
+{
+    return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+static bool isIdentChar(char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+/* Byte offset of a position in a line. Positions count UTF-16 code units,
+ * so characters outside the BMP count twice. */
+static unsigned int toOffset(const std::string &text, long character)
+{
+    std::size_t i = 0;
+    while (i < text.size() && character > 0) {
+        unsigned char c = text[i];
+        std::size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        character -= length == 4 ? 2 : 1;
+        i = std::min(i + length, text.size());
+    }
+    return i;
+}
+
+static unsigned int toCharacter(const std::string &text, std::size_t offset)
+{
+    unsigned int character = 0;
+    std::size_t i = 0;
+    while (i < offset && i < text.size()) {
+        unsigned char c = text[i];
+        std::size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        character += length == 4 ? 2 : 1;
+        i += length;
+    }
+    return character;
+}
+
+/* Split text at line feeds. A trailing line feed is followed by an empty
+ * line, as the client counts lines. */
+static void splitLines(const std::string &text, std::vector<std::string> *out)
+{
+    std::size_t start = 0;
+    for (;;) {
+        std::size_t end = text.find('\n', start);
+        std::size_t lineEnd = end == std::string::npos ? text.size() : end;
+        if (lineEnd > start && text[lineEnd - 1] == '\r') {
+            --lineEnd;
+        }
+        out->emplace_back(text, start, lineEnd - start);
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+}
+
+static std::string uriToPath(const std::string &uri)
+{
+    static const char prefix[] = "file://";
+    if (uri.compare(0, sizeof(prefix) - 1, prefix) != 0) {
+        return uri;
+    }
+
+    std::string path;
+    for (std::size_t i = sizeof(prefix) - 1; i < uri.size(); ++i) {
+        if (uri[i] == '%' && i + 2 < uri.size()
+                && std::isxdigit(static_cast<unsigned char>(uri[i + 1]))
+                && std::isxdigit(static_cast<unsigned char>(uri[i + 2]))) {
+            path += static_cast<char>(
+                    std::strtol(uri.substr(i + 1, 2).c_str(), nullptr, 16));
+            i += 2;
+        } else {
+            path += uri[i];
+        }
+    }
+    return path;
+}
+
+static std::string pathToUri(const std::string &path)
+{
+    std::string uri = "file://";
+    for (unsigned char c : path) {
+        if (std::isalnum(c) || std::strchr("/-._~", c)) {
+            uri += c;
+        } else {
+            char buf[4];
+            std::snprintf(buf, sizeof(buf), "%%%02X", c);
+            uri += buf;
+        }
+    }
+    return uri;
+}
+
+static Json position(long line, long character)
+{
+    Json json = Json::object();
+    json.set("line", line);
+    json.set("character", character);
+    return json;
+}
+
+static Json range(long line, long start, long end)
+{
+    Json json = Json::object();
+    json.set("start", position(line, start));
+    json.set("end", position(line, end));
+    return json;
+}
+
+LanguageServer::LanguageServer()
+    : m_shutdown(false)
+    , m_exit(false)
+    , m_stopping(false)
+{
+}
+
+LanguageServer::~LanguageServer()
+{
+}
+
+bool LanguageServer::run()
+{
+    std::thread worker(&LanguageServer::analyze, this);
+
+    std::string text;
+    while (!m_exit && readMessage(&text)) {
+        Json message;
+        if (!Json::parse(text, &message)) {
+            respondError(Json(), ParseError, "Invalid JSON");
+        } else if (message.type() != Json::Object) {
+            respondError(Json(), InvalidRequest, "Expected a message object");
+        } else {
+            handle(message);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_cancel.cancel();
+    }
+    m_jobReady.notify_one();
+    worker.join();
+
+    return m_shutdown;
+}
+
+/* Read the content of the next message. Only the Content-Length header is
+ * used. */
+bool LanguageServer::readMessage(std::string *out)
+{
+    std::size_t length = 0;
+    bool hasLength = false;
+
+    std::string header;
+    for (;;) {
+        if (!std::getline(std::cin, header)) {
+            return false;
+        }
+        if (!header.empty() && header.back() == '\r') {
+            header.pop_back();
+        }
+        if (header.empty()) {
+            if (hasLength) {
+                break;
+            }
+            continue;
+        }
+
+        static const char name[] = "Content-Length:";
+        if (header.compare(0, sizeof(name) - 1, name) == 0) {
+            length = std::strtoul(header.c_str() + sizeof(name) - 1,
+                                  nullptr, 10);
+            hasLength = true;
+        }
+    }
+
+    if (length > MaxMessageSize) {
+        return false;
+    }
+
+    out->resize(length);
+    return length == 0 || std::cin.read(&(*out)[0], length);
+}
+
+void LanguageServer::send(const Json &message)
+{
+    std::string content = message.dump();
+
+    std::lock_guard<std::mutex> lock(m_outputMutex);
+    std::fprintf(stdout, "Content-Length: %zu\r\n\r\n", content.size());
+    std::fwrite(content.data(), 1, content.size(), stdout);
+    std::fflush(stdout);
+}
+
+void LanguageServer::respond(const Json &id, const Json &result)
+{
+    send(Json::object()
+            .set("jsonrpc", "2.0")
+            .set("id", id)
+            .set("result", result));
+}
+
+void LanguageServer::respondError(const Json &id, int code,
+                                  const std::string &message)
+{
+    send(Json::object()
+            .set("jsonrpc", "2.0")
+            .set("id", id)
+            .set("error", Json::object()
+                    .set("code", code)
+                    .set("message", message)));
+}
+
+void LanguageServer::handle(const Json &message)
+{
+    const std::string &method = message["method"].toString();
+    const Json &params = message["params"];
+    const Json &id = message["id"];
+    // Notifications have no ID and get no response
+    bool request = message.has("id");
+
+    if (method == "initialize") {
+        Json capabilities = Json::object()
+                .set("textDocumentSync", Json::object()
+                        .set("openClose", true)
+                        .set("change", SyncIncremental))
+                .set("definitionProvider", true)
+                .set("referencesProvider", true)
+                .set("hoverProvider", true);
+        respond(id, Json::object()
+                .set("capabilities", capabilities)
+                .set("serverInfo", Json::object().set("name", "sicasm")));
+    } else if (method == "shutdown") {
+        m_shutdown = true;
+        respond(id, Json());
+    } else if (method == "exit") {
+        m_exit = true;
+    } else if (method == "textDocument/didOpen") {
+        didOpen(params);
+    } else if (method == "textDocument/didChange") {
+        didChange(params);
+    } else if (method == "textDocument/didClose") {
+        didClose(params);
+    } else if (method == "textDocument/definition") {
+        respond(id, definition(params));
+    } else if (method == "textDocument/references") {
+        respond(id, references(params));
+    } else if (method == "textDocument/hover") {
+        respond(id, hover(params));
+    } else if (request && method.empty()) {
+        respondError(id, InvalidRequest, "Missing method");
+    } else if (request) {
+        respondError(id, MethodNotFound, "Unsupported method: " + method);
+    }
+}
+
+void LanguageServer::didOpen(const Json &params)
+{
+    const Json &item = params["textDocument"];
+    const std::string &uri = item["uri"].toString();
+
+    std::unique_ptr<Document> doc(new Document());
+    doc->uri = uri;
+    doc->path = uriToPath(uri);
+    doc->version = item["version"].toInt();
+    setText(doc.get(), item["text"].toString());
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_analyses[uri];
+    }
+
+    schedule(*doc);
+    m_documents[uri] = std::move(doc);
+}
+
+void LanguageServer::didChange(const Json &params)
+{
+    Document *doc = findDocument(params);
+    if (doc == nullptr) {
+        return;
+    }
+
+    doc->version = params["textDocument"]["version"].toInt();
+
+    const Json &changes = params["contentChanges"];
+    for (std::size_t i = 0; i < changes.size(); ++i) {
+        const Json &change = changes.at(i);
+        if (change.has("range")) {
+            applyChange(doc, change["range"], change["text"].toString());
+        } else {
+            setText(doc, change["text"].toString());
+        }
+    }
+
+    schedule(*doc);
+}
+
+void LanguageServer::didClose(const Json &params)
+{
+    const std::string &uri = params["textDocument"]["uri"].toString();
+    m_documents.erase(uri);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.erase(uri);
+
+    // Diagnostics of a closed document are cleared, and the worker may no
+    // longer publish any for it
+    auto it = m_analyses.find(uri);
+    if (it != m_analyses.end()) {
+        std::vector<std::string> uris;
+        if (it->second) {
+            uris = it->second->uris;
+        }
+        m_analyses.erase(it);
+
+        for (auto const &published : uris) {
+            send(Json::object()
+                    .set("jsonrpc", "2.0")
+                    .set("method", "textDocument/publishDiagnostics")
+                    .set("params", Json::object()
+                            .set("uri", published)
+                            .set("diagnostics", Json::array())));
+        }
+    }
+}
+
+Json LanguageServer::definition(const Json &params)
+{
+    Document *doc = findDocument(params);
+    unsigned int offset;
+    Line *line = doc ? lineAt(doc, params["position"], &offset) : nullptr;
+    const Symbol *symbol = line ? symbolAt(*line, offset) : nullptr;
+    if (symbol == nullptr || symbol->id >= doc->index.size()) {
+        return Json();
+    }
+
+    std::vector<Line *> lines = doc->index[symbol->id].definitions;
+    std::sort(lines.begin(), lines.end(), [](const Line *a, const Line *b) {
+        return a->number < b->number;
+    });
+
+    Json result = Json::array();
+    for (const Line *site : lines) {
+        for (auto const &s : site->symbols) {
+            if (s.id == symbol->id && s.definition) {
+                result.push(location(*doc, *site, s.start, s.end));
+            }
+        }
+    }
+    return result;
+}
+
+Json LanguageServer::references(const Json &params)
+{
+    Document *doc = findDocument(params);
+    unsigned int offset;
+    Line *line = doc ? lineAt(doc, params["position"], &offset) : nullptr;
+    const Symbol *symbol = line ? symbolAt(*line, offset) : nullptr;
+    if (symbol == nullptr || symbol->id >= doc->index.size()) {
+        return Json();
+    }
+
+    bool declarations = params["context"]["includeDeclaration"].toBool();
+    const Sites &sites = doc->index[symbol->id];
+
+    std::vector<Line *> lines = sites.references;
+    if (declarations) {
+        lines.insert(lines.end(), sites.definitions.begin(),
+                     sites.definitions.end());
+    }
+    std::sort(lines.begin(), lines.end(), [](const Line *a, const Line *b) {
+        return a->number < b->number;
+    });
+    // A line can both define and reference the symbol
+    lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+    Json result = Json::array();
+    for (const Line *site : lines) {
+        for (auto const &s : site->symbols) {
+            if (s.id == symbol->id && (declarations || !s.definition)) {
+                result.push(location(*doc, *site, s.start, s.end));
+            }
+        }
+    }
+    return result;
+}
+
+/* Describe the symbol or instruction under the cursor, followed by the
+ * address and object code of the line if the current version of the
+ * document has been assembled */
+Json LanguageServer::hover(const Json &params)
+{
+    Document *doc = findDocument(params);
+    unsigned int offset;
+    Line *line = doc ? lineAt(doc, params["position"], &offset) : nullptr;
+    if (line == nullptr) {
+        return Json();
+    }
+
+    std::shared_ptr<Analysis> analysis;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_analyses.find(doc->uri);
+        if (it != m_analyses.end() && it->second
+                && it->second->version == doc->version) {
+            analysis = it->second;
+        }
+    }
+
+    auto lineInfo = [&](const Line *l) -> const Assembler::LineInfo * {
+        if (!analysis || l->number >= analysis->byLine.size()
+                || analysis->byLine[l->number] < 0) {
+            return nullptr;
+        }
+        return &analysis->lines[analysis->byLine[l->number]];
+    };
+
+    std::string value;
+    unsigned int start = 0;
+    unsigned int end = 0;
+    char buf[64];
+
+    const Symbol *symbol = symbolAt(*line, offset);
+    if (symbol != nullptr && symbol->id < doc->index.size()) {
+        const Sites &sites = doc->index[symbol->id];
+        start = symbol->start;
+        end = symbol->end;
+
+        value += "**";
+        value += doc->symbols.name(symbol->id);
+        value += "**";
+
+        const Line *def = nullptr;
+        for (const Line *l : sites.definitions) {
+            if (def == nullptr || l->number < def->number) {
+                def = l;
+            }
+        }
+
+        if (def == nullptr) {
+            value += " is not defined in this file";
+        } else {
+            value += " is defined on line " + std::to_string(def->number + 1);
+            const Assembler::LineInfo *info = lineInfo(def);
+            if (info != nullptr) {
+                std::snprintf(buf, sizeof(buf), " at address %06X",
+                              info->address);
+                value += buf;
+            }
+        }
+
+        std::size_t count = sites.references.size();
+        value += ", referenced on " + std::to_string(count)
+                + (count == 1 ? " line" : " lines");
+    } else if (offset >= line->instrStart && offset < line->instrEnd) {
+        start = line->instrStart;
+        end = line->instrEnd;
+
+        std::string instr = line->text.substr(start, end - start);
+        std::string name = Instructions::stripModifiers(instr);
+
+        value += "**" + name + "**";
+        if (m_instrs.isSicXE(instr)) {
+            auto *info = m_instrs[instr];
+            const char *format = "3/4";
+            if (info->length == Instructions::Length::One) {
+                format = "1";
+            } else if (info->length == Instructions::Length::Two) {
+                format = "2";
+            } else if (Instructions::isExtended(instr)) {
+                format = "4";
+            }
+            std::snprintf(buf, sizeof(buf), " opcode %02X, format %s",
+                          info->opcode, format);
+            value += buf;
+        } else {
+            value += " directive";
+        }
+    } else {
+        return Json();
+    }
+
+    const Assembler::LineInfo *info = lineInfo(line);
+    if (info != nullptr && info->hasAddress) {
+        std::snprintf(buf, sizeof(buf), "%06X", info->address);
+        value += "\n\n`";
+        value += buf;
+        if (info->encoded && !info->objectCode.empty()) {
+            value += "  ";
+            for (unsigned char byte : info->objectCode) {
+                std::snprintf(buf, sizeof(buf), "%02X", byte);
+                value += buf;
+            }
+        }
+        value += "`";
+    }
+
+    return Json::object()
+            .set("contents", Json::object()
+                    .set("kind", "markdown")
+                    .set("value", value))
+            .set("range", range(line->number, toCharacter(line->text, start),
+                                toCharacter(line->text, end)));
+}
+
+LanguageServer::Document * LanguageServer::findDocument(const Json &params)
+{
+    auto it = m_documents.find(params["textDocument"]["uri"].toString());
+    return it == m_documents.end() ? nullptr : it->second.get();
+}
+
+void LanguageServer::setText(Document *doc, const std::string &text)
+{
+    doc->lines.clear();
+    doc->symbols.clear();
+    doc->index.clear();
+
+    std::vector<std::string> lines;
+    splitLines(text, &lines);
+
+    for (std::size_t i = 0; i < lines.size(); ++i) {
+        std::unique_ptr<Line> line(new Line());
+        line->text.swap(lines[i]);
+        line->number = i;
+        lexLine(doc, line.get());
+        doc->lines.push_back(std::move(line));
+    }
+}
+
+/* Replace a range of the document. Only the lines in the range are lexed
+ * again, and the lines after it are renumbered if the line count changed. */
+void LanguageServer::applyChange(Document *doc, const Json &range,
+                                 const std::string &text)
+{
+    std::size_t count = doc->lines.size();
+    std::size_t startLine = std::min<std::size_t>(
+            std::max(range["start"]["line"].toInt(), 0L), count - 1);
+    std::size_t endLine = std::min<std::size_t>(
+            std::max(range["end"]["line"].toInt(), 0L), count - 1);
+    if (endLine < startLine) {
+        std::swap(startLine, endLine);
+    }
+
+    const std::string &first = doc->lines[startLine]->text;
+    const std::string &last = doc->lines[endLine]->text;
+    std::size_t startOffset = toOffset(first, range["start"]["character"].toInt());
+    std::size_t endOffset = toOffset(last, range["end"]["character"].toInt());
+    if (startLine == endLine && endOffset < startOffset) {
+        std::swap(startOffset, endOffset);
+    }
+
+    std::vector<std::string> lines;
+    splitLines(first.substr(0, startOffset) + text + last.substr(endOffset),
+               &lines);
+
+    for (std::size_t i = startLine; i <= endLine; ++i) {
+        unindexLine(doc, doc->lines[i].get());
+    }
+
+    // Replaced lines are reused for the new text
+    std::size_t oldCount = endLine - startLine + 1;
+    auto at = doc->lines.begin() + startLine;
+    if (lines.size() > oldCount) {
+        std::vector<std::unique_ptr<Line>> added(lines.size() - oldCount);
+        for (auto &line : added) {
+            line.reset(new Line());
+        }
+        doc->lines.insert(at + oldCount, std::make_move_iterator(added.begin()),
+                          std::make_move_iterator(added.end()));
+    } else if (lines.size() < oldCount) {
+        doc->lines.erase(at + lines.size(), at + oldCount);
+    }
+
+    for (std::size_t i = 0; i < lines.size(); ++i) {
+        Line *line = doc->lines[startLine + i].get();
+        line->text.swap(lines[i]);
+        line->number = startLine + i;
+        lexLine(doc, line);
+    }
+
+    if (lines.size() != oldCount) {
+        for (std::size_t i = startLine + lines.size(); i < doc->lines.size();
+                ++i) {
+            doc->lines[i]->number = i;
+        }
+    }
+}
+
+/* Find the label, instruction and operand symbols of a line, and add the
+ * line to the index. Tokens are split as the assembler does, and a token
+ * starting with '.' or ';' begins a comment. */
+void LanguageServer::lexLine(Document *doc, Line *line)
+{
+    const std::string &text = line->text;
+    line->symbols.clear();
+    line->instrStart = 0;
+    line->instrEnd = 0;
+
+    std::vector<std::pair<unsigned int, unsigned int>> tokens;
+    for (std::size_t i = 0; i < text.size(); ) {
+        if (text[i] == ' ' || text[i] == '\t') {
+            ++i;
+            continue;
+        }
+        if (text[i] == '.' || text[i] == ';') {
+            break;
+        }
+        std::size_t end = i;
+        while (end < text.size() && text[end] != ' ' && text[end] != '\t') {
+            ++end;
+        }
+        tokens.emplace_back(i, end);
+        i = end;
+    }
+
+    auto token = [&](std::size_t i) {
+        return text.substr(tokens[i].first, tokens[i].second - tokens[i].first);
+    };
+
+    std::size_t instrIndex;
+    if (tokens.empty()) {
+        return;
+    } else if (m_instrs.isValid(token(0))) {
+        instrIndex = 0;
+    } else if (tokens.size() >= 2 && m_instrs.isValid(token(1))) {
+        instrIndex = 1;
+        if (Instructions::getRegister(token(0)) < 0) {
+            addSymbol(doc, line, token(0), tokens[0].first, tokens[0].second,
+                      true);
+        }
+    } else {
+        return;
+    }
+
+    line->instrStart = tokens[instrIndex].first;
+    line->instrEnd = tokens[instrIndex].second;
+
+    // Operands of these are not symbols
+    std::string instr = Instructions::stripModifiers(token(instrIndex));
+    if (instr == Instructions::Directive_START
+            || instr == Instructions::Directive_USE
+            || instr == Instructions::Directive_INCLUDE
+            || instr == Instructions::Directive_IF) {
+        return;
+    }
+    // An external reference is the only declaration in this file
+    bool definition = instr == Instructions::Directive_EXTREF;
+
+    for (std::size_t t = instrIndex + 1; t < tokens.size(); ++t) {
+        std::size_t i = tokens[t].first;
+        std::size_t end = tokens[t].second;
+
+        while (i < end) {
+            char c = text[i];
+            if (c == '\'') {
+                // Character and hex constants
+                std::size_t close = text.find('\'', i + 1);
+                i = close < end ? close + 1 : end;
+            } else if (c == '%' || std::isdigit(static_cast<unsigned char>(c))) {
+                // Register names in the %RA style, and numbers
+                ++i;
+                while (i < end && isIdentChar(text[i])) {
+                    ++i;
+                }
+            } else if (isIdentStart(c)) {
+                std::size_t start = i;
+                while (i < end && isIdentChar(text[i])) {
+                    ++i;
+                }
+
+                std::string name = text.substr(start, i - start);
+                // C'...' and X'...' constants, and registers
+                if ((i < end && text[i] == '\'')
+                        || Instructions::getRegister(name) >= 0) {
+                    continue;
+                }
+                addSymbol(doc, line, name, start, i, definition);
+            } else {
+                ++i;
+            }
+        }
+    }
+}
+
+void LanguageServer::addSymbol(Document *doc, Line *line,
+                               const std::string &name, unsigned int start,
+                               unsigned int end, bool definition)
+{
+    uint32_t id = doc->symbols.intern(name);
+    if (id >= doc->index.size()) {
+        doc->index.resize(id + 1);
+    }
+    line->symbols.push_back({ id, start, end, definition });
+
+    // A line is listed once however often it uses the symbol. Its earlier
+    // uses were added last, so it would be at the back.
+    auto &sites = definition ? doc->index[id].definitions
+                             : doc->index[id].references;
+    if (sites.empty() || sites.back() != line) {
+        sites.push_back(line);
+    }
+}
+
+void LanguageServer::unindexLine(Document *doc, Line *line)
+{
+    for (auto const &symbol : line->symbols) {
+        auto &sites = symbol.definition ? doc->index[symbol.id].definitions
+                                        : doc->index[symbol.id].references;
+        auto it = std::find(sites.begin(), sites.end(), line);
+        if (it != sites.end()) {
+            *it = sites.back();
+            sites.pop_back();
+        }
+    }
+}
+
+const LanguageServer::Symbol * LanguageServer::symbolAt(
+        const Line &line, unsigned int offset)
+{
+    // The cursor may also be right after the symbol
+    for (auto const &symbol : line.symbols) {
+        if (offset >= symbol.start && offset <= symbol.end) {
+            return &symbol;
+        }
+    }
+    return nullptr;
+}
+
+LanguageServer::Line * LanguageServer::lineAt(Document *doc,
+                                              const Json &position,
+                                              unsigned int *offset)
+{
+    long number = position["line"].toInt();
+    if (number < 0 || static_cast<std::size_t>(number) >= doc->lines.size()) {
+        return nullptr;
+    }
+
+    Line *line = doc->lines[number].get();
+    *offset = toOffset(line->text, position["character"].toInt());
+    return line;
+}
+
+Json LanguageServer::location(const Document &doc, const Line &line,
+                              unsigned int start, unsigned int end)
+{
+    Json json = Json::object();
+    json.set("uri", doc.uri);
+    json.set("range", range(line.number, toCharacter(line.text, start),
+                            toCharacter(line.text, end)));
+    return json;
+}
+
+/* Queue the current text of a document for the worker, replacing any older
+ * version that it has not started on */
+void LanguageServer::schedule(const Document &doc)
+{
+    Job job;
+    job.uri = doc.uri;
+    job.path = doc.path;
+    job.version = doc.version;
+
+    std::size_t size = 0;
+    for (auto const &line : doc.lines) {
+        size += line->text.size() + 1;
+    }
+    job.text.reserve(size);
+    for (auto const &line : doc.lines) {
+        job.text += line->text;
+        job.text += '\n';
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs[doc.uri] = std::move(job);
+        // The version being assembled is out of date now
+        if (m_assembling == doc.uri) {
+            m_cancel.cancel();
+        }
+    }
+    m_jobReady.notify_one();
+}
+
+/* Worker thread. One assembler is reused for every document, so included
+ * files stay cached between runs. */
+void LanguageServer::analyze()
+{
+    Assembler::Options options;
+    options.listing = false;
+    options.printDiagnostics = false;
+    options.displacementWarnings = true;
+    options.cancel = &m_cancel;
+
+    Assembler assembler;
+    assembler.setOptions(options);
+
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_jobReady.wait(lock, [this]() {
+                return m_stopping || !m_jobs.empty();
+            });
+            if (m_stopping) {
+                return;
+            }
+            job = std::move(m_jobs.begin()->second);
+            m_jobs.erase(m_jobs.begin());
+            m_assembling = job.uri;
+            m_cancel.reset();
+        }
+
+        assembler.assembleText(job.path, job.text);
+
+        {
+            // A cancelled run has nothing to publish, the newer version of
+            // the document is waiting in m_jobs
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_assembling.clear();
+            if (m_cancel.isCancelled()) {
+                continue;
+            }
+        }
+
+        std::shared_ptr<Analysis> analysis(new Analysis());
+        analysis->version = job.version;
+        assembler.getLineInfo(&analysis->lines);
+        for (std::size_t i = 0; i < analysis->lines.size(); ++i) {
+            auto const &info = analysis->lines[i];
+            if (info.file != 0) {
+                continue;
+            }
+            std::size_t number = info.lineNumber - 1;
+            if (number >= analysis->byLine.size()) {
+                analysis->byLine.resize(number + 1, -1);
+            }
+            analysis->byLine[number] = i;
+        }
+
+        publish(job, &assembler, analysis);
+    }
+}
+
+/* Publish the diagnostics of a document and of the files it includes, and
+ * clear those of files that no longer have any */
+void LanguageServer::publish(const Job &job, Assembler *assembler,
+                             std::shared_ptr<Analysis> analysis)
+{
+    auto const &files = assembler->sourceFiles();
+
+    std::map<std::string, Json> byUri;
+    byUri[job.uri] = Json::array();
+
+    for (auto const &diagnostic : assembler->diagnostics()) {
+        const std::string &uri = diagnostic.file == 0
+                ? job.uri : pathToUri(files[diagnostic.file]);
+        long line = diagnostic.lineNumber > 0 ? diagnostic.lineNumber - 1 : 0;
+        long end = toCharacter(diagnostic.line, diagnostic.line.size());
+
+        auto it = byUri.find(uri);
+        if (it == byUri.end()) {
+            it = byUri.insert(std::make_pair(uri, Json::array())).first;
+        }
+        it->second.push(Json::object()
+                .set("range", range(line, 0, end))
+                .set("severity",
+                     diagnostic.severity == Assembler::Diagnostic::Warning
+                             ? SeverityWarning : SeverityError)
+                .set("source", "sicasm")
+                .set("message", diagnostic.message));
+    }
+
+    for (auto const &entry : byUri) {
+        analysis->uris.push_back(entry.first);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The document was closed while it was being assembled
+    auto it = m_analyses.find(job.uri);
+    if (it == m_analyses.end()) {
+        return;
+    }
+
+    if (it->second) {
+        for (auto const &uri : it->second->uris) {
+            if (byUri.find(uri) == byUri.end()) {
+                byUri[uri] = Json::array();
+            }
+        }
+    }
+    it->second = analysis;
+
+    for (auto const &entry : byUri) {
+        Json params = Json::object().set("uri", entry.first);
+        if (entry.first == job.uri) {
+            params.set("version", job.version);
+        }
+        params.set("diagnostics", entry.second);
+
+        send(Json::object()
+                .set("jsonrpc", "2.0")
+                .set("method", "textDocument/publishDiagnostics")
+                .set("params", params));
+    }
+}
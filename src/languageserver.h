@@ -0,0 +1,143 @@
+#pragma once
+
+#include "assembler.h"
+#include "cancellation.h"
+#include "instructions.h"
+#include "json.h"
+#include "symbolpool.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Language server for SIC/XE source, speaking the Language Server Protocol
+ * over standard input and output.
+ *
+ * Each open document is kept as a table of lines, and an inverted index maps
+ * every symbol to the lines that define and reference it. An edit only lexes
+ * the lines it replaces again and moves their entries in the index, so
+ * definitions, references and hovers are answered without assembling
+ * anything. Diagnostics, addresses and object code come from assembling the
+ * whole document on a worker thread, which always takes the latest text of a
+ * document and skips the versions that were replaced in the meantime. */
+class LanguageServer
+{
+public:
+    LanguageServer();
+    ~LanguageServer();
+
+    LanguageServer(const LanguageServer &) = delete;
+    LanguageServer & operator=(const LanguageServer &) = delete;
+
+    // Serve the client until it sends exit or closes the input. Returns
+    // true if the client asked for a shutdown before exiting.
+    bool run();
+
+private:
+    // A symbol on a line, as byte offsets
+    struct Symbol {
+        uint32_t id;
+        unsigned int start;
+        unsigned int end;
+        bool definition;
+    };
+
+    struct Line {
+        std::string text;
+        // Index of the line in the document
+        std::size_t number;
+        std::vector<Symbol> symbols;
+        // Instruction or directive, as byte offsets
+        unsigned int instrStart;
+        unsigned int instrEnd;
+    };
+
+    // Lines that define and that reference a symbol, in no particular order
+    struct Sites {
+        std::vector<Line *> definitions;
+        std::vector<Line *> references;
+    };
+
+    struct Document {
+        std::string uri;
+        std::string path;
+        long version;
+        std::vector<std::unique_ptr<Line>> lines;
+        SymbolPool symbols;
+        // Symbol ID -> sites
+        std::vector<Sites> index;
+    };
+
+    // Results of assembling one version of a document
+    struct Analysis {
+        long version;
+        std::vector<Assembler::LineInfo> lines;
+        // Line index in the document -> index into lines, or -1
+        std::vector<int> byLine;
+        // Documents that diagnostics were published for
+        std::vector<std::string> uris;
+    };
+
+    struct Job {
+        std::string uri;
+        std::string path;
+        long version;
+        std::string text;
+    };
+
+    bool readMessage(std::string *out);
+    void send(const Json &message);
+    void respond(const Json &id, const Json &result);
+    void respondError(const Json &id, int code, const std::string &message);
+    void handle(const Json &message);
+
+    void didOpen(const Json &params);
+    void didChange(const Json &params);
+    void didClose(const Json &params);
+    Json definition(const Json &params);
+    Json references(const Json &params);
+    Json hover(const Json &params);
+
+    Document * findDocument(const Json &params);
+    void setText(Document *doc, const std::string &text);
+    void applyChange(Document *doc, const Json &range, const std::string &text);
+    void lexLine(Document *doc, Line *line);
+    void addSymbol(Document *doc, Line *line, const std::string &name,
+                   unsigned int start, unsigned int end, bool definition);
+    void unindexLine(Document *doc, Line *line);
+    static const Symbol * symbolAt(const Line &line, unsigned int offset);
+    Line * lineAt(Document *doc, const Json &position, unsigned int *offset);
+    Json location(const Document &doc, const Line &line,
+                  unsigned int start, unsigned int end);
+
+    void schedule(const Document &doc);
+    void analyze();
+    void publish(const Job &job, Assembler *assembler,
+                 std::shared_ptr<Analysis> analysis);
+
+    Instructions m_instrs;
+    std::unordered_map<std::string, std::unique_ptr<Document>> m_documents;
+    bool m_shutdown;
+    bool m_exit;
+
+    // Guards the members below, which are shared with the worker thread
+    std::mutex m_mutex;
+    std::condition_variable m_jobReady;
+    // Latest text of the documents waiting to be assembled, by URI
+    std::map<std::string, Job> m_jobs;
+    // Last analysis of each open document
+    std::unordered_map<std::string, std::shared_ptr<Analysis>> m_analyses;
+    // Document being assembled, whose run is cancelled when a newer version
+    // of it is scheduled
+    std::string m_assembling;
+    CancellationToken m_cancel;
+    bool m_stopping;
+
+    // Keeps messages from both threads whole
+    std::mutex m_outputMutex;
+};
@@ -0,0 +1,448 @@
+#include "linetable.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+const char LineTable::Magic[4] = { 'S', 'X', 'L', 'T' };
+const uint32_t LineTable::Version = 1;
+const uint32_t LineTable::BlockEntries = 32;
+
+static const std::size_t HeaderSize = 32;
+static const std::size_t BlockEntrySize = 16;
+static const std::size_t SymbolEntrySize = 8;
+static const std::size_t FileEntrySize = 4;
+
+static void putLE32(unsigned char *p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t getLE32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void appendLE32(std::vector<unsigned char> *out, uint32_t value)
+{
+    out->resize(out->size() + 4);
+    putLE32(&out->back() - 3, value);
+}
+
+static void appendVarint(std::vector<unsigned char> *out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out->push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out->push_back(value);
+}
+
+/* Read a LEB128 number, failing at the end of the data or if it is longer
+ * than 64 bits */
+static bool readVarint(const unsigned char **p, const unsigned char *end,
+                       uint64_t *out)
+{
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (*p == end) {
+            return false;
+        }
+
+        unsigned char byte = *(*p)++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *out = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Signed deltas are zigzag encoded so that small negative numbers stay short
+static uint64_t zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ (value < 0 ? ~uint64_t(0) : 0);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+static std::size_t align4(std::size_t value)
+{
+    return (value + 3) & ~std::size_t(3);
+}
+
+LineTable::LineTable()
+    : m_map(nullptr), m_mapSize(0), m_entryCount(0), m_blockCount(0),
+      m_symbolCount(0), m_fileCount(0), m_stringsSize(0), m_blocks(nullptr),
+      m_data(nullptr), m_dataEnd(nullptr), m_symbolTable(nullptr),
+      m_fileTable(nullptr), m_strings(nullptr)
+{
+}
+
+LineTable::~LineTable()
+{
+    unmap();
+}
+
+void LineTable::unmap()
+{
+    if (m_map) {
+        munmap(m_map, m_mapSize);
+        m_map = nullptr;
+        m_mapSize = 0;
+    }
+
+    m_entryCount = m_blockCount = m_symbolCount = m_fileCount = 0;
+    m_stringsSize = 0;
+}
+
+const std::string & LineTable::error() const
+{
+    return m_error;
+}
+
+uint32_t LineTable::addFile(const std::string &name)
+{
+    m_file.clear();
+    m_files.push_back(name);
+    return m_files.size() - 1;
+}
+
+void LineTable::addEntry(const Entry &entry)
+{
+    m_file.clear();
+    m_entries.push_back(entry);
+}
+
+void LineTable::addSymbol(const std::string &name, uint32_t address)
+{
+    m_file.clear();
+    m_symbols.push_back({ address, name });
+}
+
+/* Encode the table into the layout of the file. Returns its size. */
+std::size_t LineTable::build()
+{
+    std::stable_sort(m_entries.begin(), m_entries.end(),
+                     [](const Entry &a, const Entry &b) {
+        return a.address < b.address;
+    });
+    std::stable_sort(m_symbols.begin(), m_symbols.end(),
+                     [](const Symbol &a, const Symbol &b) {
+        return a.address < b.address;
+    });
+
+    std::vector<unsigned char> blocks;
+    std::vector<unsigned char> data;
+    uint32_t prevEnd = 0;
+    const Entry *prev = nullptr;
+
+    for (std::size_t i = 0; i < m_entries.size(); ++i) {
+        const Entry &entry = m_entries[i];
+
+        // Each block starts from the values in its index entry
+        if (i % BlockEntries == 0) {
+            appendLE32(&blocks, entry.address);
+            appendLE32(&blocks, entry.file);
+            appendLE32(&blocks, entry.line);
+            appendLE32(&blocks, data.size());
+            prev = &entry;
+            prevEnd = entry.address;
+        }
+
+        bool fileChanged = entry.file != prev->file;
+        int64_t lineDelta = int64_t(entry.line) - prev->line;
+
+        appendVarint(&data, entry.address - prevEnd);
+        appendVarint(&data, entry.length);
+        appendVarint(&data, (zigzag(lineDelta) << 1) | fileChanged);
+        if (fileChanged) {
+            appendVarint(&data, entry.file);
+        }
+
+        prev = &entry;
+        prevEnd = entry.address + entry.length;
+    }
+
+    data.resize(align4(data.size()), 0);
+
+    std::vector<unsigned char> strings;
+    std::vector<unsigned char> tables;
+    for (auto const &symbol : m_symbols) {
+        appendLE32(&tables, symbol.address);
+        appendLE32(&tables, strings.size());
+        strings.insert(strings.end(), symbol.name.begin(), symbol.name.end());
+        strings.push_back('\0');
+    }
+    for (auto const &file : m_files) {
+        appendLE32(&tables, strings.size());
+        strings.insert(strings.end(), file.begin(), file.end());
+        strings.push_back('\0');
+    }
+
+    m_file.assign(HeaderSize, 0);
+    std::memcpy(&m_file[0], Magic, sizeof(Magic));
+    putLE32(&m_file[4], Version);
+    putLE32(&m_file[8], m_entries.size());
+    putLE32(&m_file[12], blocks.size() / BlockEntrySize);
+    putLE32(&m_file[16], data.size());
+    putLE32(&m_file[20], m_symbols.size());
+    putLE32(&m_file[24], m_files.size());
+    putLE32(&m_file[28], strings.size());
+
+    m_file.insert(m_file.end(), blocks.begin(), blocks.end());
+    m_file.insert(m_file.end(), data.begin(), data.end());
+    m_file.insert(m_file.end(), tables.begin(), tables.end());
+    m_file.insert(m_file.end(), strings.begin(), strings.end());
+
+    return m_file.size();
+}
+
+/* Write the table, building it first unless build() was called after the
+ * last change */
+bool LineTable::save(const std::string &path)
+{
+    if (m_file.empty()) {
+        build();
+    }
+
+    std::FILE *fp = std::fopen(path.c_str(), "wb");
+    if (fp == nullptr) {
+        m_error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    bool ok = std::fwrite(m_file.data(), 1, m_file.size(), fp) == m_file.size();
+
+    if (std::fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        m_error = path + ": Failed to write line table";
+    }
+
+    return ok;
+}
+
+bool LineTable::load(const std::string &path)
+{
+    unmap();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        m_error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        m_error = path + ": " + std::strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    if (static_cast<std::size_t>(sb.st_size) < HeaderSize) {
+        m_error = path + ": File too small for line table header";
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        m_error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    m_map = map;
+    m_mapSize = sb.st_size;
+
+    auto *base = static_cast<const unsigned char *>(m_map);
+
+    if (std::memcmp(base, Magic, sizeof(Magic)) != 0) {
+        m_error = path + ": Not a line table file";
+        unmap();
+        return false;
+    }
+
+    if (getLE32(base + 4) != Version) {
+        m_error = path + ": Unsupported line table version";
+        unmap();
+        return false;
+    }
+
+    uint32_t entryCount = getLE32(base + 8);
+    uint32_t blockCount = getLE32(base + 12);
+    uint32_t dataSize = getLE32(base + 16);
+    uint32_t symbolCount = getLE32(base + 20);
+    uint32_t fileCount = getLE32(base + 24);
+    uint32_t stringsSize = getLE32(base + 28);
+
+    // Sizes are added in 64 bits so that large counts cannot wrap around
+    uint64_t blocksOffset = HeaderSize;
+    uint64_t dataOffset = blocksOffset + uint64_t(BlockEntrySize) * blockCount;
+    uint64_t symbolsOffset = dataOffset + dataSize;
+    uint64_t filesOffset = symbolsOffset + uint64_t(SymbolEntrySize) * symbolCount;
+    uint64_t stringsOffset = filesOffset + uint64_t(FileEntrySize) * fileCount;
+
+    if (stringsOffset + stringsSize != m_mapSize) {
+        m_error = path + ": Line table size does not match its header";
+        unmap();
+        return false;
+    }
+
+    if (blockCount != (uint64_t(entryCount) + BlockEntries - 1) / BlockEntries) {
+        m_error = path + ": Invalid number of line table blocks";
+        unmap();
+        return false;
+    }
+
+    // Names are only looked up in a NUL terminated table
+    if ((symbolCount > 0 || fileCount > 0)
+            && (stringsSize == 0 || base[m_mapSize - 1] != '\0')) {
+        m_error = path + ": Invalid line table strings";
+        unmap();
+        return false;
+    }
+
+    m_entryCount = entryCount;
+    m_blockCount = blockCount;
+    m_symbolCount = symbolCount;
+    m_fileCount = fileCount;
+    m_stringsSize = stringsSize;
+    m_blocks = base + blocksOffset;
+    m_data = base + dataOffset;
+    m_dataEnd = m_data + dataSize;
+    m_symbolTable = base + symbolsOffset;
+    m_fileTable = base + filesOffset;
+    m_strings = reinterpret_cast<const char *>(base + stringsOffset);
+
+    return true;
+}
+
+bool LineTable::find(uint32_t address, Entry *out) const
+{
+    // Last block that starts at or before the address
+    uint32_t low = 0;
+    uint32_t high = m_blockCount;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (getLE32(m_blocks + BlockEntrySize * mid) <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low == 0) {
+        return false;
+    }
+
+    uint32_t block = low - 1;
+    const unsigned char *index = m_blocks + BlockEntrySize * block;
+    uint32_t dataOffset = getLE32(index + 12);
+    if (dataOffset > static_cast<std::size_t>(m_dataEnd - m_data)) {
+        return false;
+    }
+
+    Entry entry = { getLE32(index), 0, getLE32(index + 4), getLE32(index + 8) };
+    Entry found = entry;
+    bool hasFound = false;
+    uint32_t prevEnd = entry.address;
+    uint32_t count = std::min(BlockEntries, m_entryCount - block * BlockEntries);
+    const unsigned char *p = m_data + dataOffset;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t gap, length, code;
+        if (!readVarint(&p, m_dataEnd, &gap)
+                || !readVarint(&p, m_dataEnd, &length)
+                || !readVarint(&p, m_dataEnd, &code)) {
+            return false;
+        }
+
+        if (code & 1) {
+            uint64_t file;
+            if (!readVarint(&p, m_dataEnd, &file)) {
+                return false;
+            }
+            entry.file = file;
+        }
+
+        entry.address = prevEnd + gap;
+        entry.length = length;
+        entry.line += unzigzag(code >> 1);
+        prevEnd = entry.address + entry.length;
+
+        if (entry.address > address) {
+            break;
+        }
+
+        found = entry;
+        hasFound = true;
+    }
+
+    if (!hasFound || address - found.address >= found.length) {
+        return false;
+    }
+
+    *out = found;
+    return true;
+}
+
+const char * LineTable::findSymbol(uint32_t address, uint32_t *offset) const
+{
+    uint32_t low = 0;
+    uint32_t high = m_symbolCount;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (getLE32(m_symbolTable + SymbolEntrySize * mid) <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low == 0) {
+        return nullptr;
+    }
+
+    const unsigned char *symbol = m_symbolTable + SymbolEntrySize * (low - 1);
+    *offset = address - getLE32(symbol);
+    return string(getLE32(symbol + 4));
+}
+
+const char * LineTable::fileName(uint32_t file) const
+{
+    if (file >= m_fileCount) {
+        return nullptr;
+    }
+
+    return string(getLE32(m_fileTable + FileEntrySize * file));
+}
+
+uint32_t LineTable::entryCount() const
+{
+    return m_entryCount;
+}
+
+const char * LineTable::string(uint32_t offset) const
+{
+    return offset < m_stringsSize ? m_strings + offset : nullptr;
+}
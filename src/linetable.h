@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Maps addresses of a program back to its source lines and symbols. All
+ * integers are little endian, and the file is mmapped and searched in place.
+ *
+ * Header (32 bytes):
+ *   0:  Magic "SXLT"
+ *   4:  Format version (1)
+ *   8:  Number of line entries
+ *   12: Number of blocks
+ *   16: Size of the entry data, padded to 4 bytes
+ *   20: Number of symbols
+ *   24: Number of source files
+ *   28: Size of the string table
+ *
+ * Block index (16 bytes per block, sorted by address):
+ *   0:  Address of the first entry
+ *   4:  Source file of the first entry
+ *   8:  Source line of the first entry
+ *   12: Offset of the block in the entry data
+ *
+ * Entry data: Blocks of up to BlockEntries entries sorted by address. Every
+ * entry is a run of LEB128 numbers relative to the previous one, or to the
+ * block index for the first entry of a block:
+ *   - Bytes from the end of the previous entry to the address
+ *   - Length in bytes
+ *   - Line delta, zigzag encoded and shifted left by one. The low bit is set
+ *     if the source file changes, and the file index follows.
+ *
+ * Symbol table (8 bytes per symbol, sorted by address):
+ *   0:  Address
+ *   4:  Offset of the name in the string table
+ *
+ * File table (4 bytes per file): Offset of the name in the string table
+ *
+ * String table: NUL terminated names.
+ *
+ * A lookup binary searches the block index and decodes a single block. */
+class LineTable
+{
+public:
+    struct Entry {
+        uint32_t address;
+        uint32_t length;
+        uint32_t file;
+        uint32_t line;
+    };
+
+    static const char Magic[4];
+    static const uint32_t Version;
+    static const uint32_t BlockEntries;
+
+    LineTable();
+    ~LineTable();
+
+    LineTable(const LineTable &) = delete;
+    LineTable & operator=(const LineTable &) = delete;
+
+    // Building a table. Entries and symbols may be added in any order.
+    uint32_t addFile(const std::string &name);
+    void addEntry(const Entry &entry);
+    void addSymbol(const std::string &name, uint32_t address);
+    std::size_t build();
+    bool save(const std::string &path);
+
+    bool load(const std::string &path);
+
+    // Find the entry that covers an address
+    bool find(uint32_t address, Entry *out) const;
+    // Find the closest symbol at or before an address. Returns null if there
+    // is none.
+    const char * findSymbol(uint32_t address, uint32_t *offset) const;
+    const char * fileName(uint32_t file) const;
+
+    uint32_t entryCount() const;
+
+    const std::string & error() const;
+
+private:
+    struct Symbol {
+        uint32_t address;
+        std::string name;
+    };
+
+    void unmap();
+    const char * string(uint32_t offset) const;
+
+    std::vector<Entry> m_entries;
+    std::vector<Symbol> m_symbols;
+    std::vector<std::string> m_files;
+    // Encoded table, empty until it is built
+    std::vector<unsigned char> m_file;
+
+    void *m_map;
+    std::size_t m_mapSize;
+    uint32_t m_entryCount;
+    uint32_t m_blockCount;
+    uint32_t m_symbolCount;
+    uint32_t m_fileCount;
+    uint32_t m_stringsSize;
+    const unsigned char *m_blocks;
+    const unsigned char *m_data;
+    const unsigned char *m_dataEnd;
+    const unsigned char *m_symbolTable;
+    const unsigned char *m_fileTable;
+    const char *m_strings;
+    std::string m_error;
+};
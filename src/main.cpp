@@ -1,14 +1,645 @@
 #include "assembler.h"
+#include "binaryobject.h"
+#include "disassembler.h"
+#include "languageserver.h"
+#include "linetable.h"
+#include "scanner.h"
+#include "simulator.h"
+#include "watcher.h"
 
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 
+static void usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [OPTION]... [INPUT]\n"
+              << "       " << prog << " --watch [OPTION]... [INPUT]...\n"
+              << "       " << prog << " bin2obj [INPUT.sxo] [OUTPUT.obj]\n"
+              << "       " << prog << " run [OPTION]... [PROGRAM]\n"
+              << "       " << prog << " disasm [PROGRAM] [OUTPUT.asm]\n"
+              << "       " << prog << " addr2line [TABLE.sxl] [ADDRESS]...\n"
+              << "       " << prog << " bench [SIZE_MB]\n"
+              << "       " << prog << " lsp\n"
+              << "\n"
+              << "Assemble INPUT, or standard input if INPUT is -.\n"
+              << "\n"
+              << "Options:\n"
+              << "  -o, --output FILE  Write object records to FILE (- for standard output)\n"
+              << "  --listing-fd N     Write the listing to file descriptor N\n"
+              << "  -D NAME[=VALUE]    Define NAME for IF directives (VALUE defaults to 1)\n"
+              << "  --binary           Also write a binary object file (.sxo)\n"
+              << "  --image            Also write a flat memory image (.img)\n"
+              << "  --line-table       Also write an address to source line table (.sxl)\n"
+              << "  --no-listing       Do not write the listing file (.lst)\n"
+              << "  --stats FILE       Write encoding statistics to FILE as a table\n"
+              << "  --stats-json FILE  Write encoding statistics to FILE as JSON\n"
+              << "  --depfile FILE     Write a Make rule listing the included files to FILE\n"
+              << "  --pipeline         Read and lex the input on a separate thread\n"
+              << "  --remove-unused    Remove unreferenced data and unreachable code\n"
+              << "  --watch            Reassemble the inputs whenever they change\n"
+              << "  --max-input BYTES  Fail if the source files are larger than BYTES\n"
+              << "  --max-lines N      Fail if the program has more than N lines\n"
+              << "  --max-output BYTES Fail if the output files are larger than BYTES\n"
+              << "  --time-limit MS    Fail if assembling takes longer than MS milliseconds\n"
+              << "  -h, --help         Display this help message\n";
+}
+
+/* Parse the value of a limit option, where 0 means no limit */
+static bool parseLimit(const char *arg, const char *name, unsigned long max,
+                       unsigned long *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = std::strtoul(arg, &end, 10);
+    if (*end != '\0' || errno != 0 || value > max
+            || !std::isdigit(static_cast<unsigned char>(arg[0]))) {
+        std::cerr << "error: Invalid " << name << ": " << arg << std::endl;
+        return false;
+    }
+
+    *out = value;
+    return true;
+}
+
+/* Parse a -D definition of the form NAME or NAME=VALUE */
+static bool parseDefinition(const char *arg, Assembler::Options *options)
+{
+    std::string name(arg);
+    int value = 1;
+
+    std::size_t equals = name.find('=');
+    if (equals != std::string::npos) {
+        const char *number = arg + equals + 1;
+        char *end;
+        errno = 0;
+        long parsed = std::strtol(number, &end, 10);
+        if (*end != '\0' || end == number || errno != 0
+                || parsed < INT_MIN || parsed > INT_MAX) {
+            std::cerr << "error: Invalid value for " << name.substr(0, equals)
+                      << ": " << number << std::endl;
+            return false;
+        }
+        value = parsed;
+        name.erase(equals);
+    }
+
+    bool valid = !name.empty()
+            && !std::isdigit(static_cast<unsigned char>(name[0]));
+    for (char c : name) {
+        valid = valid && (std::isalnum(static_cast<unsigned char>(c)) || c == '_');
+    }
+    if (!valid) {
+        std::cerr << "error: Invalid name to define: " << arg << std::endl;
+        return false;
+    }
+
+    options->definitions[name] = value;
+    return true;
+}
+
+/* Convert a binary object file back to H/T/E text records */
+static int bin2obj(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " [INPUT.sxo] [OUTPUT.obj]"
+                  << std::endl;
+        return 1;
+    }
+
+    BinaryObject binObj;
+    if (!binObj.load(argv[1])) {
+        std::cerr << "error: " << binObj.error() << std::endl;
+        return -1;
+    }
+
+    std::FILE *out = stdout;
+    if (argc == 3) {
+        out = std::fopen(argv[2], "wb");
+        if (out == nullptr) {
+            std::cerr << "error: " << argv[2] << ": " << std::strerror(errno)
+                      << std::endl;
+            return -1;
+        }
+    }
+
+    bool ret = binObj.writeText(out);
+    if (out != stdout && std::fclose(out) != 0) {
+        ret = false;
+    }
+
+    return ret ? 0 : -1;
+}
+
+/* Print the source line and symbol of each address (hex) in a line table */
+static int addr2line(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " [TABLE.sxl] [ADDRESS]..."
+                  << std::endl;
+        return 1;
+    }
+
+    LineTable table;
+    if (!table.load(argv[1])) {
+        std::cerr << "error: " << table.error() << std::endl;
+        return -1;
+    }
+
+    for (int i = 2; i < argc; ++i) {
+        char *end;
+        unsigned long address = std::strtoul(argv[i], &end, 16);
+        if (*end != '\0' || end == argv[i] || address > UINT32_MAX) {
+            std::cerr << "error: Invalid address: " << argv[i] << std::endl;
+            return 1;
+        }
+
+        std::printf("%06lX ", address);
+
+        uint32_t offset;
+        const char *symbol = table.findSymbol(address, &offset);
+        if (symbol && offset > 0) {
+            std::printf("%s+%X ", symbol, offset);
+        } else if (symbol) {
+            std::printf("%s ", symbol);
+        }
+
+        LineTable::Entry entry;
+        const char *file;
+        if (table.find(address, &entry)
+                && (file = table.fileName(entry.file)) != nullptr) {
+            std::printf("%s:%u\n", file, entry.line);
+        } else {
+            std::printf("??\n");
+        }
+    }
+
+    return 0;
+}
+
+/* Convert an object file back to assembly source */
+static int disasm(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " [PROGRAM] [OUTPUT.asm]"
+                  << std::endl;
+        return 1;
+    }
+
+    std::FILE *out = stdout;
+    if (argc == 3) {
+        out = std::fopen(argv[2], "wb");
+        if (out == nullptr) {
+            std::cerr << "error: " << argv[2] << ": " << std::strerror(errno)
+                      << std::endl;
+            return -1;
+        }
+    }
+
+    Disassembler disasm;
+    bool ret = disasm.disassembleFile(argv[1], out);
+    if (!ret) {
+        std::cerr << "error: " << disasm.error() << std::endl;
+    }
+
+    if (out != stdout && std::fclose(out) != 0) {
+        ret = false;
+    }
+
+    return ret ? 0 : -1;
+}
+
+static void runUsage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [OPTION]... [PROGRAM]\n"
+              << "\n"
+              << "Load an object file (.obj or .sxo) and execute it.\n"
+              << "\n"
+              << "Options:\n"
+              << "  -n, --max-instructions N  Stop after N instructions\n"
+              << "  -d, --device ID=PATH      Map device ID (hex) to a file\n"
+              << "  -l, --load-address ADDR   Load the program at ADDR (hex)\n"
+              << "  -r, --registers           Print registers when stopped\n"
+              << "  -h, --help                Display this help message\n";
+}
+
+/* Execute an assembled program in the simulator */
+static int run(int argc, char *argv[])
+{
+    static const struct option longOptions[] = {
+        { "max-instructions", required_argument, 0, 'n' },
+        { "device",           required_argument, 0, 'd' },
+        { "load-address",     required_argument, 0, 'l' },
+        { "registers",        no_argument,       0, 'r' },
+        { "help",             no_argument,       0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    Simulator sim;
+    bool registers = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:d:l:rh", longOptions, nullptr)) != -1) {
+        switch (opt) {
+        case 'n': {
+            char *end;
+            errno = 0;
+            unsigned long long limit = std::strtoull(optarg, &end, 10);
+            // strtoull skips spaces and accepts a sign, which would wrap
+            // negative limits around
+            if (*end != '\0' || errno != 0
+                    || !std::isdigit(static_cast<unsigned char>(optarg[0]))) {
+                std::cerr << "error: Invalid instruction limit: " << optarg
+                          << std::endl;
+                return 1;
+            }
+            sim.setInstructionLimit(limit);
+            break;
+        }
+        case 'd': {
+            char *end;
+            unsigned long id = std::strtoul(optarg, &end, 16);
+            if (*end != '=' || !sim.setDevice(id, end + 1)) {
+                std::cerr << "error: Invalid device mapping: " << optarg
+                          << std::endl;
+                return 1;
+            }
+            break;
+        }
+        case 'l': {
+            char *end;
+            unsigned long address = std::strtoul(optarg, &end, 16);
+            if (*optarg == '\0' || *end != '\0'
+                    || address >= Simulator::MemorySize) {
+                std::cerr << "error: Invalid load address: " << optarg
+                          << std::endl;
+                return 1;
+            }
+            sim.setLoadAddress(address);
+            break;
+        }
+        case 'r':
+            registers = true;
+            break;
+        case 'h':
+            runUsage(argv[0]);
+            return 0;
+        default:
+            runUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        runUsage(argv[0]);
+        return 1;
+    }
+
+    if (!sim.loadObject(argv[optind])) {
+        std::cerr << "error: " << sim.error() << std::endl;
+        return -1;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    Simulator::Status status = sim.run();
+    std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - begin;
+
+    switch (status) {
+    case Simulator::Status::Halted:
+        std::fprintf(stderr, "Halted");
+        break;
+    case Simulator::Status::InstructionLimit:
+        std::fprintf(stderr, "Instruction limit reached");
+        break;
+    case Simulator::Status::Error:
+        std::fprintf(stderr, "error: %s\n", sim.error().c_str());
+        std::fprintf(stderr, "Stopped");
+        break;
+    }
+
+    std::fprintf(stderr, " after %" PRIu64 " instructions (%.3f s)\n",
+                 sim.instructionCount(), elapsed.count());
+
+    if (registers) {
+        sim.dumpRegisters(stderr);
+    }
+
+    return status == Simulator::Status::Halted ? 0 : -1;
+}
+
+/* Measure how fast source is classified and split into tokens, on a program
+ * generated in memory */
+static int bench(int argc, char *argv[])
+{
+    if (argc > 2) {
+        std::cerr << "Usage: " << argv[0] << " [SIZE_MB]" << std::endl;
+        return 1;
+    }
+
+    unsigned long sizeMb = 256;
+    if (argc == 2) {
+        char *end;
+        sizeMb = std::strtoul(argv[1], &end, 10);
+        if (*end != '\0' || sizeMb == 0) {
+            std::cerr << "error: Invalid size: " << argv[1] << std::endl;
+            return 1;
+        }
+    }
+
+    static const char *templates[] = {
+        "LOOP%lu   +LDA    TABLE,X     . load the next entry\n",
+        "          COMP    #0\n",
+        "          JEQ     DONE%lu\n",
+        "          STCH    BUFFER,X\n",
+        ". %lu comment lines are skipped as a whole\n",
+        "          TIXR    T\n",
+        "VAL%lu    WORD    4096\n",
+        "STR%lu    BYTE    C'EOF'\n",
+    };
+    static const std::size_t templateCount =
+            sizeof(templates) / sizeof(templates[0]);
+
+    std::string text;
+    text.reserve(sizeMb << 20);
+    char line[128];
+    for (unsigned long i = 0; text.size() < (sizeMb << 20); ++i) {
+        std::snprintf(line, sizeof(line), templates[i % templateCount],
+                      i / templateCount);
+        text += line;
+    }
+
+    std::printf("%lu MiB of generated source\n\n", sizeMb);
+    std::printf("Pass   Implementation      GB/s\n");
+
+    typedef std::chrono::duration<double> Seconds;
+
+    // Work on a few MiB at a time, about the size of a large source file
+    static const std::size_t chunkSize = 4 << 20;
+
+    // Copying the text is the most that any pass over it can do
+    {
+        std::vector<char> copy(chunkSize);
+        auto begin = std::chrono::steady_clock::now();
+        for (std::size_t pos = 0; pos < text.size(); pos += chunkSize) {
+            std::size_t length = std::min(chunkSize, text.size() - pos);
+            std::memcpy(copy.data(), text.data() + pos, length);
+        }
+        Seconds elapsed = std::chrono::steady_clock::now() - begin;
+
+        std::printf("copy   %-14s %9.2f\n", "memcpy",
+                    text.size() / elapsed.count() / 1e9);
+    }
+
+    // Classification alone, the part done with vector compares
+    for (int i = 0; i < Scanner::ImplementationCount; ++i) {
+        auto impl = static_cast<Scanner::Implementation>(i);
+        if (!Scanner::isSupported(impl)) {
+            continue;
+        }
+
+        Scanner scanner(impl);
+        std::vector<Scanner::Masks> masks(chunkSize / Scanner::BlockSize);
+        uint64_t count = 0;
+
+        auto begin = std::chrono::steady_clock::now();
+        for (std::size_t pos = 0; pos < text.size(); pos += chunkSize) {
+            std::size_t length = std::min(chunkSize, text.size() - pos);
+            scanner.scan(text.data() + pos, length, masks.data());
+            count += __builtin_popcountll(masks[0].newlines);
+        }
+        Seconds elapsed = std::chrono::steady_clock::now() - begin;
+
+        std::printf("scan   %-14s %9.2f\n", Scanner::name(impl),
+                    text.size() / elapsed.count() / 1e9);
+        if (count == 0) {
+            return -1;
+        }
+    }
+
+    // Splitting into lines and tokens as the assembler does. The strings
+    // are reused from chunk to chunk, like for a batch of files.
+    for (int i = 0; i < Scanner::ImplementationCount; ++i) {
+        auto impl = static_cast<Scanner::Implementation>(i);
+        if (!Scanner::isSupported(impl)) {
+            continue;
+        }
+
+        Scanner scanner(impl);
+        std::string chunk;
+        std::vector<std::string> lines;
+        std::vector<std::vector<std::string>> tokens;
+        std::size_t lineCount = 0;
+
+        auto begin = std::chrono::steady_clock::now();
+        for (std::size_t pos = 0; pos < text.size(); ) {
+            std::size_t end = text.find('\n', std::min(pos + chunkSize,
+                                                       text.size() - 1));
+            end = end == std::string::npos ? text.size() : end + 1;
+            chunk.assign(text, pos, end - pos);
+            scanner.split(chunk, &lines, &tokens);
+            lineCount += lines.size();
+            pos = end;
+        }
+        Seconds elapsed = std::chrono::steady_clock::now() - begin;
+
+        std::printf("split  %-14s %9.2f  (%.1f M lines/s)\n",
+                    Scanner::name(impl), text.size() / elapsed.count() / 1e9,
+                    lineCount / elapsed.count() / 1e6);
+    }
+
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " [INPUT]" << std::endl;
+    if (argc >= 2 && std::strcmp(argv[1], "bin2obj") == 0) {
+        return bin2obj(argc - 1, argv + 1);
+    } else if (argc >= 2 && std::strcmp(argv[1], "run") == 0) {
+        return run(argc - 1, argv + 1);
+    } else if (argc >= 2 && std::strcmp(argv[1], "addr2line") == 0) {
+        return addr2line(argc - 1, argv + 1);
+    } else if (argc >= 2 && std::strcmp(argv[1], "disasm") == 0) {
+        return disasm(argc - 1, argv + 1);
+    } else if (argc >= 2 && std::strcmp(argv[1], "bench") == 0) {
+        return bench(argc - 1, argv + 1);
+    } else if (argc >= 2 && std::strcmp(argv[1], "lsp") == 0) {
+        // The client speaks to the server over standard input and output
+        LanguageServer server;
+        return server.run() ? 0 : 1;
+    }
+
+    enum {
+        OPT_BINARY = 1000,
+        OPT_NO_LISTING,
+        OPT_LISTING_FD,
+        OPT_WATCH,
+        OPT_STATS,
+        OPT_STATS_JSON,
+        OPT_DEPFILE,
+        OPT_IMAGE,
+        OPT_PIPELINE,
+        OPT_MAX_INPUT,
+        OPT_MAX_LINES,
+        OPT_MAX_OUTPUT,
+        OPT_TIME_LIMIT,
+        OPT_REMOVE_UNUSED,
+        OPT_LINE_TABLE
+    };
+
+    static const struct option longOptions[] = {
+        { "output",     required_argument, 0, 'o' },
+        { "listing-fd", required_argument, 0, OPT_LISTING_FD },
+        { "binary",     no_argument,       0, OPT_BINARY },
+        { "image",      no_argument,       0, OPT_IMAGE },
+        { "line-table", no_argument,       0, OPT_LINE_TABLE },
+        { "no-listing", no_argument,       0, OPT_NO_LISTING },
+        { "pipeline",   no_argument,       0, OPT_PIPELINE },
+        { "remove-unused", no_argument,    0, OPT_REMOVE_UNUSED },
+        { "watch",      no_argument,       0, OPT_WATCH },
+        { "stats",      required_argument, 0, OPT_STATS },
+        { "stats-json", required_argument, 0, OPT_STATS_JSON },
+        { "depfile",    required_argument, 0, OPT_DEPFILE },
+        { "max-input",  required_argument, 0, OPT_MAX_INPUT },
+        { "max-lines",  required_argument, 0, OPT_MAX_LINES },
+        { "max-output", required_argument, 0, OPT_MAX_OUTPUT },
+        { "time-limit", required_argument, 0, OPT_TIME_LIMIT },
+        { "help",       no_argument,       0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    Assembler::Options options;
+    bool watch = false;
+
+    unsigned long limit;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:D:h", longOptions, nullptr)) != -1) {
+        switch (opt) {
+        case 'o':
+            options.objectFile = optarg;
+            break;
+        case 'D':
+            if (!parseDefinition(optarg, &options)) {
+                return 1;
+            }
+            break;
+        case OPT_LISTING_FD: {
+            char *end;
+            long fd = std::strtol(optarg, &end, 10);
+            if (*end != '\0' || end == optarg || fd < 0 || fd > INT_MAX) {
+                std::cerr << "error: Invalid file descriptor: " << optarg
+                          << std::endl;
+                return 1;
+            }
+            options.listingFd = fd;
+            break;
+        }
+        case OPT_BINARY:
+            options.binaryObject = true;
+            break;
+        case OPT_IMAGE:
+            options.image = true;
+            break;
+        case OPT_LINE_TABLE:
+            options.lineTable = true;
+            break;
+        case OPT_NO_LISTING:
+            options.listing = false;
+            break;
+        case OPT_PIPELINE:
+            options.pipeline = true;
+            break;
+        case OPT_REMOVE_UNUSED:
+            options.removeUnused = true;
+            break;
+        case OPT_WATCH:
+            watch = true;
+            break;
+        case OPT_STATS:
+            options.statsFile = optarg;
+            break;
+        case OPT_STATS_JSON:
+            options.statsJsonFile = optarg;
+            break;
+        case OPT_DEPFILE:
+            options.depFile = optarg;
+            break;
+        case OPT_MAX_INPUT:
+            if (!parseLimit(optarg, "input size", SIZE_MAX, &limit)) {
+                return 1;
+            }
+            options.maxInputSize = limit;
+            break;
+        case OPT_MAX_LINES:
+            if (!parseLimit(optarg, "line count", SIZE_MAX, &limit)) {
+                return 1;
+            }
+            options.maxLines = limit;
+            break;
+        case OPT_MAX_OUTPUT:
+            if (!parseLimit(optarg, "output size", SIZE_MAX, &limit)) {
+                return 1;
+            }
+            options.maxOutputSize = limit;
+            break;
+        case OPT_TIME_LIMIT:
+            if (!parseLimit(optarg, "time limit", UINT_MAX, &limit)) {
+                return 1;
+            }
+            options.timeLimitMs = limit;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (watch) {
+        // Each input has its own outputs named after it
+        if (optind == argc || !options.objectFile.empty()
+                || options.listingFd >= 0 || !options.depFile.empty()) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        Watcher watcher;
+        watcher.setOptions(options);
+        for (int i = optind; i < argc; ++i) {
+            if (std::strcmp(argv[i], "-") == 0) {
+                std::cerr << "error: Cannot watch standard input" << std::endl;
+                return 1;
+            }
+
+            if (!watcher.addFile(argv[i])) {
+                std::cerr << "error: " << watcher.error() << std::endl;
+                return -1;
+            }
+        }
+
+        watcher.run();
+        std::cerr << "error: " << watcher.error() << std::endl;
+        return -1;
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
         return 1;
     }
 
     Assembler as;
-    bool ret = as.assembleFile(argv[1]);
+    as.setOptions(options);
+    bool ret = as.assembleFile(argv[optind]);
     return ret ? 0 : -1;
 }
@@ -0,0 +1,93 @@
+#include "memoryimage.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+const uint32_t MemoryImage::PageSize;
+
+void MemoryImage::write(uint32_t address, const unsigned char *data,
+                        std::size_t size)
+{
+    while (size > 0) {
+        uint32_t offset = address % PageSize;
+        std::size_t count = std::min<std::size_t>(size, PageSize - offset);
+
+        auto &page = m_pages[address / PageSize];
+        if (!page) {
+            page.reset(new unsigned char[PageSize]());
+        }
+        std::memcpy(page.get() + offset, data, count);
+
+        address += count;
+        data += count;
+        size -= count;
+    }
+}
+
+bool MemoryImage::save(const std::string &path, uint32_t start, uint32_t end)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    if (fd < 0) {
+        m_error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    bool ok = true;
+
+    // Only allocated pages are written. Skipping over the others and setting
+    // the file size at the end leaves holes where they would be.
+    for (auto it = m_pages.lower_bound(start / PageSize);
+            ok && it != m_pages.end(); ++it) {
+        uint32_t pageStart = it->first * PageSize;
+        uint32_t first = std::max(start, pageStart);
+        uint32_t last = std::min(end, pageStart + PageSize);
+        if (first >= last) {
+            break;
+        }
+
+        const unsigned char *data = it->second.get() + (first - pageStart);
+        std::size_t size = last - first;
+        off_t offset = first - start;
+
+        while (size > 0) {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ok = false;
+                break;
+            }
+            data += written;
+            size -= written;
+            offset += written;
+        }
+    }
+
+    if (ok && end > start) {
+        ok = ftruncate(fd, end - start) == 0;
+    }
+
+    if (!ok) {
+        m_error = path + ": " + std::strerror(errno);
+    }
+
+    if (close(fd) != 0 && ok) {
+        m_error = path + ": " + std::strerror(errno);
+        ok = false;
+    }
+
+    return ok;
+}
+
+const std::string & MemoryImage::error() const
+{
+    return m_error;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+/* Contents of the SIC/XE address space, stored as a sparse map of pages.
+ * A page is only allocated when something is written to it, so space that is
+ * reserved with RESW or RESB but never initialized takes no memory. Unwritten
+ * memory reads as zero.
+ *
+ * The image is saved as a flat file of raw bytes, in which pages that were
+ * never written are left as holes. */
+class MemoryImage
+{
+public:
+    static const uint32_t PageSize = 4096;
+
+    void write(uint32_t address, const unsigned char *data, std::size_t size);
+
+    // Write the bytes from start up to end, so that file offset 0 is the
+    // start address
+    bool save(const std::string &path, uint32_t start, uint32_t end);
+
+    const std::string & error() const;
+
+private:
+    // Page number -> page
+    std::map<uint32_t, std::unique_ptr<unsigned char[]>> m_pages;
+    std::string m_error;
+};
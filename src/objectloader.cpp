@@ -0,0 +1,437 @@
+#include "objectloader.h"
+
+#include "parallel.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Number of text records decoded by one worker at a time
+static const std::size_t ChunkSize = 4096;
+
+// Largest address a text record may reach (SIC/XE has 20 bit addresses)
+static const uint32_t AddressLimit = 1 << 20;
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else {
+        return -1;
+    }
+}
+
+static bool parseHex(const char *str, std::size_t len, uint32_t *out)
+{
+    uint32_t value = 0;
+    for (std::size_t i = 0; i < len; ++i) {
+        int digit = hexValue(str[i]);
+        if (digit < 0) {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+
+    *out = value;
+    return true;
+}
+
+ObjectLoader::ObjectLoader() : m_map(nullptr), m_mapSize(0)
+{
+}
+
+ObjectLoader::~ObjectLoader()
+{
+    close();
+}
+
+void ObjectLoader::close()
+{
+    if (m_map) {
+        munmap(m_map, m_mapSize);
+        m_map = nullptr;
+        m_mapSize = 0;
+    }
+    m_programs.clear();
+}
+
+const std::vector<ObjectLoader::Program> & ObjectLoader::programs() const
+{
+    return m_programs;
+}
+
+const std::string & ObjectLoader::error() const
+{
+    return m_error;
+}
+
+bool ObjectLoader::fail(unsigned int line, const std::string &msg)
+{
+    m_error = m_path;
+    if (line > 0) {
+        m_error += ":" + std::to_string(line);
+    }
+    m_error += ": " + msg;
+    return false;
+}
+
+bool ObjectLoader::open(const std::string &path)
+{
+    close();
+    m_path = path;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return fail(0, std::strerror(errno));
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        ::close(fd);
+        return fail(0, std::strerror(errno));
+    }
+
+    if (sb.st_size == 0) {
+        ::close(fd);
+        return fail(0, "Missing header record");
+    }
+
+    void *map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return fail(0, std::strerror(errno));
+    }
+
+    m_map = map;
+    m_mapSize = sb.st_size;
+
+    const char *data = static_cast<const char *>(m_map);
+    const char *end = data + m_mapSize;
+    Program *program = nullptr;
+    unsigned int lineNumber = 0;
+
+    for (const char *p = data; p < end; ) {
+        const char *eol = static_cast<const char *>(
+                std::memchr(p, '\n', end - p));
+        if (eol == nullptr) {
+            eol = end;
+        }
+
+        const char *line = p;
+        std::size_t len = eol - p;
+        p = eol + 1;
+        ++lineNumber;
+
+        if (len > 0 && line[len - 1] == '\r') {
+            --len;
+        }
+
+        if (len == 0) {
+            continue;
+        }
+
+        if (line[0] != 'H' && program == nullptr) {
+            return fail(lineNumber, "Record before header record");
+        }
+
+        switch (line[0]) {
+        case 'H': {
+            // Col 2-7: Name, Col 8-13: Start, Col 14-19: Length
+            if (program != nullptr) {
+                return fail(lineNumber, "Missing end record before header");
+            }
+
+            Program prog;
+            if (len != 19 || !parseHex(line + 7, 6, &prog.start)
+                    || !parseHex(line + 13, 6, &prog.length)) {
+                return fail(lineNumber, "Invalid header record");
+            }
+
+            if (prog.start > AddressLimit
+                    || prog.length > AddressLimit - prog.start) {
+                return fail(lineNumber, "Program does not fit in memory");
+            }
+
+            prog.name.assign(line + 1, 6);
+            prog.name.erase(prog.name.find_last_not_of(' ') + 1);
+            prog.entry = prog.start;
+            prog.hasEntry = false;
+
+            m_programs.push_back(prog);
+            program = &m_programs.back();
+            break;
+        }
+
+        case 'T': {
+            // Col 2-7: Address, Col 8-9: Length, Col 10-69: Object code
+            uint32_t address;
+            uint32_t size;
+            if (len < 9 || !parseHex(line + 1, 6, &address)
+                    || !parseHex(line + 7, 2, &size)) {
+                return fail(lineNumber, "Invalid text record");
+            }
+
+            if (len != 9 + 2 * size) {
+                return fail(lineNumber, "Text record length does not match "
+                            "its object code");
+            }
+
+            if (address < program->start
+                    || address - program->start > program->length
+                    || size > program->length - (address - program->start)) {
+                return fail(lineNumber, "Text record is outside of program "
+                            + program->name);
+            }
+
+            program->text.push_back({ address, size, line + 9, lineNumber });
+            break;
+        }
+
+        case 'D':
+            if ((len - 1) % 12 != 0) {
+                return fail(lineNumber, "Invalid define record");
+            }
+            program->defs.push_back({ line, static_cast<uint32_t>(len), lineNumber });
+            break;
+
+        case 'R':
+            program->refs.push_back({ line, static_cast<uint32_t>(len), lineNumber });
+            break;
+
+        case 'M':
+            // The sign and symbol are left out to relocate the program
+            if (len < 9) {
+                return fail(lineNumber, "Invalid modification record");
+            }
+            program->mods.push_back({ line, static_cast<uint32_t>(len), lineNumber });
+            break;
+
+        case 'E':
+            if (len > 1) {
+                if (len != 7 || !parseHex(line + 1, 6, &program->entry)) {
+                    return fail(lineNumber, "Invalid end record");
+                }
+                program->hasEntry = true;
+            }
+            program = nullptr;
+            break;
+
+        default:
+            return fail(lineNumber, std::string("Unknown record type: ") + line[0]);
+        }
+    }
+
+    if (program != nullptr) {
+        return fail(0, "Missing end record for program " + program->name);
+    }
+
+    if (m_programs.empty()) {
+        return fail(0, "Missing header record");
+    }
+
+    // Text records of a program must not overlap
+    for (auto const &prog : m_programs) {
+        std::vector<const TextRecord *> sorted;
+        sorted.reserve(prog.text.size());
+        for (auto const &record : prog.text) {
+            sorted.push_back(&record);
+        }
+
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const TextRecord *a, const TextRecord *b) {
+            return a->address < b->address;
+        });
+
+        for (std::size_t i = 1; i < sorted.size(); ++i) {
+            if (sorted[i - 1]->address + sorted[i - 1]->size > sorted[i]->address) {
+                return fail(sorted[i]->line, "Text record overlaps the one on line "
+                            + std::to_string(sorted[i - 1]->line));
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Decode the text records of a single program object into a memory image.
+ * The program is loaded at loadAddress, and its M records that name the
+ * program itself are applied with the distance it moved, so that its
+ * addresses point to where it was loaded. Objects with several programs are
+ * rejected, as their sections all start at 0 and would overwrite each other
+ * without a linker placing them. */
+bool ObjectLoader::decode(unsigned char *memory, uint32_t memorySize,
+                          uint32_t loadAddress)
+{
+    if (m_programs.size() != 1) {
+        return fail(0, "Decoding multiple programs is not supported");
+    }
+
+    auto const &prog = m_programs[0];
+    int64_t offset = int64_t(loadAddress) - prog.start;
+
+    if (uint64_t(loadAddress) + prog.length > memorySize) {
+        return fail(0, "Program " + prog.name + " does not fit in memory");
+    }
+
+    std::vector<const TextRecord *> records;
+    records.reserve(prog.text.size());
+    for (auto const &record : prog.text) {
+        records.push_back(&record);
+    }
+
+    // Each chunk remembers the first record that failed to decode, so the
+    // reported error does not depend on thread timing
+    std::size_t chunks = (records.size() + ChunkSize - 1) / ChunkSize;
+    std::vector<const TextRecord *> failed(chunks, nullptr);
+
+    parallelFor(chunks, [&](std::size_t chunk) {
+        std::size_t first = chunk * ChunkSize;
+        std::size_t last = std::min(first + ChunkSize, records.size());
+
+        for (std::size_t i = first; i < last; ++i) {
+            const TextRecord *record = records[i];
+            if (!decodeHex(record->hex, record->size,
+                           memory + (record->address + offset))) {
+                failed[chunk] = record;
+                break;
+            }
+        }
+    });
+
+    for (auto const *record : failed) {
+        if (record) {
+            return fail(record->line, "Invalid hex digit in text record");
+        }
+    }
+
+    return relocate(prog, memory, offset);
+}
+
+/* Apply the M records of a program that was moved by offset bytes. Each
+ * record adds or subtracts the offset on the low 4 * halfBytes bits of the
+ * field at its address. Fields that span an odd number of half-bytes start
+ * in the middle of their first byte, ie. the address of a format 4
+ * instruction. */
+bool ObjectLoader::relocate(const Program &prog, unsigned char *memory,
+                            int64_t offset)
+{
+    for (auto const &record : prog.mods) {
+        // Col 2-7: Address, Col 8-9: Half-bytes, Col 10: Sign, Col 11-: Symbol
+        uint32_t address;
+        uint32_t halfBytes;
+        char sign = record.size > 9 ? record.data[9] : '+';
+        if (!parseHex(record.data + 1, 6, &address)
+                || !parseHex(record.data + 7, 2, &halfBytes)
+                || halfBytes == 0 || halfBytes > 8
+                || (sign != '+' && sign != '-')) {
+            return fail(record.line, "Invalid modification record");
+        }
+
+        // Without a symbol, the record relocates the program
+        std::string symbol;
+        if (record.size > 10) {
+            symbol.assign(record.data + 10, record.size - 10);
+            symbol.erase(symbol.find_last_not_of(' ') + 1);
+        }
+        if (!symbol.empty() && symbol != prog.name) {
+            return fail(record.line, "Linking is not supported, unresolved "
+                        "symbol " + symbol);
+        }
+
+        uint32_t size = (halfBytes + 1) / 2;
+        if (address < prog.start || address - prog.start > prog.length
+                || size > prog.length - (address - prog.start)) {
+            return fail(record.line, "Modification record is outside of "
+                        "program " + prog.name);
+        }
+
+        unsigned char *field = memory + (address + offset);
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < size; ++i) {
+            value = (value << 8) | field[i];
+        }
+
+        uint32_t mask = halfBytes == 8 ? 0xFFFFFFFF : (1u << (4 * halfBytes)) - 1;
+        uint32_t delta = static_cast<uint32_t>(offset);
+        uint32_t patched = sign == '+' ? value + delta : value - delta;
+        value = (value & ~mask) | (patched & mask);
+
+        for (uint32_t i = size; i > 0; --i) {
+            field[i - 1] = value & 0xFF;
+            value >>= 8;
+        }
+    }
+
+    return true;
+}
+
+/* Convert 2 * size hex digits to size bytes. Returns false if there is an
+ * invalid digit. */
+bool ObjectLoader::decodeHex(const char *hex, std::size_t size, unsigned char *out)
+{
+    std::size_t i = 0;
+
+#ifdef __SSE2__
+    // 16 digits at a time. Setting bit 5 maps 'A'-'F' to 'a'-'f' and leaves
+    // '0'-'9' unchanged, so only two ranges need to be checked.
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i digitLo = _mm_set1_epi8('0' - 1);
+    const __m128i digitHi = _mm_set1_epi8('9' + 1);
+    const __m128i alphaLo = _mm_set1_epi8('a' - 1);
+    const __m128i alphaHi = _mm_set1_epi8('f' + 1);
+    const __m128i zeroChar = _mm_set1_epi8('0');
+    const __m128i alphaBase = _mm_set1_epi8('a' - 10);
+    const __m128i lowByte = _mm_set1_epi16(0x00FF);
+
+    for (; i + 8 <= size; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hex + 2 * i));
+        __m128i lower = _mm_or_si128(v, caseBit);
+
+        __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(v, digitLo),
+                                        _mm_cmplt_epi8(v, digitHi));
+        __m128i isAlpha = _mm_and_si128(_mm_cmpgt_epi8(lower, alphaLo),
+                                        _mm_cmplt_epi8(lower, alphaHi));
+
+        if (_mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)) != 0xFFFF) {
+            return false;
+        }
+
+        __m128i value = _mm_or_si128(
+                _mm_and_si128(isDigit, _mm_sub_epi8(v, zeroChar)),
+                _mm_andnot_si128(isDigit, _mm_sub_epi8(lower, alphaBase)));
+
+        // The first digit of each pair is the high nibble
+        __m128i hi = _mm_slli_epi16(_mm_and_si128(value, lowByte), 4);
+        __m128i lo = _mm_srli_epi16(value, 8);
+        __m128i bytes = _mm_packus_epi16(_mm_or_si128(hi, lo), _mm_setzero_si128());
+
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), bytes);
+    }
+#endif
+
+    for (; i < size; ++i) {
+        int hi = hexValue(hex[2 * i]);
+        int lo = hexValue(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = (hi << 4) | lo;
+    }
+
+    return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Reader for the H/D/R/T/M/E object records written by the assembler.
+ *
+ * open() mmaps the file and validates every record: header fields, record
+ * lengths, text records that fall outside of their program and text records
+ * that overlap. Records are not copied. They point into the mapping, which
+ * stays valid until the loader is destroyed or another file is opened.
+ *
+ * decode() converts the hex digits of the text records of a single program
+ * into a memory image, and fails for objects with several programs. Large
+ * objects are split into chunks of records that are decoded in parallel. The
+ * program can be loaded at another address than the one it was assembled
+ * for, in which case its M records relocate it. */
+class ObjectLoader
+{
+public:
+    struct TextRecord {
+        uint32_t address;
+        uint32_t size;
+        // Hex digits of the object code (2 * size characters)
+        const char *hex;
+        unsigned int line;
+    };
+
+    // D, R and M records are passed through as-is
+    struct Record {
+        const char *data;
+        uint32_t size;
+        unsigned int line;
+    };
+
+    struct Program {
+        std::string name;
+        uint32_t start;
+        uint32_t length;
+        uint32_t entry;
+        bool hasEntry;
+        std::vector<TextRecord> text;
+        std::vector<Record> defs;
+        std::vector<Record> refs;
+        std::vector<Record> mods;
+    };
+
+    ObjectLoader();
+    ~ObjectLoader();
+
+    ObjectLoader(const ObjectLoader &) = delete;
+    ObjectLoader & operator=(const ObjectLoader &) = delete;
+
+    bool open(const std::string &path);
+
+    bool decode(unsigned char *memory, uint32_t memorySize,
+                uint32_t loadAddress);
+
+    const std::vector<Program> & programs() const;
+
+    const std::string & error() const;
+
+    static bool decodeHex(const char *hex, std::size_t size, unsigned char *out);
+
+private:
+    void close();
+    bool relocate(const Program &prog, unsigned char *memory, int64_t offset);
+    bool fail(unsigned int line, const std::string &msg);
+
+    void *m_map;
+    std::size_t m_mapSize;
+    std::string m_path;
+    std::vector<Program> m_programs;
+    std::string m_error;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/* Call fn(i) for every i in [0, count) using a small pool of worker threads.
+ * Items are handed out in increasing order but may finish in any order, so
+ * callers should store results by index rather than appending to shared
+ * state. */
+template<typename Func>
+void parallelFor(std::size_t count, Func fn)
+{
+    std::size_t workers = std::thread::hardware_concurrency();
+    if (workers == 0) {
+        workers = 1;
+    }
+    if (workers > count) {
+        workers = count;
+    }
+
+    if (workers <= 1) {
+        for (std::size_t i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<std::size_t> next(0);
+
+    auto worker = [&]() {
+        for (;;) {
+            std::size_t i = next++;
+            if (i >= count) {
+                break;
+            }
+            fn(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < workers; ++i) {
+        threads.emplace_back(worker);
+    }
+
+    // The calling thread does its share of the work too
+    worker();
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
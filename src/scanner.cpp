@@ -0,0 +1,314 @@
+#include "scanner.h"
+
+#include <cstring>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+
+const std::size_t Scanner::BlockSize;
+
+// Number of blocks classified before the lexer walks their masks
+static const std::size_t BatchBlocks = 64;
+
+static void scanScalar(const char *data, std::size_t blocks,
+                       Scanner::Masks *out)
+{
+    for (std::size_t b = 0; b < blocks; ++b) {
+        uint64_t newlines = 0;
+        uint64_t spaces = 0;
+        uint64_t comments = 0;
+
+        for (std::size_t i = 0; i < Scanner::BlockSize; ++i) {
+            uint64_t bit = uint64_t(1) << i;
+            char c = data[i];
+            newlines |= c == '\n' ? bit : 0;
+            spaces |= (c == ' ' || c == '\t') ? bit : 0;
+            comments |= (c == '.' || c == ';') ? bit : 0;
+        }
+
+        out[b].newlines = newlines;
+        out[b].spaces = spaces;
+        out[b].comments = comments;
+        data += Scanner::BlockSize;
+    }
+}
+
+#ifdef __SSE2__
+static void scanSSE2(const char *data, std::size_t blocks,
+                     Scanner::Masks *out)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i semicolon = _mm_set1_epi8(';');
+
+    for (std::size_t b = 0; b < blocks; ++b) {
+        uint64_t newlines = 0;
+        uint64_t spaces = 0;
+        uint64_t comments = 0;
+
+        for (unsigned int i = 0; i < Scanner::BlockSize / 16; ++i) {
+            __m128i v = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + 16 * i));
+
+            uint64_t n = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+            uint64_t s = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)));
+            uint64_t c = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(v, dot), _mm_cmpeq_epi8(v, semicolon)));
+
+            newlines |= n << (16 * i);
+            spaces |= s << (16 * i);
+            comments |= c << (16 * i);
+        }
+
+        out[b].newlines = newlines;
+        out[b].spaces = spaces;
+        out[b].comments = comments;
+        data += Scanner::BlockSize;
+    }
+}
+#endif
+
+#ifdef SCANNER_X86
+__attribute__((target("avx2")))
+static void scanAVX2(const char *data, std::size_t blocks,
+                     Scanner::Masks *out)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i semicolon = _mm256_set1_epi8(';');
+
+    for (std::size_t b = 0; b < blocks; ++b) {
+        uint64_t newlines = 0;
+        uint64_t spaces = 0;
+        uint64_t comments = 0;
+
+        for (unsigned int i = 0; i < Scanner::BlockSize / 32; ++i) {
+            __m256i v = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + 32 * i));
+
+            // The mask is returned as an int, so it must not be sign extended
+            uint64_t n = static_cast<uint32_t>(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+            uint64_t s = static_cast<uint32_t>(_mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                    _mm256_cmpeq_epi8(v, tab))));
+            uint64_t c = static_cast<uint32_t>(_mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, dot),
+                                    _mm256_cmpeq_epi8(v, semicolon))));
+
+            newlines |= n << (32 * i);
+            spaces |= s << (32 * i);
+            comments |= c << (32 * i);
+        }
+
+        out[b].newlines = newlines;
+        out[b].spaces = spaces;
+        out[b].comments = comments;
+        data += Scanner::BlockSize;
+    }
+}
+#endif
+
+// Assign to a string of a previous text, or append a new one
+static void setString(std::vector<std::string> *strings, std::size_t index,
+                      const char *data, std::size_t length)
+{
+    if (index == strings->size()) {
+        strings->emplace_back(data, length);
+    } else {
+        (*strings)[index].assign(data, length);
+    }
+}
+
+static Scanner::Implementation fastestImplementation()
+{
+    if (Scanner::isSupported(Scanner::AVX2)) {
+        return Scanner::AVX2;
+    } else if (Scanner::isSupported(Scanner::SSE2)) {
+        return Scanner::SSE2;
+    }
+
+    return Scanner::Scalar;
+}
+
+Scanner::Scanner() : Scanner(fastestImplementation())
+{
+}
+
+Scanner::Scanner(Implementation impl) : m_impl(impl), m_scan(scanScalar)
+{
+    switch (impl) {
+#ifdef __SSE2__
+    case SSE2:
+        m_scan = scanSSE2;
+        break;
+#endif
+#ifdef SCANNER_X86
+    case AVX2:
+        m_scan = scanAVX2;
+        break;
+#endif
+    default:
+        m_impl = Scalar;
+        break;
+    }
+}
+
+bool Scanner::isSupported(Implementation impl)
+{
+    switch (impl) {
+    case Scalar:
+        return true;
+#ifdef __SSE2__
+    case SSE2:
+        return true;
+#endif
+#ifdef SCANNER_X86
+    case AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+const char * Scanner::name(Implementation impl)
+{
+    static const char *names[] = { "scalar", "sse2", "avx2" };
+    return impl < ImplementationCount ? names[impl] : "unknown";
+}
+
+Scanner::Implementation Scanner::implementation() const
+{
+    return m_impl;
+}
+
+void Scanner::scan(const char *data, std::size_t length, Masks *out) const
+{
+    std::size_t blocks = length / BlockSize;
+    m_scan(data, blocks, out);
+
+    std::size_t rest = length % BlockSize;
+    if (rest != 0) {
+        // The last block is padded with NULs, which are in no class
+        char block[BlockSize] = {};
+        std::memcpy(block, data + blocks * BlockSize, rest);
+        m_scan(block, 1, out + blocks);
+    }
+}
+
+void Scanner::split(const std::string &text, std::vector<std::string> *lines,
+                    std::vector<std::vector<std::string>> *tokens) const
+{
+    const char *data = text.data();
+    std::size_t size = text.size();
+
+    std::size_t lineCount = 0;
+    std::size_t lineStart = 0;
+    std::size_t tokenCount = 0;
+    std::size_t tokenStart = 0;
+    // The rest of the line is a comment
+    bool comment = false;
+    // The last byte of the previous block is part of a token
+    uint64_t carry = 0;
+
+    auto addToken = [&](std::size_t end) {
+        // The carriage return of a CRLF line ending is not part of a token
+        if (data[end - 1] == '\r' && (end == size || data[end] == '\n')) {
+            --end;
+        }
+        if (comment || end == tokenStart) {
+            return;
+        }
+
+        if (tokens->size() == lineCount) {
+            tokens->emplace_back();
+        }
+        setString(&(*tokens)[lineCount], tokenCount++, data + tokenStart,
+                  end - tokenStart);
+    };
+
+    auto addLine = [&](std::size_t end) {
+        if (end > lineStart && data[end - 1] == '\r') {
+            --end;
+        }
+
+        setString(lines, lineCount, data + lineStart, end - lineStart);
+        if (tokens->size() == lineCount) {
+            tokens->emplace_back();
+        }
+        (*tokens)[lineCount].resize(tokenCount);
+
+        ++lineCount;
+        tokenCount = 0;
+        comment = false;
+    };
+
+    Masks batch[BatchBlocks];
+
+    for (std::size_t pos = 0; pos < size; pos += BatchBlocks * BlockSize) {
+        std::size_t batchLength = std::min(BatchBlocks * BlockSize, size - pos);
+        scan(data + pos, batchLength, batch);
+
+        for (std::size_t b = 0; b * BlockSize < batchLength; ++b) {
+            const Masks &masks = batch[b];
+            std::size_t block = pos + b * BlockSize;
+            std::size_t length = std::min(BlockSize, size - block);
+
+            uint64_t valid = length == BlockSize
+                    ? ~uint64_t(0) : (uint64_t(1) << length) - 1;
+            uint64_t word = ~(masks.spaces | masks.newlines) & valid;
+            uint64_t previous = (word << 1) | carry;
+            uint64_t starts = word & ~previous;
+            // Past the end of a partial block, bytes count as separators
+            uint64_t ends = ~word & previous;
+            carry = word >> (BlockSize - 1);
+
+            // Visit token boundaries and line ends in order
+            uint64_t events = starts | ends | masks.newlines;
+            while (events != 0) {
+                unsigned int bit = __builtin_ctzll(events);
+                events &= events - 1;
+
+                uint64_t mask = uint64_t(1) << bit;
+                std::size_t at = block + bit;
+
+                if (ends & mask) {
+                    addToken(at);
+                }
+                if ((starts & mask) && !comment) {
+                    if (masks.comments & mask) {
+                        comment = true;
+                    } else {
+                        tokenStart = at;
+                    }
+                }
+                if (masks.newlines & mask) {
+                    addLine(at);
+                    lineStart = at + 1;
+                }
+            }
+        }
+    }
+
+    // A token or line running to the end of the text
+    if (carry) {
+        addToken(size);
+    }
+    if (lineStart < size) {
+        addLine(size);
+    }
+
+    lines->resize(lineCount);
+    tokens->resize(lineCount);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Splits assembly source into lines and whitespace separated tokens.
+ *
+ * The text is classified 64 bytes at a time into bitmasks of newlines,
+ * whitespace and comment characters, with SSE2 or AVX2 compares when the CPU
+ * has them, and the lexer then walks the set bits of the masks instead of
+ * looking at every byte. A token starting with '.' or ';' begins a comment,
+ * and the rest of its line is left out of the tokens. */
+class Scanner
+{
+public:
+    enum Implementation
+    {
+        Scalar,
+        SSE2,
+        AVX2,
+        ImplementationCount
+    };
+
+    static const std::size_t BlockSize = 64;
+
+    // Bit i is set if byte i of the block is of the class
+    struct Masks {
+        uint64_t newlines;
+        uint64_t spaces;
+        uint64_t comments;
+    };
+
+    // Use the fastest implementation the CPU supports
+    Scanner();
+    explicit Scanner(Implementation impl);
+
+    static bool isSupported(Implementation impl);
+    static const char * name(Implementation impl);
+
+    Implementation implementation() const;
+
+    // Classify a text into one Masks per started block. Bits past the end
+    // of the text are cleared.
+    void scan(const char *data, std::size_t length, Masks *out) const;
+
+    // Reuses the strings of the previous text. A carriage return before a
+    // newline is not part of the line.
+    void split(const std::string &text, std::vector<std::string> *lines,
+               std::vector<std::vector<std::string>> *tokens) const;
+
+private:
+    typedef void (*ScanFunc)(const char *data, std::size_t blocks, Masks *out);
+
+    Implementation m_impl;
+    ScanFunc m_scan;
+};
@@ -0,0 +1,876 @@
+#include "simulator.h"
+
+#include "binaryobject.h"
+#include "objectloader.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+
+
+const unsigned int Simulator::MemorySize = 1 << 20;
+// Initial L register. Returning here from the entry point ends the program.
+const unsigned int Simulator::ReturnAddr = (1 << 20) - 1;
+
+static const uint32_t AddrMask = (1 << 20) - 1;
+static const uint32_t WordMask = (1 << 24) - 1;
+
+enum {
+    RegA = 0,
+    RegX = 1,
+    RegL = 2,
+    RegB = 3,
+    RegS = 4,
+    RegT = 5,
+    RegF = 6,
+    RegPC = 8,
+    RegSW = 9
+};
+
+/* Sign extend a 24 bit word */
+static inline int32_t signExtend24(uint32_t value)
+{
+    return static_cast<int32_t>(value << 8) >> 8;
+}
+
+Simulator::Simulator()
+    : m_memory(MemorySize + 8, 0), m_cache(MemorySize), m_f(0), m_cc(0),
+      m_count(0), m_limit(0), m_relocate(false), m_loadAddress(0)
+{
+    for (auto &handler : m_handlers) {
+        handler = &opInvalid;
+    }
+
+    auto set = [&](Instructions::SicXE instr, Handler handler) {
+        m_handlers[m_instrs[instr]->opcode >> 2] = handler;
+    };
+
+    set(Instructions::SicXE::ADD,    &opADD);
+    set(Instructions::SicXE::ADDF,   &opADDF);
+    set(Instructions::SicXE::ADDR,   &opADDR);
+    set(Instructions::SicXE::AND,    &opAND);
+    set(Instructions::SicXE::CLEAR,  &opCLEAR);
+    set(Instructions::SicXE::COMP,   &opCOMP);
+    set(Instructions::SicXE::COMPF,  &opCOMPF);
+    set(Instructions::SicXE::COMPR,  &opCOMPR);
+    set(Instructions::SicXE::DIV,    &opDIV);
+    set(Instructions::SicXE::DIVF,   &opDIVF);
+    set(Instructions::SicXE::DIVR,   &opDIVR);
+    set(Instructions::SicXE::FIX,    &opFIX);
+    set(Instructions::SicXE::FLOAT,  &opFLOAT);
+    set(Instructions::SicXE::HIO,    &opNop);
+    set(Instructions::SicXE::J,      &opJ);
+    set(Instructions::SicXE::JEQ,    &opJEQ);
+    set(Instructions::SicXE::JGT,    &opJGT);
+    set(Instructions::SicXE::JLT,    &opJLT);
+    set(Instructions::SicXE::JSUB,   &opJSUB);
+    set(Instructions::SicXE::LDA,    &opLoad<RegA>);
+    set(Instructions::SicXE::LDB,    &opLoad<RegB>);
+    set(Instructions::SicXE::LDCH,   &opLDCH);
+    set(Instructions::SicXE::LDF,    &opLDF);
+    set(Instructions::SicXE::LDL,    &opLoad<RegL>);
+    set(Instructions::SicXE::LDS,    &opLoad<RegS>);
+    set(Instructions::SicXE::LDT,    &opLoad<RegT>);
+    set(Instructions::SicXE::LDX,    &opLoad<RegX>);
+    set(Instructions::SicXE::LPS,    &opNop);
+    set(Instructions::SicXE::MUL,    &opMUL);
+    set(Instructions::SicXE::MULF,   &opMULF);
+    set(Instructions::SicXE::MULR,   &opMULR);
+    set(Instructions::SicXE::NORM,   &opNop);
+    set(Instructions::SicXE::OR,     &opOR);
+    set(Instructions::SicXE::RD,     &opRD);
+    set(Instructions::SicXE::RMO,    &opRMO);
+    set(Instructions::SicXE::RSUB,   &opRSUB);
+    set(Instructions::SicXE::SHIFTL, &opSHIFTL);
+    set(Instructions::SicXE::SHIFTR, &opSHIFTR);
+    set(Instructions::SicXE::SIO,    &opNop);
+    set(Instructions::SicXE::SSK,    &opNop);
+    set(Instructions::SicXE::STA,    &opStore<RegA>);
+    set(Instructions::SicXE::STB,    &opStore<RegB>);
+    set(Instructions::SicXE::STCH,   &opSTCH);
+    set(Instructions::SicXE::STF,    &opSTF);
+    set(Instructions::SicXE::STI,    &opNop);
+    set(Instructions::SicXE::STL,    &opStore<RegL>);
+    set(Instructions::SicXE::STS,    &opStore<RegS>);
+    set(Instructions::SicXE::STSW,   &opSTSW);
+    set(Instructions::SicXE::STT,    &opStore<RegT>);
+    set(Instructions::SicXE::STX,    &opStore<RegX>);
+    set(Instructions::SicXE::SUB,    &opSUB);
+    set(Instructions::SicXE::SUBF,   &opSUBF);
+    set(Instructions::SicXE::SUBR,   &opSUBR);
+    set(Instructions::SicXE::SVC,    &opNop);
+    set(Instructions::SicXE::TD,     &opTD);
+    set(Instructions::SicXE::TIO,    &opNop);
+    set(Instructions::SicXE::TIX,    &opTIX);
+    set(Instructions::SicXE::TIXR,   &opTIXR);
+    set(Instructions::SicXE::WD,     &opWD);
+
+    for (auto &reg : m_regs) {
+        reg = 0;
+    }
+    m_regs[RegL] = ReturnAddr;
+
+    for (auto &device : m_devices) {
+        device.fp = nullptr;
+        device.owned = false;
+    }
+
+    // Devices 00, 01 and 02 are standard input, output and error unless they
+    // are mapped to files
+    m_devices[0].fp = stdin;
+    m_devices[1].fp = stdout;
+    m_devices[2].fp = stderr;
+}
+
+Simulator::~Simulator()
+{
+    for (auto &device : m_devices) {
+        if (device.owned) {
+            std::fclose(device.fp);
+        } else if (device.fp) {
+            std::fflush(device.fp);
+        }
+    }
+}
+
+const std::string & Simulator::error() const
+{
+    return m_error;
+}
+
+unsigned char * Simulator::memory()
+{
+    return m_memory.data();
+}
+
+uint64_t Simulator::instructionCount() const
+{
+    return m_count;
+}
+
+void Simulator::setInstructionLimit(uint64_t limit)
+{
+    m_limit = limit;
+}
+
+/* Load the next object at an address instead of where it was assembled */
+void Simulator::setLoadAddress(uint32_t address)
+{
+    m_relocate = true;
+    m_loadAddress = address;
+}
+
+/* Map a device number to a file. The file is opened when the program first
+ * reads from or writes to the device. */
+bool Simulator::setDevice(unsigned int id, const std::string &path)
+{
+    if (id > 0xFF) {
+        m_error = "Invalid device number: " + std::to_string(id);
+        return false;
+    }
+
+    Device &device = m_devices[id];
+    if (device.owned) {
+        std::fclose(device.fp);
+    }
+    device.fp = nullptr;
+    device.owned = false;
+    device.path = path;
+
+    return true;
+}
+
+Simulator::Device * Simulator::getDevice(unsigned int id, bool write)
+{
+    Device &device = m_devices[id];
+
+    if (device.fp == nullptr) {
+        // Unmapped devices use files named after the device, ie. F1.dev
+        std::string path = device.path;
+        if (path.empty()) {
+            char name[8];
+            std::snprintf(name, sizeof(name), "%02X.dev", id);
+            path = name;
+        }
+
+        device.fp = std::fopen(path.c_str(), write ? "wb" : "rb");
+        if (device.fp == nullptr) {
+            fail("Failed to open device " + path + ": " + std::strerror(errno));
+            return nullptr;
+        }
+        device.owned = true;
+    }
+
+    return &device;
+}
+
+/* Load H/T/E records or a binary object (.sxo) into memory. The file type is
+ * detected from its first bytes. */
+bool Simulator::loadObject(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        m_error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    char magic[4] = { 0 };
+    file.read(magic, sizeof(magic));
+    file.close();
+
+    if (std::memcmp(magic, BinaryObject::Magic, sizeof(magic)) == 0) {
+        BinaryObject binObj;
+        if (!binObj.load(path)) {
+            m_error = binObj.error();
+            return false;
+        }
+
+        // Binary objects do not keep M records
+        if (m_relocate && binObj.start != m_loadAddress) {
+            m_error = path + ": Binary objects cannot be relocated";
+            return false;
+        }
+
+        for (auto const &segment : binObj.segments) {
+            if (segment.address + segment.size > MemorySize) {
+                m_error = path + ": Segment does not fit in memory";
+                return false;
+            }
+            std::memcpy(&m_memory[segment.address], segment.data, segment.size);
+        }
+
+        m_regs[RegPC] = binObj.entry & AddrMask;
+        return true;
+    }
+
+    ObjectLoader loader;
+    if (!loader.open(path)) {
+        m_error = loader.error();
+        return false;
+    }
+
+    auto const &programs = loader.programs();
+    if (programs.size() != 1) {
+        m_error = path + ": Linking multiple control sections is not supported";
+        return false;
+    }
+
+    uint32_t start = m_relocate ? m_loadAddress : programs[0].start;
+    if (!loader.decode(m_memory.data(), MemorySize, start)) {
+        m_error = loader.error();
+        return false;
+    }
+
+    m_regs[RegPC] = (programs[0].entry - programs[0].start + start) & AddrMask;
+    return true;
+}
+
+Simulator::Status Simulator::run()
+{
+    uint64_t remaining = m_limit == 0 ? UINT64_MAX : m_limit - m_count;
+    uint64_t executed = 0;
+    Status status = Status::InstructionLimit;
+
+    Decoded *cache = m_cache.data();
+    uint32_t &pc = m_regs[RegPC];
+
+    while (executed < remaining) {
+        Decoded &d = cache[pc];
+        if (d.handler == nullptr) {
+            decode(pc, &d);
+        }
+
+        pc = (pc + d.length) & AddrMask;
+        ++executed;
+
+        if (!d.handler(this, d)) {
+            status = m_error.empty() ? Status::Halted : Status::Error;
+            break;
+        }
+    }
+
+    m_count += executed;
+
+    for (auto &device : m_devices) {
+        if (device.fp && device.fp != stdin) {
+            std::fflush(device.fp);
+        }
+    }
+
+    return status;
+}
+
+void Simulator::dumpRegisters(std::FILE *out) const
+{
+    std::fprintf(out, "A=%06X X=%06X L=%06X B=%06X S=%06X T=%06X\n",
+                 m_regs[RegA], m_regs[RegX], m_regs[RegL], m_regs[RegB],
+                 m_regs[RegS], m_regs[RegT]);
+    std::fprintf(out, "F=%g PC=%06X SW=%06X\n", m_f, m_regs[RegPC],
+                 getReg(RegSW));
+}
+
+/* Decode the instruction at an address into a cache entry */
+void Simulator::decode(uint32_t addr, Decoded *d)
+{
+    const unsigned char *p = &m_memory[addr];
+    auto *info = m_instrs.byOpcode(p[0]);
+
+    d->handler = m_handlers[p[0] >> 2];
+    d->operand = 0;
+    d->mode = ModeDirect;
+    d->r1 = 0;
+    d->r2 = 0;
+
+    if (info == nullptr) {
+        d->handler = &opInvalid;
+        d->length = 1;
+        return;
+    }
+
+    switch (info->length) {
+    case Instructions::Length::One:
+        d->length = 1;
+        break;
+
+    case Instructions::Length::Two:
+        d->length = 2;
+        d->r1 = p[1] >> 4;
+        d->r2 = p[1] & 0xF;
+        break;
+
+    case Instructions::Length::ThreeOrFour: {
+        bool n = p[0] & 0x2;
+        bool i = p[0] & 0x1;
+        bool x = p[1] & 0x80;
+        bool b = p[1] & 0x40;
+        bool pc = p[1] & 0x20;
+        bool e = p[1] & 0x10;
+
+        if (x) {
+            d->mode |= ModeIndexed;
+        }
+
+        if (!n && !i) {
+            // SIC compatible: 15 bit address, no relative addressing
+            d->length = 3;
+            d->operand = ((p[1] & 0x7F) << 8) | p[2];
+            break;
+        }
+
+        if (n && !i) {
+            d->mode |= ModeIndirect;
+        } else if (!n && i) {
+            d->mode |= ModeImmediate;
+        }
+
+        if (e) {
+            d->length = 4;
+            d->operand = ((p[1] & 0xF) << 16) | (p[2] << 8) | p[3];
+        } else {
+            d->length = 3;
+            d->operand = ((p[1] & 0xF) << 8) | p[2];
+
+            if (pc) {
+                // Displacement is a signed 12 bit integer
+                d->mode |= ModePC;
+                d->operand = (d->operand ^ 0x800) - 0x800;
+            } else if (b) {
+                d->mode |= ModeBase;
+            }
+        }
+        break;
+    }
+    }
+}
+
+/* Target address of a format 3/4 instruction. The program counter has already
+ * been advanced past the instruction. */
+inline uint32_t Simulator::targetAddr(const Decoded &d) const
+{
+    uint32_t addr = d.operand;
+
+    switch (d.mode & 3) {
+    case ModePC:
+        addr += m_regs[RegPC];
+        break;
+    case ModeBase:
+        addr += m_regs[RegB];
+        break;
+    }
+
+    if (d.mode & ModeIndexed) {
+        addr += m_regs[RegX];
+    }
+
+    return addr & AddrMask;
+}
+
+/* Address of the operand after resolving indirection */
+inline uint32_t Simulator::effectiveAddr(const Decoded &d) const
+{
+    uint32_t addr = targetAddr(d);
+
+    if (d.mode & ModeIndirect) {
+        addr = readWord(addr) & AddrMask;
+    }
+
+    return addr;
+}
+
+inline uint32_t Simulator::loadWord(const Decoded &d) const
+{
+    if (d.mode & ModeImmediate) {
+        return targetAddr(d);
+    }
+
+    return readWord(effectiveAddr(d));
+}
+
+inline uint32_t Simulator::loadByte(const Decoded &d) const
+{
+    if (d.mode & ModeImmediate) {
+        return targetAddr(d) & 0xFF;
+    }
+
+    return m_memory[effectiveAddr(d)];
+}
+
+inline double Simulator::loadFloat(const Decoded &d) const
+{
+    return floatFromBytes(&m_memory[effectiveAddr(d)]);
+}
+
+inline uint32_t Simulator::readWord(uint32_t addr) const
+{
+    // Memory has padding at the end, so this never reads out of bounds
+    const unsigned char *p = &m_memory[addr];
+    return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+inline void Simulator::writeWord(uint32_t addr, uint32_t value)
+{
+    unsigned char *p = &m_memory[addr];
+    p[0] = value >> 16;
+    p[1] = value >> 8;
+    p[2] = value;
+    invalidate(addr, 3);
+}
+
+inline void Simulator::writeByte(uint32_t addr, uint32_t value)
+{
+    m_memory[addr] = value;
+    invalidate(addr, 1);
+}
+
+/* Drop the decoded instructions overlapping a write. An instruction is at most
+ * 4 bytes long, so it can start up to 3 bytes before the written range. */
+inline void Simulator::invalidate(uint32_t addr, uint32_t size)
+{
+    uint32_t first = addr >= 3 ? addr - 3 : 0;
+    uint32_t last = std::min(addr + size, MemorySize);
+
+    for (uint32_t i = first; i < last; ++i) {
+        m_cache[i].handler = nullptr;
+    }
+}
+
+inline uint32_t Simulator::getReg(unsigned int reg) const
+{
+    if (reg == RegSW) {
+        // Condition code is stored in bits 6 and 7: 00 (<), 01 (=), 10 (>)
+        return (m_cc + 1) << 6;
+    } else if (reg == RegF) {
+        return static_cast<uint32_t>(static_cast<int32_t>(m_f)) & WordMask;
+    } else if (reg < 10) {
+        return m_regs[reg];
+    } else {
+        return 0;
+    }
+}
+
+inline void Simulator::setReg(unsigned int reg, uint32_t value)
+{
+    if (reg == RegSW) {
+        m_cc = ((value >> 6) & 3) - 1;
+    } else if (reg == RegF) {
+        m_f = signExtend24(value);
+    } else if (reg == RegPC) {
+        m_regs[RegPC] = value & AddrMask;
+    } else if (reg < 10) {
+        m_regs[reg] = value & WordMask;
+    }
+}
+
+inline bool Simulator::jump(const Decoded &d, uint32_t target)
+{
+    uint32_t instrAddr = (m_regs[RegPC] - d.length) & AddrMask;
+
+    if (target == instrAddr || target == ReturnAddr) {
+        // Jumping to itself is the usual way to halt
+        return false;
+    }
+
+    m_regs[RegPC] = target;
+    return true;
+}
+
+inline void Simulator::compare(int32_t a, int32_t b)
+{
+    m_cc = a < b ? -1 : (a > b ? 1 : 0);
+}
+
+bool Simulator::fail(const std::string &msg)
+{
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "%06X: ", m_regs[RegPC]);
+    m_error = buf + msg;
+    return false;
+}
+
+/* SIC/XE floats are 48 bits: sign, 11 bit exponent (excess 1024) and a 36 bit
+ * fraction with the binary point to the left of the most significant bit */
+double Simulator::floatFromBytes(const unsigned char *p)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < 6; ++i) {
+        bits = (bits << 8) | p[i];
+    }
+
+    uint64_t fraction = bits & ((static_cast<uint64_t>(1) << 36) - 1);
+    int exponent = (bits >> 36) & 0x7FF;
+    bool negative = bits >> 47;
+
+    double value = std::ldexp(static_cast<double>(fraction), exponent - 1024 - 36);
+    return negative ? -value : value;
+}
+
+void Simulator::floatToBytes(double value, unsigned char *p)
+{
+    uint64_t bits = 0;
+
+    if (value != 0 && std::isfinite(value)) {
+        int exponent;
+        double mantissa = std::frexp(std::fabs(value), &exponent);
+        uint64_t fraction = static_cast<uint64_t>(
+                std::ldexp(mantissa, 36) + 0.5);
+
+        if (fraction >> 36) {
+            fraction >>= 1;
+            ++exponent;
+        }
+
+        bits = (static_cast<uint64_t>(value < 0) << 47)
+                | (static_cast<uint64_t>((exponent + 1024) & 0x7FF) << 36)
+                | fraction;
+    }
+
+    for (int i = 5; i >= 0; --i) {
+        p[i] = bits & 0xFF;
+        bits >>= 8;
+    }
+}
+
+bool Simulator::opInvalid(Simulator *sim, const Decoded &d)
+{
+    uint32_t addr = (sim->m_regs[RegPC] - d.length) & AddrMask;
+    char buf[48];
+    std::snprintf(buf, sizeof(buf), "Invalid opcode %02X",
+                  sim->m_memory[addr]);
+    sim->m_regs[RegPC] = addr;
+    return sim->fail(buf);
+}
+
+bool Simulator::opNop(Simulator *, const Decoded &)
+{
+    return true;
+}
+
+bool Simulator::opADD(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[RegA] = (sim->m_regs[RegA] + sim->loadWord(d)) & WordMask;
+    return true;
+}
+
+bool Simulator::opADDF(Simulator *sim, const Decoded &d)
+{
+    sim->m_f += sim->loadFloat(d);
+    return true;
+}
+
+bool Simulator::opADDR(Simulator *sim, const Decoded &d)
+{
+    sim->setReg(d.r2, sim->getReg(d.r2) + sim->getReg(d.r1));
+    return true;
+}
+
+bool Simulator::opAND(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[RegA] &= sim->loadWord(d);
+    return true;
+}
+
+bool Simulator::opCLEAR(Simulator *sim, const Decoded &d)
+{
+    sim->setReg(d.r1, 0);
+    return true;
+}
+
+bool Simulator::opCOMP(Simulator *sim, const Decoded &d)
+{
+    sim->compare(signExtend24(sim->m_regs[RegA]),
+                 signExtend24(sim->loadWord(d)));
+    return true;
+}
+
+bool Simulator::opCOMPF(Simulator *sim, const Decoded &d)
+{
+    double value = sim->loadFloat(d);
+    sim->m_cc = sim->m_f < value ? -1 : (sim->m_f > value ? 1 : 0);
+    return true;
+}
+
+bool Simulator::opCOMPR(Simulator *sim, const Decoded &d)
+{
+    sim->compare(signExtend24(sim->getReg(d.r1)),
+                 signExtend24(sim->getReg(d.r2)));
+    return true;
+}
+
+bool Simulator::opDIV(Simulator *sim, const Decoded &d)
+{
+    int32_t divisor = signExtend24(sim->loadWord(d));
+    if (divisor == 0) {
+        return sim->fail("Division by zero");
+    }
+
+    sim->m_regs[RegA] = (signExtend24(sim->m_regs[RegA]) / divisor) & WordMask;
+    return true;
+}
+
+bool Simulator::opDIVF(Simulator *sim, const Decoded &d)
+{
+    double divisor = sim->loadFloat(d);
+    if (divisor == 0) {
+        return sim->fail("Division by zero");
+    }
+
+    sim->m_f /= divisor;
+    return true;
+}
+
+bool Simulator::opDIVR(Simulator *sim, const Decoded &d)
+{
+    int32_t divisor = signExtend24(sim->getReg(d.r1));
+    if (divisor == 0) {
+        return sim->fail("Division by zero");
+    }
+
+    sim->setReg(d.r2, signExtend24(sim->getReg(d.r2)) / divisor);
+    return true;
+}
+
+bool Simulator::opFIX(Simulator *sim, const Decoded &)
+{
+    sim->m_regs[RegA] = static_cast<uint32_t>(
+            static_cast<int32_t>(sim->m_f)) & WordMask;
+    return true;
+}
+
+bool Simulator::opFLOAT(Simulator *sim, const Decoded &)
+{
+    sim->m_f = signExtend24(sim->m_regs[RegA]);
+    return true;
+}
+
+bool Simulator::opJ(Simulator *sim, const Decoded &d)
+{
+    return sim->jump(d, sim->effectiveAddr(d));
+}
+
+bool Simulator::opJEQ(Simulator *sim, const Decoded &d)
+{
+    return sim->m_cc != 0 || sim->jump(d, sim->effectiveAddr(d));
+}
+
+bool Simulator::opJGT(Simulator *sim, const Decoded &d)
+{
+    return sim->m_cc <= 0 || sim->jump(d, sim->effectiveAddr(d));
+}
+
+bool Simulator::opJLT(Simulator *sim, const Decoded &d)
+{
+    return sim->m_cc >= 0 || sim->jump(d, sim->effectiveAddr(d));
+}
+
+bool Simulator::opJSUB(Simulator *sim, const Decoded &d)
+{
+    uint32_t target = sim->effectiveAddr(d);
+    sim->m_regs[RegL] = sim->m_regs[RegPC];
+    sim->m_regs[RegPC] = target;
+    return true;
+}
+
+template<unsigned int Reg>
+bool Simulator::opLoad(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[Reg] = sim->loadWord(d);
+    return true;
+}
+
+bool Simulator::opLDCH(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[RegA] = (sim->m_regs[RegA] & 0xFFFF00) | sim->loadByte(d);
+    return true;
+}
+
+bool Simulator::opLDF(Simulator *sim, const Decoded &d)
+{
+    sim->m_f = sim->loadFloat(d);
+    return true;
+}
+
+bool Simulator::opMUL(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[RegA] = (sim->m_regs[RegA] * sim->loadWord(d)) & WordMask;
+    return true;
+}
+
+bool Simulator::opMULF(Simulator *sim, const Decoded &d)
+{
+    sim->m_f *= sim->loadFloat(d);
+    return true;
+}
+
+bool Simulator::opMULR(Simulator *sim, const Decoded &d)
+{
+    sim->setReg(d.r2, sim->getReg(d.r2) * sim->getReg(d.r1));
+    return true;
+}
+
+bool Simulator::opOR(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[RegA] |= sim->loadWord(d);
+    return true;
+}
+
+bool Simulator::opRD(Simulator *sim, const Decoded &d)
+{
+    Device *device = sim->getDevice(sim->loadByte(d), false);
+    if (device == nullptr) {
+        return false;
+    }
+
+    // End of file reads as 0
+    int c = std::fgetc(device->fp);
+    sim->m_regs[RegA] = (sim->m_regs[RegA] & 0xFFFF00) | (c == EOF ? 0 : c);
+    return true;
+}
+
+bool Simulator::opRMO(Simulator *sim, const Decoded &d)
+{
+    sim->setReg(d.r2, sim->getReg(d.r1));
+    return true;
+}
+
+bool Simulator::opRSUB(Simulator *sim, const Decoded &d)
+{
+    return sim->jump(d, sim->m_regs[RegL] & AddrMask);
+}
+
+bool Simulator::opSHIFTL(Simulator *sim, const Decoded &d)
+{
+    // Circular shift. The second operand holds the shift count minus 1.
+    unsigned int n = (d.r2 + 1) % 24;
+    uint32_t value = sim->getReg(d.r1);
+    sim->setReg(d.r1, (value << n) | (value >> (24 - n)));
+    return true;
+}
+
+bool Simulator::opSHIFTR(Simulator *sim, const Decoded &d)
+{
+    // Arithmetic shift, vacated bits are filled with the sign bit
+    sim->setReg(d.r1, signExtend24(sim->getReg(d.r1)) >> (d.r2 + 1));
+    return true;
+}
+
+template<unsigned int Reg>
+bool Simulator::opStore(Simulator *sim, const Decoded &d)
+{
+    sim->writeWord(sim->effectiveAddr(d), sim->m_regs[Reg]);
+    return true;
+}
+
+bool Simulator::opSTCH(Simulator *sim, const Decoded &d)
+{
+    sim->writeByte(sim->effectiveAddr(d), sim->m_regs[RegA] & 0xFF);
+    return true;
+}
+
+bool Simulator::opSTF(Simulator *sim, const Decoded &d)
+{
+    uint32_t addr = sim->effectiveAddr(d);
+    floatToBytes(sim->m_f, &sim->m_memory[addr]);
+    sim->invalidate(addr, 6);
+    return true;
+}
+
+bool Simulator::opSTSW(Simulator *sim, const Decoded &d)
+{
+    sim->writeWord(sim->effectiveAddr(d), sim->getReg(RegSW));
+    return true;
+}
+
+bool Simulator::opSUB(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[RegA] = (sim->m_regs[RegA] - sim->loadWord(d)) & WordMask;
+    return true;
+}
+
+bool Simulator::opSUBF(Simulator *sim, const Decoded &d)
+{
+    sim->m_f -= sim->loadFloat(d);
+    return true;
+}
+
+bool Simulator::opSUBR(Simulator *sim, const Decoded &d)
+{
+    sim->setReg(d.r2, sim->getReg(d.r2) - sim->getReg(d.r1));
+    return true;
+}
+
+bool Simulator::opTD(Simulator *sim, const Decoded &)
+{
+    // File backed devices are always ready
+    sim->m_cc = -1;
+    return true;
+}
+
+bool Simulator::opTIX(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[RegX] = (sim->m_regs[RegX] + 1) & WordMask;
+    sim->compare(signExtend24(sim->m_regs[RegX]),
+                 signExtend24(sim->loadWord(d)));
+    return true;
+}
+
+bool Simulator::opTIXR(Simulator *sim, const Decoded &d)
+{
+    sim->m_regs[RegX] = (sim->m_regs[RegX] + 1) & WordMask;
+    sim->compare(signExtend24(sim->m_regs[RegX]),
+                 signExtend24(sim->getReg(d.r1)));
+    return true;
+}
+
+bool Simulator::opWD(Simulator *sim, const Decoded &d)
+{
+    Device *device = sim->getDevice(sim->loadByte(d), true);
+    if (device == nullptr) {
+        return false;
+    }
+
+    std::fputc(sim->m_regs[RegA] & 0xFF, device->fp);
+    return true;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "instructions.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* SIC/XE simulator with a 1 MB memory image.
+ *
+ * Instructions are decoded once per address into a cache entry holding the
+ * handler for the opcode, the instruction length and the addressing mode.
+ * The main loop then only has to look up the entry for the program counter
+ * and call its handler. Stores invalidate the cache entries that overlap the
+ * written bytes, so self-modifying code still behaves correctly.
+ *
+ * The program stops when it jumps to its own address (ie. HALT J HALT), when
+ * it jumps to the initial value of the L register, which is the last byte of
+ * memory (RSUB or J @RETADR from the entry point), when the instruction limit
+ * is reached, or on an error. */
+class Simulator
+{
+public:
+    enum class Status
+    {
+        Halted,
+        InstructionLimit,
+        Error
+    };
+
+    static const unsigned int MemorySize;
+    static const unsigned int ReturnAddr;
+
+    Simulator();
+    ~Simulator();
+
+    Simulator(const Simulator &) = delete;
+    Simulator & operator=(const Simulator &) = delete;
+
+    bool loadObject(const std::string &path);
+
+    bool setDevice(unsigned int id, const std::string &path);
+    void setInstructionLimit(uint64_t limit);
+    void setLoadAddress(uint32_t address);
+
+    Status run();
+
+    uint64_t instructionCount() const;
+    void dumpRegisters(std::FILE *out) const;
+
+    unsigned char * memory();
+
+    const std::string & error() const;
+
+private:
+    struct Decoded;
+    typedef bool (*Handler)(Simulator *sim, const Decoded &d);
+
+    // Addressing mode of a format 3/4 instruction
+    enum AddrMode : uint8_t
+    {
+        ModeDirect   = 0,
+        ModePC       = 1,
+        ModeBase     = 2,
+        ModeIndexed  = 4,
+        ModeImmediate = 8,
+        ModeIndirect = 16
+    };
+
+    struct Decoded {
+        Handler handler;
+        // Address or displacement (sign extended for PC-relative). For format 2
+        // instructions, the register numbers.
+        int32_t operand;
+        uint8_t length;
+        uint8_t mode;
+        uint8_t r1;
+        uint8_t r2;
+    };
+
+    struct Device {
+        std::FILE *fp;
+        bool owned;
+        std::string path;
+    };
+
+    void decode(uint32_t addr, Decoded *d);
+
+    uint32_t targetAddr(const Decoded &d) const;
+    uint32_t effectiveAddr(const Decoded &d) const;
+    uint32_t loadWord(const Decoded &d) const;
+    uint32_t loadByte(const Decoded &d) const;
+    double loadFloat(const Decoded &d) const;
+
+    uint32_t readWord(uint32_t addr) const;
+    void writeWord(uint32_t addr, uint32_t value);
+    void writeByte(uint32_t addr, uint32_t value);
+    void invalidate(uint32_t addr, uint32_t size);
+
+    uint32_t getReg(unsigned int reg) const;
+    void setReg(unsigned int reg, uint32_t value);
+    bool jump(const Decoded &d, uint32_t target);
+    void compare(int32_t a, int32_t b);
+    bool fail(const std::string &msg);
+
+    Device * getDevice(unsigned int id, bool write);
+
+    static double floatFromBytes(const unsigned char *p);
+    static void floatToBytes(double value, unsigned char *p);
+
+    // Instruction handlers
+    static bool opInvalid(Simulator *sim, const Decoded &d);
+    static bool opNop(Simulator *sim, const Decoded &d);
+    static bool opADD(Simulator *sim, const Decoded &d);
+    static bool opADDF(Simulator *sim, const Decoded &d);
+    static bool opADDR(Simulator *sim, const Decoded &d);
+    static bool opAND(Simulator *sim, const Decoded &d);
+    static bool opCLEAR(Simulator *sim, const Decoded &d);
+    static bool opCOMP(Simulator *sim, const Decoded &d);
+    static bool opCOMPF(Simulator *sim, const Decoded &d);
+    static bool opCOMPR(Simulator *sim, const Decoded &d);
+    static bool opDIV(Simulator *sim, const Decoded &d);
+    static bool opDIVF(Simulator *sim, const Decoded &d);
+    static bool opDIVR(Simulator *sim, const Decoded &d);
+    static bool opFIX(Simulator *sim, const Decoded &d);
+    static bool opFLOAT(Simulator *sim, const Decoded &d);
+    static bool opJ(Simulator *sim, const Decoded &d);
+    static bool opJEQ(Simulator *sim, const Decoded &d);
+    static bool opJGT(Simulator *sim, const Decoded &d);
+    static bool opJLT(Simulator *sim, const Decoded &d);
+    static bool opJSUB(Simulator *sim, const Decoded &d);
+    template<unsigned int Reg>
+    static bool opLoad(Simulator *sim, const Decoded &d);
+    static bool opLDCH(Simulator *sim, const Decoded &d);
+    static bool opLDF(Simulator *sim, const Decoded &d);
+    static bool opMUL(Simulator *sim, const Decoded &d);
+    static bool opMULF(Simulator *sim, const Decoded &d);
+    static bool opMULR(Simulator *sim, const Decoded &d);
+    static bool opOR(Simulator *sim, const Decoded &d);
+    static bool opRD(Simulator *sim, const Decoded &d);
+    static bool opRMO(Simulator *sim, const Decoded &d);
+    static bool opRSUB(Simulator *sim, const Decoded &d);
+    static bool opSHIFTL(Simulator *sim, const Decoded &d);
+    static bool opSHIFTR(Simulator *sim, const Decoded &d);
+    template<unsigned int Reg>
+    static bool opStore(Simulator *sim, const Decoded &d);
+    static bool opSTCH(Simulator *sim, const Decoded &d);
+    static bool opSTF(Simulator *sim, const Decoded &d);
+    static bool opSTSW(Simulator *sim, const Decoded &d);
+    static bool opSUB(Simulator *sim, const Decoded &d);
+    static bool opSUBF(Simulator *sim, const Decoded &d);
+    static bool opSUBR(Simulator *sim, const Decoded &d);
+    static bool opTD(Simulator *sim, const Decoded &d);
+    static bool opTIX(Simulator *sim, const Decoded &d);
+    static bool opTIXR(Simulator *sim, const Decoded &d);
+    static bool opWD(Simulator *sim, const Decoded &d);
+
+    Instructions m_instrs;
+    Handler m_handlers[64];
+
+    std::vector<unsigned char> m_memory;
+    std::vector<Decoded> m_cache;
+
+    // A, X, L, B, S, T, F (unused, see m_f), -, PC, SW (unused, see m_cc)
+    uint32_t m_regs[10];
+    double m_f;
+    int m_cc;
+
+    uint64_t m_count;
+    uint64_t m_limit;
+
+    bool m_relocate;
+    uint32_t m_loadAddress;
+
+    Device m_devices[256];
+
+    std::string m_error;
+};
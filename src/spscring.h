@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/* Fixed size ring of slots passed from one producer thread to one consumer
+ * thread without locks. Slots are reused in place, so anything they own (ie.
+ * string buffers) is allocated once and then recycled.
+ *
+ * The producer fills the slot returned by beginPush() and publishes it with
+ * endPush(). The consumer reads the slot returned by front() and hands it
+ * back with pop(). Both return nullptr instead of blocking, and callers wait
+ * as they see fit. */
+template<typename T>
+class SpscRing
+{
+public:
+    // Capacity must be a power of 2
+    explicit SpscRing(std::size_t capacity)
+        : m_slots(capacity), m_mask(capacity - 1), m_head(0), m_tail(0)
+    {
+    }
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing & operator=(const SpscRing &) = delete;
+
+    // Only while neither thread is using the ring
+    void clear()
+    {
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+    }
+
+    T * beginPush()
+    {
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == m_slots.size()) {
+            return nullptr;
+        }
+        return &m_slots[tail & m_mask];
+    }
+
+    void endPush()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+    }
+
+    T * front()
+    {
+        std::size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &m_slots[head & m_mask];
+    }
+
+    void pop()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+    }
+
+private:
+    // Cache line size on common CPUs
+    static const std::size_t LineSize = 64;
+
+    std::vector<T> m_slots;
+    std::size_t m_mask;
+    // The consumer and producer indices are kept on separate cache lines, so
+    // that the threads do not invalidate each other's line on every update
+    char m_pad0[LineSize];
+    std::atomic<std::size_t> m_head;
+    char m_pad1[LineSize - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> m_tail;
+    char m_pad2[LineSize - sizeof(std::atomic<std::size_t>)];
+};
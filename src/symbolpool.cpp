@@ -0,0 +1,107 @@
+#include "symbolpool.h"
+
+#include <cstring>
+
+#include <algorithm>
+
+
+const uint32_t SymbolPool::None = ~0u;
+
+// Number of buckets of an empty pool. Always a power of 2.
+static const std::size_t InitialBuckets = 256;
+
+SymbolPool::SymbolPool() : m_table(InitialBuckets, 0)
+{
+}
+
+void SymbolPool::clear()
+{
+    m_arena.clear();
+    m_offsets.clear();
+    m_hashes.clear();
+    std::fill(m_table.begin(), m_table.end(), 0);
+}
+
+/* FNV-1a */
+uint32_t SymbolPool::hash(const char *str, std::size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (std::size_t i = 0; i < len; ++i) {
+        h ^= static_cast<unsigned char>(str[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool SymbolPool::equals(uint32_t id, const char *str, std::size_t len) const
+{
+    const char *name = &m_arena[m_offsets[id]];
+    return std::strncmp(name, str, len) == 0 && name[len] == '\0';
+}
+
+uint32_t SymbolPool::find(const std::string &name) const
+{
+    uint32_t h = hash(name.data(), name.size());
+    std::size_t mask = m_table.size() - 1;
+
+    for (std::size_t i = h & mask; m_table[i] != 0; i = (i + 1) & mask) {
+        uint32_t id = m_table[i] - 1;
+        if (m_hashes[id] == h && equals(id, name.data(), name.size())) {
+            return id;
+        }
+    }
+
+    return None;
+}
+
+uint32_t SymbolPool::intern(const std::string &name)
+{
+    uint32_t h = hash(name.data(), name.size());
+    std::size_t mask = m_table.size() - 1;
+
+    std::size_t i = h & mask;
+    for (; m_table[i] != 0; i = (i + 1) & mask) {
+        uint32_t id = m_table[i] - 1;
+        if (m_hashes[id] == h && equals(id, name.data(), name.size())) {
+            return id;
+        }
+    }
+
+    uint32_t id = m_offsets.size();
+    m_offsets.push_back(m_arena.size());
+    m_hashes.push_back(h);
+    m_arena.insert(m_arena.end(), name.begin(), name.end());
+    m_arena.push_back('\0');
+    m_table[i] = id + 1;
+
+    // Keep the table at most half full
+    if (2 * m_offsets.size() > m_table.size()) {
+        rehash(2 * m_table.size());
+    }
+
+    return id;
+}
+
+void SymbolPool::rehash(std::size_t buckets)
+{
+    m_table.assign(buckets, 0);
+    std::size_t mask = buckets - 1;
+
+    for (uint32_t id = 0; id < m_offsets.size(); ++id) {
+        std::size_t i = m_hashes[id] & mask;
+        while (m_table[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        m_table[i] = id + 1;
+    }
+}
+
+const char * SymbolPool::name(uint32_t id) const
+{
+    return &m_arena[m_offsets[id]];
+}
+
+uint32_t SymbolPool::size() const
+{
+    return m_offsets.size();
+}
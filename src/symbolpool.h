@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Interns symbol names as 32-bit IDs. All names are stored back to back in
+ * one character arena, so each distinct name is kept once no matter how often
+ * it is referenced, and comparing two symbols is an integer compare.
+ *
+ * IDs are assigned in order starting at 0, which makes them usable as indices
+ * into per-section tables. Lookups with find() do not modify the pool and can
+ * run concurrently, interning cannot. */
+class SymbolPool
+{
+public:
+    static const uint32_t None;
+
+    SymbolPool();
+
+    // Forget all names but keep the allocated memory
+    void clear();
+
+    uint32_t intern(const std::string &name);
+    uint32_t find(const std::string &name) const;
+
+    // Valid until the next call to intern()
+    const char * name(uint32_t id) const;
+
+    uint32_t size() const;
+
+private:
+    static uint32_t hash(const char *str, std::size_t len);
+
+    bool equals(uint32_t id, const char *str, std::size_t len) const;
+    void rehash(std::size_t buckets);
+
+    std::vector<char> m_arena;
+    // Start of each name in the arena. Names are NUL terminated.
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint32_t> m_hashes;
+    // Open addressing hash table of ID + 1, 0 for empty buckets
+    std::vector<uint32_t> m_table;
+};
@@ -0,0 +1,201 @@
+#include "watcher.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+
+// Time without new events before the changed files are assembled
+static const int DebounceMs = 50;
+
+// Writing or renaming a file over a watched name
+static const uint32_t WatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+
+Watcher::Watcher() : m_fd(-1)
+{
+}
+
+Watcher::~Watcher()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+void Watcher::setOptions(const Assembler::Options &options)
+{
+    m_assembler.setOptions(options);
+}
+
+const std::string & Watcher::error() const
+{
+    return m_error;
+}
+
+bool Watcher::addFile(const std::string &path)
+{
+    if (m_fd < 0) {
+        m_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (m_fd < 0) {
+            m_error = std::string("inotify: ") + std::strerror(errno);
+            return false;
+        }
+    }
+
+    for (auto const &file : m_files) {
+        if (file.path == path) {
+            return true;
+        }
+    }
+
+    m_files.push_back({ path, true });
+    return watchPath(path, m_files.size() - 1);
+}
+
+/* Assemble a file when the file at the path changes */
+bool Watcher::watchPath(const std::string &path, std::size_t file)
+{
+    std::string dir = ".";
+    std::string name = path;
+    std::size_t slash = path.rfind('/');
+    if (slash != std::string::npos) {
+        dir = slash == 0 ? "/" : path.substr(0, slash);
+        name = path.substr(slash + 1);
+    }
+
+    if (name.empty()) {
+        m_error = path + ": Not a file";
+        return false;
+    }
+
+    // Watching the same directory again returns the same descriptor
+    int wd = inotify_add_watch(m_fd, dir.c_str(), WatchMask);
+    if (wd < 0) {
+        m_error = dir + ": " + std::strerror(errno);
+        return false;
+    }
+
+    auto &files = m_watches[wd][name];
+    if (std::find(files.begin(), files.end(), file) == files.end()) {
+        files.push_back(file);
+    }
+
+    return true;
+}
+
+bool Watcher::run()
+{
+    for (auto &file : m_files) {
+        assemble(&file);
+    }
+
+    std::fprintf(stderr, "Watching %zu file%s for changes\n",
+                 m_files.size(), m_files.size() == 1 ? "" : "s");
+
+    for (;;) {
+        // Block until the first event, then keep collecting events until
+        // the files have been quiet for a moment. Saving a file often causes
+        // several events in a row.
+        int timeout = -1;
+        for (;;) {
+            struct pollfd pfd = { m_fd, POLLIN, 0 };
+            int ret = poll(&pfd, 1, timeout);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                m_error = std::string("poll: ") + std::strerror(errno);
+                return false;
+            } else if (ret == 0) {
+                break;
+            }
+
+            if (!readEvents()) {
+                return false;
+            }
+
+            bool dirty = false;
+            for (auto const &file : m_files) {
+                dirty = dirty || file.dirty;
+            }
+            if (dirty) {
+                timeout = DebounceMs;
+            }
+        }
+
+        for (auto &file : m_files) {
+            if (file.dirty) {
+                assemble(&file);
+            }
+        }
+    }
+}
+
+/* Mark the files named in pending inotify events as changed */
+bool Watcher::readEvents()
+{
+    alignas(struct inotify_event) char buf[4096];
+
+    for (;;) {
+        ssize_t len = read(m_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EAGAIN) {
+                return true;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            m_error = std::string("inotify: ") + std::strerror(errno);
+            return false;
+        }
+
+        for (char *p = buf; p < buf + len; ) {
+            auto *event = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            auto watch = m_watches.find(event->wd);
+            if (watch == m_watches.end() || event->len == 0) {
+                continue;
+            }
+
+            auto it = watch->second.find(event->name);
+            if (it != watch->second.end()) {
+                for (std::size_t file : it->second) {
+                    m_files[file].dirty = true;
+                }
+            }
+        }
+    }
+}
+
+void Watcher::assemble(File *file)
+{
+    file->dirty = false;
+
+    auto begin = std::chrono::steady_clock::now();
+
+    // A file that is being replaced may briefly not exist. The next event
+    // for it triggers another attempt.
+    bool ok = m_assembler.assembleFile(file->path);
+
+    std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - begin;
+
+    std::fprintf(stderr, "%s: %s (%.1f ms)\n", file->path.c_str(),
+                 ok ? "assembled" : "failed", elapsed.count());
+
+    // Includes may have been added since the last run. Watches of includes
+    // that were removed stay, which at worst reassembles the file once more.
+    auto const &sources = m_assembler.sourceFiles();
+    for (std::size_t i = 1; i < sources.size(); ++i) {
+        if (!watchPath(sources[i], file - m_files.data())) {
+            std::fprintf(stderr, "warning: %s\n", m_error.c_str());
+        }
+    }
+}
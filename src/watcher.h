@@ -0,0 +1,54 @@
+#pragma once
+
+#include "assembler.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Reassembles source files whenever they change.
+ *
+ * The directories of the files are watched with inotify rather than the files
+ * themselves, so that editors which save by writing a temporary file and
+ * renaming it over the original are noticed as well. Events are collected
+ * until no new event arrives for a short time, and each changed file is then
+ * assembled once. Files pulled in with INCLUDE are watched as well, and a
+ * change to one of them reassembles every file that includes it. */
+class Watcher
+{
+public:
+    Watcher();
+    ~Watcher();
+
+    Watcher(const Watcher &) = delete;
+    Watcher & operator=(const Watcher &) = delete;
+
+    void setOptions(const Assembler::Options &options);
+
+    bool addFile(const std::string &path);
+
+    // Does not return unless watching fails
+    bool run();
+
+    const std::string & error() const;
+
+private:
+    struct File {
+        std::string path;
+        bool dirty;
+    };
+
+    bool watchPath(const std::string &path, std::size_t file);
+    bool readEvents();
+    void assemble(File *file);
+
+    // One assembler for all files, reset between runs
+    Assembler m_assembler;
+    int m_fd;
+    std::vector<File> m_files;
+    // Directory watch descriptor -> (file name -> indices into m_files of
+    // the files that are assembled when it changes)
+    std::unordered_map<int,
+            std::unordered_map<std::string, std::vector<std::size_t>>> m_watches;
+    std::string m_error;
+};